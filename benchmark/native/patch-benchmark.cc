@@ -0,0 +1,881 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <thread>
+#include "catch.hpp"
+#include "patch.h"
+#include "point.h"
+
+using namespace std::chrono;
+using std::vector;
+
+// Tracks the heap memory in use, so that benchmarks can report how much of it
+// a patch holds onto. Each block is prefixed with its size. The counters are
+// atomic because the multithreaded benchmarks allocate from worker threads.
+static std::atomic<size_t> live_allocation_count{0};
+static std::atomic<size_t> live_allocation_size{0};
+
+void *operator new(size_t size) {
+  size_t *block = static_cast<size_t *>(malloc(size + alignof(max_align_t)));
+  if (!block) throw std::bad_alloc();
+  *block = size;
+  live_allocation_count.fetch_add(1, std::memory_order_relaxed);
+  live_allocation_size.fetch_add(size, std::memory_order_relaxed);
+  return reinterpret_cast<char *>(block) + alignof(max_align_t);
+}
+
+void operator delete(void *pointer) noexcept {
+  if (!pointer) return;
+  size_t *block = reinterpret_cast<size_t *>(static_cast<char *>(pointer) - alignof(max_align_t));
+  live_allocation_count.fetch_sub(1, std::memory_order_relaxed);
+  live_allocation_size.fetch_sub(*block, std::memory_order_relaxed);
+  free(block);
+}
+
+struct Splice {
+  Point start;
+  Point deletion_extent;
+  Point insertion_extent;
+};
+
+static Splice get_random_splice() {
+  Point start(rand() % 20000, rand() % 100);
+  Point deletion_extent(0, rand() % 5);
+  Point insertion_extent(rand() % 10 < 2 ? 1 : 0, rand() % 5);
+  return Splice{start, deletion_extent, insertion_extent};
+}
+
+static std::unique_ptr<Text> get_random_text(Point extent) {
+  std::unique_ptr<Text> text{new Text()};
+  for (unsigned row = 0; row < extent.row; row++) {
+    text->push_back('a' + rand() % 26);
+    text->push_back('\n');
+  }
+  for (unsigned column = 0; column < extent.column; column++) {
+    text->push_back('a' + rand() % 26);
+  }
+  return text;
+}
+
+TEST_CASE("Patch::splice and ~Patch") {
+  srand(0);
+  uint count = 100000;
+
+  vector<Splice> splices;
+  for (uint i = 0; i < count; i++) {
+    splices.push_back(get_random_splice());
+  }
+
+  SECTION("without text") {
+    Patch *patch = new Patch();
+
+    auto start = steady_clock::now();
+    for (const Splice &splice : splices) {
+      patch->splice(splice.start, splice.deletion_extent, splice.insertion_extent);
+    }
+    auto end = steady_clock::now();
+    auto splice_time = duration_cast<microseconds>(end - start).count();
+    size_t hunk_count = patch->get_hunk_count();
+
+    start = steady_clock::now();
+    delete patch;
+    end = steady_clock::now();
+    auto destroy_time = duration_cast<microseconds>(end - start).count();
+
+    std::cout << "Splicing " << count << " times without text: " << splice_time << "us ("
+              << (count * 1000 / (splice_time ? splice_time : 1)) << " splices/ms), "
+              << "destroying " << hunk_count << " hunks: " << destroy_time << "us\n";
+  }
+
+  SECTION("with text") {
+    vector<std::unique_ptr<Text>> deleted_texts, inserted_texts;
+    for (const Splice &splice : splices) {
+      deleted_texts.push_back(get_random_text(splice.deletion_extent));
+      inserted_texts.push_back(get_random_text(splice.insertion_extent));
+    }
+
+    Patch *patch = new Patch();
+
+    auto start = steady_clock::now();
+    for (uint i = 0; i < count; i++) {
+      patch->splice(splices[i].start, splices[i].deletion_extent, splices[i].insertion_extent,
+                    move(deleted_texts[i]), move(inserted_texts[i]));
+    }
+    auto end = steady_clock::now();
+    auto splice_time = duration_cast<microseconds>(end - start).count();
+    size_t hunk_count = patch->get_hunk_count();
+
+    start = steady_clock::now();
+    delete patch;
+    end = steady_clock::now();
+    auto destroy_time = duration_cast<microseconds>(end - start).count();
+
+    std::cout << "Splicing " << count << " times with text: " << splice_time << "us ("
+              << (count * 1000 / (splice_time ? splice_time : 1)) << " splices/ms), "
+              << "destroying " << hunk_count << " hunks: " << destroy_time << "us\n";
+  }
+}
+
+TEST_CASE("Patch deserialization") {
+  srand(0);
+  uint count = 100000;
+
+  Patch patch;
+  for (uint i = 0; i < count; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                 get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+  }
+
+  vector<uint8_t> serialization_vector;
+  patch.serialize(&serialization_vector);
+
+  auto start = steady_clock::now();
+  {
+    Patch deserialized_patch(serialization_vector);
+  }
+  auto end = steady_clock::now();
+  std::cout << "Deserializing " << patch.get_hunk_count() << " hunks: "
+            << duration_cast<microseconds>(end - start).count() << "us\n";
+
+  start = steady_clock::now();
+  {
+    Patch patch_view = Patch::view(serialization_vector.data(), serialization_vector.size());
+  }
+  end = steady_clock::now();
+  std::cout << "Viewing " << patch.get_hunk_count() << " hunks: "
+            << duration_cast<microseconds>(end - start).count() << "us\n";
+}
+
+TEST_CASE("Patch serialization formats") {
+  srand(0);
+  uint count = 100000;
+
+  Patch patch;
+  for (uint i = 0; i < count; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                 get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+  }
+
+  for (uint32_t version : {1, 2}) {
+    vector<uint8_t> serialization_vector;
+
+    auto start = steady_clock::now();
+    patch.serialize(&serialization_vector, version);
+    auto end = steady_clock::now();
+    auto encode_time = duration_cast<microseconds>(end - start).count();
+
+    start = steady_clock::now();
+    Patch deserialized_patch(serialization_vector);
+    end = steady_clock::now();
+    auto decode_time = duration_cast<microseconds>(end - start).count();
+    REQUIRE(deserialized_patch.get_hunk_count() == patch.get_hunk_count());
+
+    std::cout << "Version " << version << " serialization of " << patch.get_hunk_count() << " hunks: "
+              << serialization_vector.size() << " bytes ("
+              << (double)serialization_vector.size() / patch.get_hunk_count() << " per hunk), "
+              << "encode " << encode_time << "us, decode " << decode_time << "us\n";
+  }
+}
+
+TEST_CASE("Patch const queries across threads") {
+  srand(0);
+  uint count = 100000;
+
+  Patch patch;
+  for (uint i = 0; i < count; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent);
+  }
+
+  uint query_count = 1000000;
+  vector<Point> positions;
+  for (uint i = 0; i < query_count; i++) {
+    positions.push_back(Point(rand() % 20000, rand() % 100));
+  }
+
+  auto start = steady_clock::now();
+  for (const Point &position : positions) {
+    patch.hunk_for_new_position(position);
+  }
+  auto end = steady_clock::now();
+  std::cout << "Splaying " << query_count << " position queries: "
+            << duration_cast<microseconds>(end - start).count() << "us\n";
+
+  // Without splaying, lookups cost whatever depth the tree was left with.
+  patch.rebalance();
+
+  const Patch &const_patch = patch;
+  for (uint thread_count : {1, 2, 4, 8}) {
+    vector<std::thread> threads;
+    start = steady_clock::now();
+    for (uint t = 0; t < thread_count; t++) {
+      threads.push_back(std::thread([&, t]() {
+        for (uint i = t; i < query_count; i += thread_count) {
+          const_patch.hunk_for_new_position(positions[i]);
+        }
+      }));
+    }
+    for (std::thread &thread : threads) thread.join();
+    end = steady_clock::now();
+    std::cout << "Non-splaying " << query_count << " position queries on " << thread_count << " threads: "
+              << duration_cast<microseconds>(end - start).count() << "us\n";
+  }
+}
+
+TEST_CASE("Patch hunk cursor") {
+  srand(0);
+  uint count = 100000;
+
+  Patch patch;
+  for (uint i = 0; i < count; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent);
+  }
+  const Patch &const_patch = patch;
+
+  auto start = steady_clock::now();
+  size_t hunk_count = const_patch.get_hunks().size();
+  auto end = steady_clock::now();
+  std::cout << "Materializing " << hunk_count << " hunks: "
+            << duration_cast<microseconds>(end - start).count() << "us\n";
+
+  start = steady_clock::now();
+  hunk_count = 0;
+  for (Patch::HunkCursor cursor = const_patch.get_hunk_cursor(); cursor; cursor.next()) {
+    hunk_count++;
+  }
+  end = steady_clock::now();
+  std::cout << "Walking " << hunk_count << " hunks with a cursor: "
+            << duration_cast<microseconds>(end - start).count() << "us\n";
+
+  uint viewport_count = 10000;
+  vector<Point> viewport_starts;
+  for (uint i = 0; i < viewport_count; i++) {
+    viewport_starts.push_back(Point(rand() % 20000, 0));
+  }
+
+  start = steady_clock::now();
+  for (const Point &viewport_start : viewport_starts) {
+    const_patch.get_hunks_in_new_range(viewport_start, viewport_start.traverse(Point(50, 0)));
+  }
+  end = steady_clock::now();
+  std::cout << "Querying " << viewport_count << " 50-row viewports: "
+            << duration_cast<microseconds>(end - start).count() << "us\n";
+
+  start = steady_clock::now();
+  Patch::HunkCursor cursor = const_patch.get_hunk_cursor();
+  for (const Point &viewport_start : viewport_starts) {
+    Point viewport_end = viewport_start.traverse(Point(50, 0));
+    for (cursor.seek_to_new_position(viewport_start); cursor && cursor->new_start < viewport_end; cursor.next()) {}
+  }
+  end = steady_clock::now();
+  std::cout << "Walking " << viewport_count << " 50-row viewports with a cursor: "
+            << duration_cast<microseconds>(end - start).count() << "us\n";
+}
+
+TEST_CASE("Patch::splice_batch") {
+  srand(0);
+  uint count = 10000;
+
+  Patch patch;
+  for (uint i = 0; i < count; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                 get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+  }
+
+  vector<Splice> replacements;
+  for (uint row = 0; row < 20000; row += 2) {
+    replacements.push_back(Splice{Point(row, rand() % 100), Point(0, 3), Point(0, 4)});
+  }
+
+  for (bool with_text : {false, true}) {
+    Patch sequentially_spliced_patch = patch.copy();
+    auto start = steady_clock::now();
+    for (auto replacement = replacements.rbegin(); replacement != replacements.rend(); ++replacement) {
+      sequentially_spliced_patch.splice(
+        replacement->start, replacement->deletion_extent, replacement->insertion_extent,
+        with_text ? get_random_text(replacement->deletion_extent) : nullptr,
+        with_text ? get_random_text(replacement->insertion_extent) : nullptr);
+    }
+    auto end = steady_clock::now();
+    std::cout << "Splicing " << replacements.size() << " replacements " << (with_text ? "with" : "without")
+              << " text one at a time: " << duration_cast<microseconds>(end - start).count() << "us\n";
+
+    Patch batch_spliced_patch = patch.copy();
+    vector<Patch::Splice> splices;
+    for (const Splice &replacement : replacements) {
+      splices.push_back(Patch::Splice{
+        replacement.start, replacement.deletion_extent, replacement.insertion_extent,
+        with_text ? get_random_text(replacement.deletion_extent) : nullptr,
+        with_text ? get_random_text(replacement.insertion_extent) : nullptr});
+    }
+    start = steady_clock::now();
+    batch_spliced_patch.splice_batch(move(splices));
+    end = steady_clock::now();
+    std::cout << "Splicing " << replacements.size() << " replacements " << (with_text ? "with" : "without")
+              << " text as a batch: " << duration_cast<microseconds>(end - start).count() << "us\n";
+
+    REQUIRE(batch_spliced_patch.get_hunk_count() == sequentially_spliced_patch.get_hunk_count());
+  }
+}
+
+TEST_CASE("Patch composition") {
+  srand(0);
+
+  auto get_random_patch = [](uint count) {
+    Patch patch;
+    for (uint i = 0; i < count; i++) {
+      Splice splice = get_random_splice();
+      patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                   get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+    }
+    return patch;
+  };
+
+  // Composes patches the way Patch's constructor used to, by splicing each
+  // hunk in one at a time.
+  auto compose_one_at_a_time = [](const vector<const Patch *> &patches) {
+    Patch result;
+    for (const Patch *patch : patches) {
+      auto hunks = patch->get_hunks();
+      for (auto hunk = hunks.rbegin(); hunk != hunks.rend(); ++hunk) {
+        result.splice(hunk->old_start, hunk->old_end.traversal(hunk->old_start),
+                      hunk->new_end.traversal(hunk->new_start),
+                      std::unique_ptr<Text>{new Text(hunk->old_text)},
+                      std::unique_ptr<Text>{new Text(hunk->new_text)});
+      }
+    }
+    return result;
+  };
+
+  vector<Patch> large_patches;
+  large_patches.push_back(get_random_patch(20000));
+  large_patches.push_back(get_random_patch(20000));
+
+  vector<Patch> small_patches;
+  small_patches.push_back(get_random_patch(20000));
+  for (uint i = 0; i < 200; i++) {
+    small_patches.push_back(get_random_patch(10));
+  }
+
+  for (vector<Patch> *patches : {&large_patches, &small_patches}) {
+    vector<const Patch *> patches_to_compose;
+    for (const Patch &patch : *patches) patches_to_compose.push_back(&patch);
+
+    auto start = steady_clock::now();
+    Patch spliced_patch = compose_one_at_a_time(patches_to_compose);
+    auto end = steady_clock::now();
+    std::cout << "Composing " << patches->size() << " patches one hunk at a time: "
+              << duration_cast<microseconds>(end - start).count() << "us\n";
+
+    start = steady_clock::now();
+    Patch composed_patch(patches_to_compose);
+    end = steady_clock::now();
+    std::cout << "Composing " << patches->size() << " patches by merging: "
+              << duration_cast<microseconds>(end - start).count() << "us\n";
+
+    REQUIRE(composed_patch.get_hunk_count() == spliced_patch.get_hunk_count());
+  }
+}
+
+TEST_CASE("Patch composition across threads") {
+  srand(0);
+  uint count = 256;
+
+  vector<Patch> patches;
+  for (uint i = 0; i < count; i++) {
+    patches.emplace_back();
+    for (uint j = 0; j < 1000; j++) {
+      Splice splice = get_random_splice();
+      patches.back().splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                            get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+    }
+  }
+
+  vector<const Patch *> patches_to_compose;
+  for (const Patch &patch : patches) patches_to_compose.push_back(&patch);
+
+  auto start = steady_clock::now();
+  Patch sequentially_composed_patch(patches_to_compose);
+  auto end = steady_clock::now();
+  std::cout << "Composing " << count << " patches from left to right: "
+            << duration_cast<milliseconds>(end - start).count() << "ms\n";
+
+  for (unsigned thread_count : {1, 2, 4, 8}) {
+    start = steady_clock::now();
+    Patch composed_patch(patches_to_compose, thread_count);
+    end = steady_clock::now();
+    std::cout << "Composing " << count << " patches in pairs on " << thread_count << " threads: "
+              << duration_cast<milliseconds>(end - start).count() << "ms\n";
+    REQUIRE(composed_patch.get_hunk_count() == sequentially_composed_patch.get_hunk_count());
+  }
+}
+
+TEST_CASE("Patch::copy and Patch::invert") {
+  srand(0);
+  uint count = 100000;
+
+  Patch patch;
+  size_t text_size = 0;
+  for (uint i = 0; i < count; i++) {
+    Splice splice = get_random_splice();
+    Point insertion_extent(splice.insertion_extent.row, splice.insertion_extent.column + 100);
+    std::unique_ptr<Text> deleted_text = get_random_text(splice.deletion_extent);
+    std::unique_ptr<Text> inserted_text = get_random_text(insertion_extent);
+    text_size += deleted_text->size() + inserted_text->size();
+    patch.splice(splice.start, splice.deletion_extent, insertion_extent,
+                 move(deleted_text), move(inserted_text));
+  }
+
+  auto start = steady_clock::now();
+  Patch patch_copy = patch.copy();
+  auto end = steady_clock::now();
+  std::cout << "Copying " << patch.get_hunk_count() << " hunks with " << text_size * 2 / 1024
+            << "KB of recorded text: " << duration_cast<microseconds>(end - start).count() << "us\n";
+
+  start = steady_clock::now();
+  Patch inverted_patch = patch.invert();
+  end = steady_clock::now();
+  std::cout << "Inverting " << patch.get_hunk_count() << " hunks with " << text_size * 2 / 1024
+            << "KB of recorded text: " << duration_cast<microseconds>(end - start).count() << "us\n";
+
+  REQUIRE(patch_copy.get_hunk_count() == patch.get_hunk_count());
+  REQUIRE(inverted_patch.get_hunk_count() == patch.get_hunk_count());
+}
+
+TEST_CASE("Patch snapshots at undo checkpoints") {
+  srand(0);
+  uint count = 30000, checkpoint_count = 1000, splices_per_checkpoint = 10;
+
+  vector<Splice> splices;
+  for (uint i = 0; i < count + checkpoint_count * splices_per_checkpoint; i++) {
+    splices.push_back(get_random_splice());
+  }
+
+  for (bool takes_snapshots : {false, true}) {
+    Patch edited_patch;
+    for (uint i = 0; i < count; i++) {
+      const Splice &splice = splices[i];
+      edited_patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                          get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+    }
+
+    vector<Patch> snapshots;
+    auto start = steady_clock::now();
+    for (uint i = count; i < splices.size(); i++) {
+      if (takes_snapshots && i % splices_per_checkpoint == 0) snapshots.push_back(edited_patch.copy());
+      const Splice &splice = splices[i];
+      edited_patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                          get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+    }
+    auto end = steady_clock::now();
+    std::cout << "Splicing " << splices.size() - count << " times after " << count << " splices"
+              << (takes_snapshots ? " with a snapshot every " : " without snapshots")
+              << (takes_snapshots ? std::to_string(splices_per_checkpoint) + " splices" : "")
+              << ": " << duration_cast<milliseconds>(end - start).count() << "ms\n";
+
+    start = steady_clock::now();
+    snapshots.clear();
+    end = steady_clock::now();
+    if (takes_snapshots) {
+      std::cout << "Destroying " << checkpoint_count << " snapshots: "
+                << duration_cast<milliseconds>(end - start).count() << "ms\n";
+    }
+  }
+}
+
+TEST_CASE("Patch text memory") {
+  srand(0);
+  uint count = 100000;
+
+  size_t initial_allocation_count = live_allocation_count;
+  size_t initial_allocation_size = live_allocation_size;
+  Patch patch;
+  for (uint i = 0; i < count; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                 get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+  }
+
+  size_t text_size = 0;
+  for (const Patch::Hunk &hunk : patch.get_hunks()) {
+    text_size += hunk.old_text.size() + hunk.new_text.size();
+  }
+
+  std::cout << "Holding " << patch.get_hunk_count() << " hunks with " << text_size * 2 / 1024
+            << "KB of text after " << count << " splices: "
+            << (live_allocation_size - initial_allocation_size) / 1024 << "KB in "
+            << live_allocation_count - initial_allocation_count << " heap allocations\n";
+
+  REQUIRE(patch.get_hunk_count() > 0);
+}
+
+TEST_CASE("Patch splicing within a long hunk") {
+  srand(0);
+  uint line_count = 20000, splice_count = 2000;
+
+  std::unique_ptr<Text> pasted_text{new Text()};
+  for (uint row = 0; row < line_count; row++) {
+    for (uint column = 0; column < 40; column++) pasted_text->push_back('a' + rand() % 26);
+    pasted_text->push_back('\n');
+  }
+
+  Patch patch;
+  patch.splice(Point(), Point(), Point(line_count, 0), std::unique_ptr<Text>{new Text()}, move(pasted_text));
+
+  auto start = steady_clock::now();
+  for (uint i = 0; i < splice_count; i++) {
+    Point position(line_count / 2 + i / 40, i % 40);
+    patch.splice(position, Point(0, 1), Point(0, 1), get_random_text(Point(0, 1)), get_random_text(Point(0, 1)));
+  }
+  auto end = steady_clock::now();
+  std::cout << "Typing " << splice_count << " characters within a hunk of " << line_count
+            << " lines: " << duration_cast<milliseconds>(end - start).count() << "ms\n";
+
+  REQUIRE(patch.get_hunk_count() == 1);
+}
+
+TEST_CASE("Patch query latency after sequential edits") {
+  srand(0);
+  uint edit_count = 100000, query_interval = 100;
+
+  for (float max_depth_factor : {0.0f, 4.0f}) {
+    Patch patch;
+    patch.set_max_depth_factor(max_depth_factor);
+    const Patch &const_patch = patch;
+
+    // Edit one line after another, as when replacing through a document, and
+    // look up random earlier edits in between.
+    vector<uint64_t> query_times;
+    auto start = steady_clock::now();
+    for (uint i = 0; i < edit_count; i++) {
+      patch.splice(Point(i, 0), Point(0, 1), Point(0, 2));
+      if (i % query_interval == query_interval - 1) {
+        auto query_start = steady_clock::now();
+        const_patch.hunk_for_new_position(Point(rand() % (i + 1), 0));
+        query_times.push_back(duration_cast<microseconds>(steady_clock::now() - query_start).count());
+      }
+    }
+    auto end = steady_clock::now();
+
+    std::sort(query_times.begin(), query_times.end());
+    std::cout << "Editing " << edit_count << " lines with " << query_times.size() << " queries, "
+              << (max_depth_factor > 0 ? "with" : "without") << " automatic rebalancing: "
+              << duration_cast<milliseconds>(end - start).count() << "ms, median query "
+              << query_times[query_times.size() / 2] << "us, slowest query "
+              << query_times.back() << "us\n";
+
+    REQUIRE(patch.get_hunk_count() == edit_count);
+  }
+}
+
+TEST_CASE("Patch::apply") {
+  srand(0);
+  uint line_count = 200000, hunk_count = 20000;
+
+  Text old_text;
+  for (uint row = 0; row < line_count; row++) {
+    for (uint column = 0; column < 40; column++) old_text.push_back('a' + rand() % 26);
+    old_text.push_back('\n');
+  }
+
+  // Replace a few characters on every tenth line.
+  vector<Text> texts;
+  texts.reserve(hunk_count * 2);
+  vector<Patch::Hunk> hunks;
+  for (uint i = 0; i < hunk_count; i++) {
+    Point old_start(i * (line_count / hunk_count), rand() % 30);
+    size_t start_index = old_start.row * 41 + old_start.column;
+    texts.push_back(Text(old_text.begin() + start_index, old_text.begin() + start_index + 5));
+    texts.push_back(*get_random_text(Point(0, 3)));
+    Point new_start(old_start.row, old_start.column);
+    hunks.push_back(Patch::Hunk{
+      old_start, Point(old_start.row, old_start.column + 5),
+      new_start, Point(new_start.row, new_start.column + 3),
+      TextView(&texts[texts.size() - 2]), TextView(&texts.back())
+    });
+  }
+  Patch patch = Patch::from_hunks(hunks);
+
+  auto start = steady_clock::now();
+  optional<Text> new_text = patch.apply(old_text);
+  auto apply_time = duration_cast<microseconds>(steady_clock::now() - start).count();
+  REQUIRE(new_text);
+
+  // Concatenating the texts between hunks, as callers had to before, with the
+  // old text's line starts computed up front to map positions to indices.
+  start = steady_clock::now();
+  Text concatenated_text;
+  size_t old_index = 0;
+  vector<uint32_t> line_starts = TextSlice::get_line_starts(TextView(&old_text));
+  TextSlice old_slice{TextView(&old_text), line_starts};
+  for (const Patch::Hunk &hunk : patch.get_hunks()) {
+    size_t hunk_start = old_slice.character_index_for_position(hunk.old_start);
+    concatenated_text.insert(concatenated_text.end(), old_text.begin() + old_index, old_text.begin() + hunk_start);
+    concatenated_text.insert(concatenated_text.end(), hunk.new_text.begin(), hunk.new_text.end());
+    old_index = old_slice.character_index_for_position(hunk.old_end);
+  }
+  concatenated_text.insert(concatenated_text.end(), old_text.begin() + old_index, old_text.end());
+  auto concatenate_time = duration_cast<microseconds>(steady_clock::now() - start).count();
+  REQUIRE(concatenated_text == *new_text);
+
+  start = steady_clock::now();
+  optional<Text> inverted_text = patch.apply_inverse(*new_text);
+  auto apply_inverse_time = duration_cast<microseconds>(steady_clock::now() - start).count();
+  REQUIRE(*inverted_text == old_text);
+
+  std::cout << "Applying " << hunk_count << " hunks to " << line_count << " lines:\n" <<
+    "  apply: " << apply_time << "us\n" <<
+    "  apply_inverse: " << apply_inverse_time << "us\n" <<
+    "  concatenating the text between hunks: " << concatenate_time << "us\n";
+}
+
+TEST_CASE("Patch::coalesce") {
+  srand(0);
+  uint line_count = 20000, splice_count = 50000;
+
+  // Scattered single-character replacements on every tenth line, as left by a
+  // long session of small fixes.
+  Text new_text;
+  for (uint row = 0; row < line_count; row++) {
+    for (uint column = 0; column < 80; column++) new_text.push_back('a' + rand() % 26);
+    new_text.push_back('\n');
+  }
+
+  Patch patch;
+  for (uint i = 0; i < splice_count; i++) {
+    Point start(rand() % (line_count / 10) * 10, rand() % 80);
+    std::unique_ptr<Text> inserted_text = get_random_text(Point(0, 1));
+    std::unique_ptr<Text> deleted_text{new Text{new_text[start.row * 81 + start.column]}};
+    new_text[start.row * 81 + start.column] = (*inserted_text)[0];
+    patch.splice(start, Point(0, 1), Point(0, 1), move(deleted_text), move(inserted_text));
+  }
+
+  for (Point max_distance : {Point(0, 4), Point(0, 16), Point(1, 0)}) {
+    Patch coalesced_patch = patch.copy();
+    auto start = steady_clock::now();
+    REQUIRE(coalesced_patch.coalesce(max_distance, new_text));
+    auto time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+    vector<uint8_t> serialization, coalesced_serialization;
+    patch.serialize(&serialization);
+    coalesced_patch.serialize(&coalesced_serialization);
+    std::cout << "Coalescing " << patch.get_hunk_count() << " hunks closer than " << max_distance <<
+      " in " << time << "ms: " << coalesced_patch.get_hunk_count() << " hunks, " <<
+      serialization.size() / 1024 << "KB serialized before, " <<
+      coalesced_serialization.size() / 1024 << "KB after\n";
+  }
+}
+
+TEST_CASE("Patch::transform") {
+  srand(0);
+
+  // Two collaborators each make a long stream of edits to the same document.
+  for (uint splice_count : {1000, 10000, 50000}) {
+    Patch a, b;
+    for (Patch *patch : {&a, &b}) {
+      for (uint i = 0; i < splice_count; i++) {
+        Splice splice = get_random_splice();
+        patch->splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                      nullptr, get_random_text(splice.insertion_extent));
+      }
+    }
+
+    auto start = steady_clock::now();
+    Patch transformed_b = Patch::transform(a, b);
+    auto transform_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+    // Copying out both patches' hunks, which is where transforming them by
+    // hand had to start.
+    start = steady_clock::now();
+    vector<Patch::Hunk> a_hunks = a.get_hunks(), b_hunks = b.get_hunks();
+    auto get_hunks_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+    REQUIRE(a_hunks.size() + b_hunks.size() == a.get_hunk_count() + b.get_hunk_count());
+
+    std::cout << "Transforming " << b.get_hunk_count() << " hunks against " << a.get_hunk_count() <<
+      " hunks: " << transform_time << "ms, " << transformed_b.get_hunk_count() << " hunks" <<
+      " (getting both patches' hunks: " << get_hunks_time << "ms)\n";
+  }
+}
+
+TEST_CASE("Patch::translate_old_positions") {
+  srand(0);
+  Patch patch;
+  for (uint i = 0; i < 50000; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent);
+  }
+
+  // Diagnostics spread over the whole document.
+  vector<Point> positions;
+  for (uint i = 0; i < 1000000; i++) positions.push_back(Point(rand() % 20000, rand() % 100));
+  std::sort(positions.begin(), positions.end());
+
+  auto start = steady_clock::now();
+  vector<Point> translated_positions = patch.translate_old_positions(positions, Patch::ClipMode::Backward);
+  auto batch_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+  // Looking up the hunk before each position, which is the first step of
+  // translating positions one at a time.
+  start = steady_clock::now();
+  size_t found_count = 0;
+  for (Point position : positions) {
+    if (patch.hunk_for_old_position(position)) found_count++;
+  }
+  auto lookup_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+  REQUIRE(translated_positions.size() == positions.size());
+  REQUIRE(found_count > 0);
+
+  std::cout << "Translating " << positions.size() << " positions through " << patch.get_hunk_count() <<
+    " hunks: " << batch_time << "ms (looking up each one's hunk: " << lookup_time << "ms)\n";
+}
+
+TEST_CASE("Patch::get_change_statistics_in_new_range") {
+  srand(0);
+  Patch patch;
+  for (uint i = 0; i < 50000; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent);
+  }
+  const Patch &const_patch = patch;
+
+  // Gutter updates, each counting the rows changed before a visible row.
+  vector<Point> ends;
+  for (uint i = 0; i < 2000; i++) ends.push_back(Point(rand() % 20000, 0));
+
+  auto start = steady_clock::now();
+  size_t total_row_count = 0;
+  for (Point end : ends) {
+    total_row_count += const_patch.get_change_statistics_in_new_range(Point(), end).new_changed_row_count;
+  }
+  auto statistics_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+  // Summing up the hunks in the same ranges.
+  start = steady_clock::now();
+  size_t total_hunk_count = 0;
+  for (Point end : ends) {
+    total_hunk_count += const_patch.get_hunks_in_new_range(Point(), end).size();
+  }
+  auto get_hunks_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+  REQUIRE(total_row_count > 0);
+  REQUIRE(total_hunk_count > 0);
+
+  std::cout << "Summarizing the hunks before " << ends.size() << " rows out of " << patch.get_hunk_count() <<
+    ": " << statistics_time << "ms (getting the hunks: " << get_hunks_time << "ms)\n";
+}
+
+TEST_CASE("Patch typing replay") {
+  srand(0);
+  Patch patch;
+  for (uint i = 0; i < 50000; i++) {
+    Splice splice = get_random_splice();
+    patch.splice(splice.start, splice.deletion_extent, splice.insertion_extent,
+                 get_random_text(splice.deletion_extent), get_random_text(splice.insertion_extent));
+  }
+
+  // Bursts of typing at random places, each character spliced on its own and
+  // followed by a lookup of the hunk at the cursor, with the occasional
+  // backspace.
+  uint burst_count = 5000, burst_length = 30, keystroke_count = 0;
+  vector<std::unique_ptr<Text>> typed_texts, deleted_texts;
+  for (uint i = 0; i < burst_count * burst_length; i++) {
+    typed_texts.push_back(get_random_text(Point(0, 1)));
+    deleted_texts.push_back(get_random_text(Point(0, 1)));
+  }
+
+  auto start = steady_clock::now();
+  size_t found_count = 0;
+  for (uint i = 0; i < burst_count; i++) {
+    Point cursor(rand() % 20000, rand() % 100);
+    for (uint j = 0; j < burst_length; j++, keystroke_count++) {
+      if (j % 7 == 6) {
+        cursor.column--;
+        patch.splice(cursor, Point(0, 1), Point(), move(deleted_texts[keystroke_count]),
+                     std::unique_ptr<Text>{new Text()});
+      } else {
+        patch.splice(cursor, Point(), Point(0, 1), std::unique_ptr<Text>{new Text()},
+                     move(typed_texts[keystroke_count]));
+        cursor.column++;
+      }
+      if (patch.hunk_for_new_position(cursor)) found_count++;
+    }
+  }
+  auto time = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  REQUIRE(found_count == keystroke_count);
+
+  std::cout << "Replaying " << keystroke_count << " keystrokes in bursts of " << burst_length << " among " <<
+    patch.get_hunk_count() << " hunks: " << time / keystroke_count << "ns per keystroke\n";
+}
+
+TEST_CASE("Patch backends") {
+  srand(0);
+  uint random_splice_count = 100000, sequential_splice_count = 100000, query_count = 1000000;
+  vector<Splice> splices;
+  vector<std::unique_ptr<Text>> deleted_texts, inserted_texts;
+  for (uint i = 0; i < random_splice_count; i++) {
+    splices.push_back(get_random_splice());
+    deleted_texts.push_back(get_random_text(splices.back().deletion_extent));
+    inserted_texts.push_back(get_random_text(splices.back().insertion_extent));
+  }
+  vector<Point> query_positions;
+  for (uint i = 0; i < query_count; i++) {
+    query_positions.push_back(Point(rand() % 20000, rand() % 100));
+  }
+
+  for (Patch::Backend backend : {Patch::Backend::SplayTree, Patch::Backend::BTree}) {
+    const char *name = backend == Patch::Backend::BTree ? "B+ tree" : "splay tree";
+
+    Patch random_patch(true, backend);
+    auto start = steady_clock::now();
+    for (uint i = 0; i < random_splice_count; i++) {
+      random_patch.splice(splices[i].start, splices[i].deletion_extent, splices[i].insertion_extent,
+                          std::unique_ptr<Text>{new Text(*deleted_texts[i])},
+                          std::unique_ptr<Text>{new Text(*inserted_texts[i])});
+    }
+    auto random_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+    // Edit one line after another, as when replacing through a document.
+    Patch sequential_patch(true, backend);
+    start = steady_clock::now();
+    for (uint i = 0; i < sequential_splice_count; i++) {
+      sequential_patch.splice(Point(i, 0), Point(0, 1), Point(0, 2));
+    }
+    auto sequential_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+    // Look up hunks and sum up ranges of the randomly spliced patch, through a
+    // const reference as concurrent readers would.
+    const Patch &const_patch = random_patch;
+    start = steady_clock::now();
+    size_t found_count = 0;
+    for (Point position : query_positions) {
+      if (const_patch.hunk_for_new_position(position)) found_count++;
+    }
+    auto lookup_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+    start = steady_clock::now();
+    size_t total_hunk_count = 0;
+    for (uint i = 0; i < query_count / 10; i++) {
+      Point range_start = query_positions[i];
+      total_hunk_count += const_patch.get_change_statistics_in_new_range(
+        range_start, range_start.traverse(Point(100, 0))).hunk_count;
+    }
+    auto statistics_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+    REQUIRE(found_count > 0);
+    REQUIRE(total_hunk_count > 0);
+
+    Patch::MemoryUsage memory_usage = random_patch.get_memory_usage();
+    std::cout << name << ":\n" <<
+      "  " << random_splice_count << " random splices: " << random_time << "ms, " <<
+      random_patch.get_hunk_count() << " hunks in " << memory_usage.nodes / 1024 << "KB of nodes\n" <<
+      "  " << sequential_splice_count << " sequential splices: " << sequential_time << "ms\n" <<
+      "  " << query_count << " lookups: " << lookup_time << "ms, " <<
+      query_count / 10 << " range statistics: " << statistics_time << "ms\n";
+  }
+}
@@ -0,0 +1,133 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include "catch.hpp"
+#include "newline-scan.h"
+#include "text.h"
+#include "text-diff.h"
+
+using namespace std::chrono;
+using std::vector;
+
+static Text get_random_text(size_t size, unsigned average_line_length) {
+  Text text;
+  text.reserve(size);
+  for (size_t i = 0; i < size; i++) {
+    text.push_back(rand() % average_line_length == 0 ? '\n' : 'a' + rand() % 26);
+  }
+  return text;
+}
+
+TEST_CASE("Newline scanning") {
+  srand(0);
+
+  for (size_t megabytes : {1, 10, 100}) {
+    Text text = get_random_text(megabytes * 1024 * 1024 / sizeof(uint16_t), 60);
+    const uint16_t *begin = text.data();
+    const uint16_t *end = text.data() + text.size();
+    size_t newline_count = 0;
+    for (uint16_t character : text) {
+      if (character == '\n') newline_count++;
+    }
+
+    for (const NewlineScanner &scanner : get_newline_scanners()) {
+      auto start = steady_clock::now();
+      REQUIRE(scanner.count_newlines(begin, end) == newline_count);
+      auto count_time = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+      start = steady_clock::now();
+      size_t found_count = 0;
+      for (const uint16_t *newline = scanner.find_newline(begin, end, 1); newline != end;
+           newline = scanner.find_newline(newline + 1, end, 1)) {
+        found_count++;
+      }
+      REQUIRE(found_count == newline_count);
+      auto find_each_time = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+      start = steady_clock::now();
+      REQUIRE(scanner.find_newline(begin, end, newline_count) == scanner.find_last_newline(begin, end));
+      auto find_nth_time = duration_cast<microseconds>(steady_clock::now() - start).count();
+
+      std::cout << megabytes << "MB, " << scanner.name << ":\n" <<
+        "  count: " << count_time << "us\n" <<
+        "  find each: " << find_each_time << "us\n" <<
+        "  find last by index: " << find_nth_time << "us\n";
+    }
+  }
+}
+
+TEST_CASE("TextSlice::character_index_for_position") {
+  srand(0);
+  Text text = get_random_text(10 * 1024 * 1024 / sizeof(uint16_t), 60);
+  TextSlice slice(TextView(&text), 0, text.size());
+  Point extent = slice.extent();
+
+  vector<Point> positions;
+  for (unsigned i = 0; i < 1000; i++) {
+    positions.push_back(Point(rand() % (extent.row + 1), rand() % 80));
+  }
+
+  auto start = steady_clock::now();
+  size_t total = 0;
+  for (Point position : positions) {
+    total += slice.character_index_for_position(position);
+  }
+  auto time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+  REQUIRE(total > 0);
+  std::cout << "Mapping " << positions.size() << " positions in 10MB: " << time << "ms\n";
+}
+
+static Text get_random_source(size_t line_count) {
+  static const char *words[] = {"if", "return", "const", "value", "index", "(", ")", "{", "}", ";", "=", "+"};
+  Text text;
+  for (size_t i = 0; i < line_count; i++) {
+    for (unsigned j = 0, word_count = rand() % 10; j < word_count; j++) {
+      for (const char *c = words[rand() % 12]; *c; c++) text.push_back(*c);
+      text.push_back(' ');
+    }
+    text.push_back('\n');
+  }
+  return text;
+}
+
+TEST_CASE("text_diff") {
+  srand(0);
+  Text old_text = get_random_source(40000);
+  Text new_text = old_text;
+  for (unsigned i = 0; i < 500; i++) {
+    size_t start = rand() % new_text.size();
+    size_t end = std::min(new_text.size(), start + rand() % 40);
+    Text inserted_text = get_random_source(rand() % 2);
+    inserted_text.push_back('a' + rand() % 26);
+    new_text.erase(new_text.begin() + start, new_text.begin() + end);
+    new_text.insert(new_text.begin() + start, inserted_text.begin(), inserted_text.end());
+  }
+  std::cout << "Diffing " << old_text.size() * sizeof(uint16_t) / 1024 << "KB:\n";
+
+  for (DiffGranularity granularity : {DiffGranularity::Lines, DiffGranularity::Characters}) {
+    auto start = steady_clock::now();
+    Patch patch = text_diff(old_text, new_text, granularity);
+    auto diff_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+    // Building the same patch one splice at a time, the way the results of a
+    // diff computed elsewhere would be applied.
+    start = steady_clock::now();
+    Patch replayed_patch;
+    for (const Patch::Hunk &hunk : patch.get_hunks()) {
+      replayed_patch.splice(
+        hunk.new_start,
+        hunk.old_end.traversal(hunk.old_start),
+        hunk.new_end.traversal(hunk.new_start),
+        std::unique_ptr<Text>(new Text(hunk.old_text)),
+        std::unique_ptr<Text>(new Text(hunk.new_text))
+      );
+    }
+    auto replay_time = duration_cast<milliseconds>(steady_clock::now() - start).count();
+    REQUIRE(replayed_patch.get_hunk_count() == patch.get_hunk_count());
+
+    std::cout << "  " << (granularity == DiffGranularity::Lines ? "lines" : "characters") <<
+      ": " << patch.get_hunk_count() << " hunks in " << diff_time << "ms" <<
+      " (splicing them one by one: " << replay_time << "ms)\n";
+  }
+}
@@ -23,7 +23,10 @@
             "sources": [
                 "src/core/patch.cc",
                 "src/core/point.cc",
+                "src/core/serializer.cc",
                 "src/core/text.cc",
+                "src/core/newline-scan.cc",
+                "src/core/text-diff.cc",
                 "src/core/marker-index.cc",
                 "src/core/buffer-offset-index.cc"
             ]
@@ -13,6 +13,7 @@ void BufferOffsetIndexWrapper::init(Local<Object> exports) {
   prototype_template->Set(Nan::New<String>("splice").ToLocalChecked(), Nan::New<FunctionTemplate>(splice));
   prototype_template->Set(Nan::New<String>("positionForCharacterIndex").ToLocalChecked(), Nan::New<FunctionTemplate>(position_for_character_index));
   prototype_template->Set(Nan::New<String>("characterIndexForPosition").ToLocalChecked(), Nan::New<FunctionTemplate>(character_index_for_position));
+  prototype_template->Set(Nan::New<String>("getMemoryUsage").ToLocalChecked(), Nan::New<FunctionTemplate>(get_memory_usage));
   exports->Set(Nan::New("BufferOffsetIndex").ToLocalChecked(), constructor_template->GetFunction());
 }
 
@@ -53,3 +54,11 @@ void BufferOffsetIndexWrapper::position_for_character_index(const Nan::FunctionC
     info.GetReturnValue().Set(PointWrapper::from_point(result));
   }
 }
+
+void BufferOffsetIndexWrapper::get_memory_usage(const Nan::FunctionCallbackInfo<Value> &info) {
+  BufferOffsetIndex &buffer_offset_index = Nan::ObjectWrap::Unwrap<BufferOffsetIndexWrapper>(info.This())->buffer_offset_index;
+  BufferOffsetIndex::MemoryUsage usage = buffer_offset_index.get_memory_usage();
+  Local<Object> result = Nan::New<Object>();
+  result->Set(Nan::New("nodes").ToLocalChecked(), Nan::New<Number>(usage.nodes));
+  info.GetReturnValue().Set(result);
+}
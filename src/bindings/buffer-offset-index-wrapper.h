@@ -10,6 +10,7 @@ private:
   static void splice(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void character_index_for_position(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void position_for_character_index(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void get_memory_usage(const Nan::FunctionCallbackInfo<v8::Value> &info);
 
   BufferOffsetIndex buffer_offset_index;
 };
@@ -201,6 +201,24 @@ struct em_wrap_type<std::unique_ptr<Text>> : public em_wrap_type_base<std::uniqu
 
 };
 
+template <>
+struct em_wrap_type<TextView> : public em_wrap_type_base<TextView, emscripten::val> {
+
+    static TextView receive(emscripten::val const & val)
+    {
+        throw std::runtime_error("Unimplemented");
+    }
+
+    static emscripten::val transmit(TextView text)
+    {
+        if (!text)
+            return emscripten::val::undefined();
+
+        return emscripten::val(std::string(text.begin(), text.end()));
+    }
+
+};
+
 template <>
 struct em_wrap_type<Text *> : public em_wrap_type_base<Text *, emscripten::val> {
 
@@ -14,6 +14,14 @@ EMSCRIPTEN_BINDINGS(BufferOffsetIndex) {
         .function("characterIndexForPosition", WRAP(&BufferOffsetIndex::character_index_for_position))
         .function("positionForCharacterIndex", WRAP(&BufferOffsetIndex::position_for_character_index))
 
+        .function("getMemoryUsage", WRAP(&BufferOffsetIndex::get_memory_usage))
+
+        ;
+
+    emscripten::value_object<BufferOffsetIndex::MemoryUsage>("BufferOffsetIndexMemoryUsage")
+
+        .field("nodes", &BufferOffsetIndex::MemoryUsage::nodes)
+
         ;
 
 }
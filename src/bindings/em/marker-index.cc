@@ -34,6 +34,8 @@ EMSCRIPTEN_BINDINGS(MarkerIndex) {
 
         .function("dump", WRAP(&MarkerIndex::dump))
 
+        .function("getMemoryUsage", WRAP(&MarkerIndex::get_memory_usage))
+
         ;
 
     emscripten::value_object<MarkerIndex::SpliceResult>("SpliceResult")
@@ -45,4 +47,13 @@ EMSCRIPTEN_BINDINGS(MarkerIndex) {
 
         ;
 
+    emscripten::value_object<MarkerIndex::MemoryUsage>("MarkerIndexMemoryUsage")
+
+        .field("nodes", &MarkerIndex::MemoryUsage::nodes)
+        .field("markerIdSets", &MarkerIndex::MemoryUsage::marker_id_sets)
+        .field("idMaps", &MarkerIndex::MemoryUsage::id_maps)
+        .field("caches", &MarkerIndex::MemoryUsage::caches)
+
+        ;
+
 }
@@ -1,4 +1,5 @@
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "as.h"
@@ -11,11 +12,15 @@
 Patch * constructor(emscripten::val val)
 {
     bool merge_adjacent_hunks = false;
+    Patch::Backend backend = Patch::Backend::SplayTree;
 
     if (val.as<bool>() && val["mergeAdjacentHunks"].as<bool>())
         merge_adjacent_hunks = true;
 
-    return new Patch(merge_adjacent_hunks);
+    if (val.as<bool>() && val["backend"].as<bool>() && val["backend"].as<std::string>() == "btree")
+        backend = Patch::Backend::BTree;
+
+    return new Patch(merge_adjacent_hunks, backend);
 }
 
 std::vector<uint8_t> serialize(Patch const & patch)
@@ -36,6 +41,69 @@ Patch * deserialize(std::vector<uint8_t> const & vec)
     return new Patch(vec);
 }
 
+Patch * concat(Patch * first, Patch * second)
+{
+    optional<Patch> result = Patch::concat(std::move(*first), std::move(*second));
+    return result ? new Patch(std::move(*result)) : nullptr;
+}
+
+Patch * transform(Patch const * a, Patch const * b)
+{
+    return new Patch(Patch::transform(*a, *b));
+}
+
+Patch * transform_in_order(Patch const * a, Patch const * b, std::string const & order)
+{
+    return new Patch(Patch::transform(*a, *b, order == "b-first" ? Patch::InsertionOrder::BFirst : Patch::InsertionOrder::AFirst));
+}
+
+// Positions are passed in bulk as a Uint32Array of alternating rows and
+// columns, and their translations are returned the same way.
+template <typename Translate>
+emscripten::val translate_positions(emscripten::val const & js_coordinates, std::string const & clip_mode, Translate translate)
+{
+    std::vector<uint32_t> coordinates(js_coordinates["length"].as<unsigned>());
+    emscripten::val(emscripten::typed_memory_view(coordinates.size(), coordinates.data())).call<void>("set", js_coordinates);
+
+    std::vector<Point> positions;
+    positions.reserve(coordinates.size() / 2);
+    for (size_t i = 0; i + 1 < coordinates.size(); i += 2)
+        positions.push_back(Point(coordinates[i], coordinates[i + 1]));
+
+    std::vector<Point> translated_positions = translate(positions, clip_mode == "forward" ? Patch::ClipMode::Forward : Patch::ClipMode::Backward);
+    coordinates.resize(translated_positions.size() * 2);
+    for (size_t i = 0; i < translated_positions.size(); ++i) {
+        coordinates[2 * i] = translated_positions[i].row;
+        coordinates[2 * i + 1] = translated_positions[i].column;
+    }
+
+    return emscripten::val(emscripten::typed_memory_view(coordinates.size(), coordinates.data())).call<emscripten::val>("slice");
+}
+
+emscripten::val translate_old_positions(Patch const & patch, emscripten::val const & coordinates, std::string const & clip_mode)
+{
+    return translate_positions(coordinates, clip_mode, [&patch](std::vector<Point> const & positions, Patch::ClipMode mode) {
+        return patch.translate_old_positions(positions, mode);
+    });
+}
+
+emscripten::val translate_new_positions(Patch const & patch, emscripten::val const & coordinates, std::string const & clip_mode)
+{
+    return translate_positions(coordinates, clip_mode, [&patch](std::vector<Point> const & positions, Patch::ClipMode mode) {
+        return patch.translate_new_positions(positions, mode);
+    });
+}
+
+emscripten::val translate_old_positions_backward(Patch const & patch, emscripten::val const & coordinates)
+{
+    return translate_old_positions(patch, coordinates, "backward");
+}
+
+emscripten::val translate_new_positions_backward(Patch const & patch, emscripten::val const & coordinates)
+{
+    return translate_new_positions(patch, coordinates, "backward");
+}
+
 Point get_old_extent(Patch::Hunk const & hunk)
 {
     return hunk.old_end.traversal(hunk.old_start);
@@ -65,21 +133,40 @@ EMSCRIPTEN_BINDINGS(Patch) {
 
         .function("copy", WRAP(&Patch::copy))
         .function("invert", WRAP(&Patch::invert))
+        .function("apply", WRAP(&Patch::apply))
+        .function("applyInverse", WRAP(&Patch::apply_inverse))
+        .function("translateOldPositions", WRAP(&translate_old_positions_backward))
+        .function("translateOldPositions", WRAP(&translate_old_positions))
+        .function("translateNewPositions", WRAP(&translate_new_positions_backward))
+        .function("translateNewPositions", WRAP(&translate_new_positions))
+        .function("coalesce", WRAP_OVERLOAD(&Patch::coalesce, bool (Patch::*)(Point)))
+        .function("coalesce", WRAP_OVERLOAD(&Patch::coalesce, bool (Patch::*)(Point, Text const &)))
+        .function("splitAtOldPosition", WRAP(&Patch::split_at_old_position))
+        .function("splitAtNewPosition", WRAP(&Patch::split_at_new_position))
 
         .function("getHunks", WRAP(&Patch::get_hunks))
         .function("getHunksInNewRange", WRAP_OVERLOAD(&Patch::get_hunks_in_new_range, std::vector<Patch::Hunk> (Patch::*)(Point, Point)))
         .function("getHunksInNewRange", WRAP_OVERLOAD(&Patch::get_hunks_in_new_range, std::vector<Patch::Hunk> (Patch::*)(Point, Point, bool)))
-        .function("getHunksInOldRange", WRAP(&Patch::get_hunks_in_old_range))
+        .function("getHunksInOldRange", WRAP_OVERLOAD(&Patch::get_hunks_in_old_range, std::vector<Patch::Hunk> (Patch::*)(Point, Point)))
         .function("getHunkCount", WRAP(&Patch::get_hunk_count))
 
-        .function("hunkForOldPosition", WRAP(&Patch::hunk_for_old_position))
-        .function("hunkForNewPosition", WRAP(&Patch::hunk_for_new_position))
+        .function("hunkForOldPosition", WRAP_OVERLOAD(&Patch::hunk_for_old_position, optional<Patch::Hunk> (Patch::*)(Point)))
+        .function("hunkForNewPosition", WRAP_OVERLOAD(&Patch::hunk_for_new_position, optional<Patch::Hunk> (Patch::*)(Point)))
 
         .function("rebalance", WRAP(&Patch::rebalance))
 
+        .function("getMemoryUsage", WRAP(&Patch::get_memory_usage))
+
+        .function("getChangeStatistics", WRAP(&Patch::get_change_statistics))
+        .function("getChangeStatisticsInOldRange", WRAP(&Patch::get_change_statistics_in_old_range))
+        .function("getChangeStatisticsInNewRange", WRAP(&Patch::get_change_statistics_in_new_range))
+
         .function("serialize", WRAP(&serialize))
 
         .class_function("compose", WRAP_STATIC(&compose), emscripten::allow_raw_pointers())
+        .class_function("concat", WRAP_STATIC(&concat), emscripten::allow_raw_pointers())
+        .class_function("transform", WRAP_STATIC(&transform), emscripten::allow_raw_pointers())
+        .class_function("transform", WRAP_STATIC(&transform_in_order), emscripten::allow_raw_pointers())
 
         .class_function("deserialize", WRAP_STATIC(&deserialize), emscripten::allow_raw_pointers())
 
@@ -98,4 +185,22 @@ EMSCRIPTEN_BINDINGS(Patch) {
 
         ;
 
+    emscripten::value_object<Patch::MemoryUsage>("PatchMemoryUsage")
+
+        .field("nodes", &Patch::MemoryUsage::nodes)
+        .field("text", &Patch::MemoryUsage::text)
+        .field("caches", &Patch::MemoryUsage::caches)
+
+        ;
+
+    emscripten::value_object<Patch::ChangeStatistics>("PatchChangeStatistics")
+
+        .field("hunkCount", &Patch::ChangeStatistics::hunk_count)
+        .field("oldTextSize", &Patch::ChangeStatistics::old_text_size)
+        .field("newTextSize", &Patch::ChangeStatistics::new_text_size)
+        .field("oldChangedRowCount", &Patch::ChangeStatistics::old_changed_row_count)
+        .field("newChangedRowCount", &Patch::ChangeStatistics::new_changed_row_count)
+
+        ;
+
 }
@@ -49,6 +49,8 @@ void MarkerIndexWrapper::init(Local<Object> exports) {
   prototype_template->Set(Nan::New<String>("findEndingIn").ToLocalChecked(), Nan::New<FunctionTemplate>(find_ending_in));
   prototype_template->Set(Nan::New<String>("findEndingAt").ToLocalChecked(), Nan::New<FunctionTemplate>(find_ending_at));
   prototype_template->Set(Nan::New<String>("dump").ToLocalChecked(), Nan::New<FunctionTemplate>(dump));
+  prototype_template->Set(Nan::New<String>("getMemoryUsage").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(get_memory_usage));
 
   start_string.Reset(Nan::Persistent<String>(Nan::New("start").ToLocalChecked()));
   end_string.Reset(Nan::Persistent<String>(Nan::New("end").ToLocalChecked()));
@@ -316,5 +318,16 @@ void MarkerIndexWrapper::dump(const Nan::FunctionCallbackInfo<Value> &info) {
   info.GetReturnValue().Set(snapshot_to_js(snapshot));
 }
 
+void MarkerIndexWrapper::get_memory_usage(const Nan::FunctionCallbackInfo<Value> &info) {
+  MarkerIndexWrapper *wrapper = Nan::ObjectWrap::Unwrap<MarkerIndexWrapper>(info.This());
+  MarkerIndex::MemoryUsage usage = wrapper->marker_index.get_memory_usage();
+  Local<Object> result = Nan::New<Object>();
+  result->Set(Nan::New("nodes").ToLocalChecked(), Nan::New<Number>(usage.nodes));
+  result->Set(Nan::New("markerIdSets").ToLocalChecked(), Nan::New<Number>(usage.marker_id_sets));
+  result->Set(Nan::New("idMaps").ToLocalChecked(), Nan::New<Number>(usage.id_maps));
+  result->Set(Nan::New("caches").ToLocalChecked(), Nan::New<Number>(usage.caches));
+  info.GetReturnValue().Set(result);
+}
+
 MarkerIndexWrapper::MarkerIndexWrapper(v8::Local<v8::Number> seed)
     : marker_index{static_cast<unsigned>(seed->Int32Value())} {}
@@ -33,6 +33,7 @@ private:
   static void find_ending_in(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void find_ending_at(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void dump(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void get_memory_usage(const Nan::FunctionCallbackInfo<v8::Value> &info);
   MarkerIndexWrapper(v8::Local<v8::Number> seed);
   MarkerIndex marker_index;
 };
@@ -2,6 +2,7 @@
 #include "patch-wrapper.h"
 #include <memory>
 #include <sstream>
+#include <string>
 #include <vector>
 #include "point-wrapper.h"
 
@@ -27,8 +28,51 @@ static unique_ptr<Text> text_from_js(Nan::MaybeLocal<String> maybe_string) {
   return text;
 }
 
-static Local<String> text_to_js(Text *text) {
-  return Nan::New<String>(text->data(), text->size()).ToLocalChecked();
+static Local<String> text_to_js(TextView text) {
+  return Nan::New<String>(text.data(), text.size()).ToLocalChecked();
+}
+
+// Positions are passed in bulk as a Uint32Array of alternating rows and
+// columns, and their translations are returned the same way.
+template <typename Translate>
+static void translate_positions(const Nan::FunctionCallbackInfo<Value> &info, Translate translate) {
+  if (!info[0]->IsUint32Array()) {
+    Nan::ThrowTypeError("Expected a Uint32Array of alternating rows and columns");
+    return;
+  }
+
+  Patch::ClipMode clip_mode = Patch::ClipMode::Backward;
+  if (info.Length() >= 2 && !info[1]->IsUndefined()) {
+    Nan::Utf8String clip_mode_string(info[1]);
+    if (std::string(*clip_mode_string) == "forward") {
+      clip_mode = Patch::ClipMode::Forward;
+    } else if (std::string(*clip_mode_string) != "backward") {
+      Nan::ThrowTypeError("The clip mode must be 'backward' or 'forward'");
+      return;
+    }
+  }
+
+  Nan::TypedArrayContents<uint32_t> coordinates(info[0]);
+  if (coordinates.length() % 2 != 0) {
+    Nan::ThrowTypeError("Expected a Uint32Array of alternating rows and columns");
+    return;
+  }
+  vector<Point> positions;
+  positions.reserve(coordinates.length() / 2);
+  for (size_t i = 0; i < coordinates.length(); i += 2) {
+    positions.push_back(Point((*coordinates)[i], (*coordinates)[i + 1]));
+  }
+
+  vector<Point> translated_positions = translate(positions, clip_mode);
+  size_t length = translated_positions.size() * 2;
+  Local<Uint32Array> result = Uint32Array::New(
+    ArrayBuffer::New(Isolate::GetCurrent(), length * sizeof(uint32_t)), 0, length);
+  Nan::TypedArrayContents<uint32_t> translated_coordinates(result);
+  for (size_t i = 0; i < translated_positions.size(); i++) {
+    (*translated_coordinates)[2 * i] = translated_positions[i].row;
+    (*translated_coordinates)[2 * i + 1] = translated_positions[i].column;
+  }
+  info.GetReturnValue().Set(result);
 }
 
 class HunkWrapper : public Nan::ObjectWrap {
@@ -110,6 +154,8 @@ void PatchWrapper::init(Local<Object> exports) {
   constructor_template_local->SetClassName(Nan::New<String>("Patch").ToLocalChecked());
   constructor_template_local->Set(Nan::New("deserialize").ToLocalChecked(), Nan::New<FunctionTemplate>(deserialize));
   constructor_template_local->Set(Nan::New("compose").ToLocalChecked(), Nan::New<FunctionTemplate>(compose));
+  constructor_template_local->Set(Nan::New("concat").ToLocalChecked(), Nan::New<FunctionTemplate>(concat));
+  constructor_template_local->Set(Nan::New("transform").ToLocalChecked(), Nan::New<FunctionTemplate>(transform));
   constructor_template_local->InstanceTemplate()->SetInternalFieldCount(1);
   const auto &prototype_template = constructor_template_local->PrototypeTemplate();
   prototype_template->Set(Nan::New("delete").ToLocalChecked(), Nan::New<FunctionTemplate>(noop));
@@ -117,6 +163,17 @@ void PatchWrapper::init(Local<Object> exports) {
   prototype_template->Set(Nan::New("spliceOld").ToLocalChecked(), Nan::New<FunctionTemplate>(splice_old));
   prototype_template->Set(Nan::New("copy").ToLocalChecked(), Nan::New<FunctionTemplate>(copy));
   prototype_template->Set(Nan::New("invert").ToLocalChecked(), Nan::New<FunctionTemplate>(invert));
+  prototype_template->Set(Nan::New("apply").ToLocalChecked(), Nan::New<FunctionTemplate>(apply));
+  prototype_template->Set(Nan::New("applyInverse").ToLocalChecked(), Nan::New<FunctionTemplate>(apply_inverse));
+  prototype_template->Set(Nan::New("translateOldPositions").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(translate_old_positions));
+  prototype_template->Set(Nan::New("translateNewPositions").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(translate_new_positions));
+  prototype_template->Set(Nan::New("coalesce").ToLocalChecked(), Nan::New<FunctionTemplate>(coalesce));
+  prototype_template->Set(Nan::New("splitAtOldPosition").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(split_at_old_position));
+  prototype_template->Set(Nan::New("splitAtNewPosition").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(split_at_new_position));
   prototype_template->Set(Nan::New("getHunks").ToLocalChecked(), Nan::New<FunctionTemplate>(get_hunks));
   prototype_template->Set(Nan::New("getHunksInOldRange").ToLocalChecked(),
                           Nan::New<FunctionTemplate>(get_hunks_in_old_range));
@@ -131,6 +188,13 @@ void PatchWrapper::init(Local<Object> exports) {
   prototype_template->Set(Nan::New("getJSON").ToLocalChecked(), Nan::New<FunctionTemplate>(get_json));
   prototype_template->Set(Nan::New("rebalance").ToLocalChecked(), Nan::New<FunctionTemplate>(rebalance));
   prototype_template->Set(Nan::New("getHunkCount").ToLocalChecked(), Nan::New<FunctionTemplate>(get_hunk_count));
+  prototype_template->Set(Nan::New("getMemoryUsage").ToLocalChecked(), Nan::New<FunctionTemplate>(get_memory_usage));
+  prototype_template->Set(Nan::New("getChangeStatistics").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(get_change_statistics));
+  prototype_template->Set(Nan::New("getChangeStatisticsInOldRange").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(get_change_statistics_in_old_range));
+  prototype_template->Set(Nan::New("getChangeStatisticsInNewRange").ToLocalChecked(),
+                          Nan::New<FunctionTemplate>(get_change_statistics_in_new_range));
   patch_wrapper_constructor_template.Reset(constructor_template_local);
   patch_wrapper_constructor.Reset(constructor_template_local->GetFunction());
   exports->Set(Nan::New("Patch").ToLocalChecked(), Nan::New(patch_wrapper_constructor));
@@ -140,6 +204,7 @@ PatchWrapper::PatchWrapper(Patch &&patch) : patch{std::move(patch)} {}
 
 void PatchWrapper::construct(const Nan::FunctionCallbackInfo<Value> &info) {
   bool merges_adjacent_hunks = true;
+  Patch::Backend backend = Patch::Backend::SplayTree;
   Local<Object> options;
 
   if (info.Length() > 0 && Nan::To<Object>(info[0]).ToLocal(&options)) {
@@ -148,8 +213,19 @@ void PatchWrapper::construct(const Nan::FunctionCallbackInfo<Value> &info) {
             .ToLocal(&js_merge_adjacent_hunks)) {
       merges_adjacent_hunks = js_merge_adjacent_hunks->BooleanValue();
     }
+
+    Local<Value> js_backend = options->Get(Nan::New("backend").ToLocalChecked());
+    if (!js_backend->IsUndefined()) {
+      Nan::Utf8String backend_string(js_backend);
+      if (std::string(*backend_string) == "btree") {
+        backend = Patch::Backend::BTree;
+      } else if (std::string(*backend_string) != "splay") {
+        Nan::ThrowTypeError("The backend must be 'splay' or 'btree'");
+        return;
+      }
+    }
   }
-  PatchWrapper *patch = new PatchWrapper(Patch{merges_adjacent_hunks});
+  PatchWrapper *patch = new PatchWrapper(Patch{merges_adjacent_hunks, backend});
   patch->Wrap(info.This());
 }
 
@@ -215,6 +291,87 @@ void PatchWrapper::invert(const Nan::FunctionCallbackInfo<Value> &info) {
   }
 }
 
+void PatchWrapper::apply(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  unique_ptr<Text> old_text = text_from_js(Nan::To<String>(info[0]));
+  if (old_text) {
+    optional<Text> new_text = patch.apply(*old_text);
+    if (new_text) {
+      info.GetReturnValue().Set(text_to_js(TextView(&*new_text)));
+    } else {
+      info.GetReturnValue().Set(Nan::Undefined());
+    }
+  }
+}
+
+void PatchWrapper::apply_inverse(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  unique_ptr<Text> new_text = text_from_js(Nan::To<String>(info[0]));
+  if (new_text) {
+    optional<Text> old_text = patch.apply_inverse(*new_text);
+    if (old_text) {
+      info.GetReturnValue().Set(text_to_js(TextView(&*old_text)));
+    } else {
+      info.GetReturnValue().Set(Nan::Undefined());
+    }
+  }
+}
+
+void PatchWrapper::translate_old_positions(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  translate_positions(info, [&patch](const vector<Point> &positions, Patch::ClipMode clip_mode) {
+    return patch.translate_old_positions(positions, clip_mode);
+  });
+}
+
+void PatchWrapper::translate_new_positions(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  translate_positions(info, [&patch](const vector<Point> &positions, Patch::ClipMode clip_mode) {
+    return patch.translate_new_positions(positions, clip_mode);
+  });
+}
+
+void PatchWrapper::coalesce(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  optional<Point> max_distance = PointWrapper::point_from_js(info[0]);
+  if (max_distance) {
+    bool coalesced;
+    if (info.Length() >= 2) {
+      unique_ptr<Text> new_text = text_from_js(Nan::To<String>(info[1]));
+      if (!new_text) return;
+      coalesced = patch.coalesce(*max_distance, *new_text);
+    } else {
+      coalesced = patch.coalesce(*max_distance);
+    }
+
+    if (!coalesced) {
+      Nan::ThrowError("Can't coalesce a frozen patch, or one whose hunks don't fit in the given text");
+    }
+  }
+}
+
+void PatchWrapper::split_at_old_position(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  optional<Point> position = PointWrapper::point_from_js(info[0]);
+  Local<Object> result;
+  if (position && Nan::NewInstance(Nan::New(patch_wrapper_constructor)).ToLocal(&result)) {
+    auto wrapper = new PatchWrapper{patch.split_at_old_position(*position)};
+    wrapper->Wrap(result);
+    info.GetReturnValue().Set(result);
+  }
+}
+
+void PatchWrapper::split_at_new_position(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  optional<Point> position = PointWrapper::point_from_js(info[0]);
+  Local<Object> result;
+  if (position && Nan::NewInstance(Nan::New(patch_wrapper_constructor)).ToLocal(&result)) {
+    auto wrapper = new PatchWrapper{patch.split_at_new_position(*position)};
+    wrapper->Wrap(result);
+    info.GetReturnValue().Set(result);
+  }
+}
+
 void PatchWrapper::get_hunks(const Nan::FunctionCallbackInfo<Value> &info) {
   Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
 
@@ -346,6 +503,56 @@ void PatchWrapper::compose(const Nan::FunctionCallbackInfo<Value> &info) {
   }
 }
 
+void PatchWrapper::concat(const Nan::FunctionCallbackInfo<Value> &info) {
+  Local<Object> result;
+  if (Nan::NewInstance(Nan::New(patch_wrapper_constructor)).ToLocal(&result)) {
+    Local<FunctionTemplate> patch_template = Nan::New(patch_wrapper_constructor_template);
+    if (!patch_template->HasInstance(info[0]) || !patch_template->HasInstance(info[1])) {
+      Nan::ThrowTypeError("Patch.concat must be called with two patches");
+      return;
+    }
+
+    Patch &first = Nan::ObjectWrap::Unwrap<PatchWrapper>(Local<Object>::Cast(info[0]))->patch;
+    Patch &second = Nan::ObjectWrap::Unwrap<PatchWrapper>(Local<Object>::Cast(info[1]))->patch;
+    optional<Patch> concatenation = Patch::concat(std::move(first), std::move(second));
+    if (concatenation) {
+      auto wrapper = new PatchWrapper{std::move(*concatenation)};
+      wrapper->Wrap(result);
+      info.GetReturnValue().Set(result);
+    } else {
+      info.GetReturnValue().Set(Nan::Undefined());
+    }
+  }
+}
+
+void PatchWrapper::transform(const Nan::FunctionCallbackInfo<Value> &info) {
+  Local<Object> result;
+  if (Nan::NewInstance(Nan::New(patch_wrapper_constructor)).ToLocal(&result)) {
+    Local<FunctionTemplate> patch_template = Nan::New(patch_wrapper_constructor_template);
+    if (!patch_template->HasInstance(info[0]) || !patch_template->HasInstance(info[1])) {
+      Nan::ThrowTypeError("Patch.transform must be called with two patches");
+      return;
+    }
+
+    Patch::InsertionOrder order = Patch::InsertionOrder::AFirst;
+    if (info.Length() >= 3 && !info[2]->IsUndefined()) {
+      Nan::Utf8String order_string(info[2]);
+      if (std::string(*order_string) == "b-first") {
+        order = Patch::InsertionOrder::BFirst;
+      } else if (std::string(*order_string) != "a-first") {
+        Nan::ThrowTypeError("The insertion order must be 'a-first' or 'b-first'");
+        return;
+      }
+    }
+
+    Patch &a = Nan::ObjectWrap::Unwrap<PatchWrapper>(Local<Object>::Cast(info[0]))->patch;
+    Patch &b = Nan::ObjectWrap::Unwrap<PatchWrapper>(Local<Object>::Cast(info[1]))->patch;
+    auto wrapper = new PatchWrapper{Patch::transform(a, b, order)};
+    wrapper->Wrap(result);
+    info.GetReturnValue().Set(result);
+  }
+}
+
 void PatchWrapper::get_dot_graph(const Nan::FunctionCallbackInfo<Value> &info) {
   Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
   std::string graph = patch.get_dot_graph();
@@ -368,3 +575,48 @@ void PatchWrapper::rebalance(const Nan::FunctionCallbackInfo<Value> &info) {
   Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
   patch.rebalance();
 }
+
+void PatchWrapper::get_memory_usage(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  Patch::MemoryUsage usage = patch.get_memory_usage();
+  Local<Object> result = Nan::New<Object>();
+  result->Set(Nan::New("nodes").ToLocalChecked(), Nan::New<Number>(usage.nodes));
+  result->Set(Nan::New("text").ToLocalChecked(), Nan::New<Number>(usage.text));
+  result->Set(Nan::New("caches").ToLocalChecked(), Nan::New<Number>(usage.caches));
+  info.GetReturnValue().Set(result);
+}
+
+static Local<Object> change_statistics_to_js(const Patch::ChangeStatistics &statistics) {
+  Local<Object> result = Nan::New<Object>();
+  result->Set(Nan::New("hunkCount").ToLocalChecked(), Nan::New<Number>(statistics.hunk_count));
+  result->Set(Nan::New("oldTextSize").ToLocalChecked(), Nan::New<Number>(statistics.old_text_size));
+  result->Set(Nan::New("newTextSize").ToLocalChecked(), Nan::New<Number>(statistics.new_text_size));
+  result->Set(Nan::New("oldChangedRowCount").ToLocalChecked(),
+              Nan::New<Number>(statistics.old_changed_row_count));
+  result->Set(Nan::New("newChangedRowCount").ToLocalChecked(),
+              Nan::New<Number>(statistics.new_changed_row_count));
+  return result;
+}
+
+void PatchWrapper::get_change_statistics(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  info.GetReturnValue().Set(change_statistics_to_js(patch.get_change_statistics()));
+}
+
+void PatchWrapper::get_change_statistics_in_old_range(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  optional<Point> start = PointWrapper::point_from_js(info[0]);
+  optional<Point> end = PointWrapper::point_from_js(info[1]);
+  if (start && end) {
+    info.GetReturnValue().Set(change_statistics_to_js(patch.get_change_statistics_in_old_range(*start, *end)));
+  }
+}
+
+void PatchWrapper::get_change_statistics_in_new_range(const Nan::FunctionCallbackInfo<Value> &info) {
+  Patch &patch = Nan::ObjectWrap::Unwrap<PatchWrapper>(info.This())->patch;
+  optional<Point> start = PointWrapper::point_from_js(info[0]);
+  optional<Point> end = PointWrapper::point_from_js(info[1]);
+  if (start && end) {
+    info.GetReturnValue().Set(change_statistics_to_js(patch.get_change_statistics_in_new_range(*start, *end)));
+  }
+}
@@ -12,6 +12,15 @@ class PatchWrapper : public Nan::ObjectWrap {
   static void splice_old(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void copy(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void invert(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void apply(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void apply_inverse(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void translate_old_positions(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void translate_new_positions(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void coalesce(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void split_at_old_position(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void split_at_new_position(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void concat(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void transform(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void get_hunks(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void get_hunks_in_old_range(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void get_hunks_in_new_range(const Nan::FunctionCallbackInfo<v8::Value> &info);
@@ -24,6 +33,10 @@ class PatchWrapper : public Nan::ObjectWrap {
   static void get_json(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void get_hunk_count(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void rebalance(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void get_memory_usage(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void get_change_statistics(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void get_change_statistics_in_old_range(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void get_change_statistics_in_new_range(const Nan::FunctionCallbackInfo<v8::Value> &info);
 
   Patch patch;
 };
@@ -161,6 +161,14 @@ Point BufferOffsetIndex::position_for_character_index(unsigned char_index) const
   }
 }
 
+BufferOffsetIndex::MemoryUsage BufferOffsetIndex::get_memory_usage() const {
+  size_t node_count = 0;
+  if (root) {
+    node_count = root->left_subtree_extent.rows + 1 + root->right_subtree_extent.rows;
+  }
+  return MemoryUsage{node_count * sizeof(LineNode)};
+}
+
 LineNode *BufferOffsetIndex::find_and_bubble_node_up_to_root(unsigned row) {
   auto left_ancestor_row = 0u;
   auto current_node = root;
@@ -9,11 +9,17 @@ struct LineNode;
 
 class BufferOffsetIndex {
  public:
+  // The heap memory a buffer offset index holds onto, in bytes.
+  struct MemoryUsage {
+    size_t nodes;
+  };
+
   BufferOffsetIndex();
   ~BufferOffsetIndex();
   void splice(unsigned, unsigned, std::vector<unsigned> const&);
   unsigned character_index_for_position(Point) const;
   Point position_for_character_index(unsigned) const;
+  MemoryUsage get_memory_usage() const;
 
  private:
   LineNode *find_and_bubble_node_up_to_root(unsigned);
@@ -8,6 +8,14 @@
 using std::default_random_engine;
 using std::unordered_map;
 
+// Each entry of a hash map lives in its own node, along with a link to the
+// next node in its bucket and, typically, its cached hash.
+template <typename Map>
+static size_t get_hash_map_memory_usage(const Map &map) {
+  return map.bucket_count() * sizeof(void *) +
+         map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void *));
+}
+
 MarkerIndex::Node::Node(Node *parent, Point left_extent) :
   parent {parent},
   left {nullptr},
@@ -684,6 +692,29 @@ void MarkerIndex::delete_node(Node *node) {
   delete node;
 }
 
+MarkerIndex::MemoryUsage MarkerIndex::get_memory_usage() const {
+  MemoryUsage result{0, 0, 0, 0};
+
+  std::vector<const Node *> node_stack;
+  if (root) node_stack.push_back(root);
+  while (!node_stack.empty()) {
+    const Node *node = node_stack.back();
+    node_stack.pop_back();
+    result.nodes += sizeof(Node);
+    result.marker_id_sets += (node->left_marker_ids.capacity() + node->right_marker_ids.capacity() +
+                              node->start_marker_ids.capacity() + node->end_marker_ids.capacity()) *
+                             sizeof(MarkerId);
+    if (node->left) node_stack.push_back(node->left);
+    if (node->right) node_stack.push_back(node->right);
+  }
+
+  result.marker_id_sets += exclusive_marker_ids.capacity() * sizeof(MarkerId);
+  result.id_maps = get_hash_map_memory_usage(start_nodes_by_id) +
+                   get_hash_map_memory_usage(end_nodes_by_id);
+  result.caches = get_hash_map_memory_usage(node_position_cache);
+  return result;
+}
+
 void MarkerIndex::delete_subtree(Node *node) {
   if (node->left) delete_subtree(node->left);
   if (node->right) delete_subtree(node->right);
@@ -19,6 +19,15 @@ public:
     flat_set<MarkerId> surround;
   };
 
+  // The heap memory a marker index holds onto, in bytes. Hash maps are
+  // estimated from their bucket and entry counts.
+  struct MemoryUsage {
+    size_t nodes;
+    size_t marker_id_sets;
+    size_t id_maps;
+    size_t caches;
+  };
+
   MarkerIndex(unsigned seed = 0u);
   ~MarkerIndex();
   int generate_random_number();
@@ -41,6 +50,7 @@ public:
   flat_set<MarkerId> find_ending_at(Point position);
 
   std::unordered_map<MarkerId, Range> dump();
+  MemoryUsage get_memory_usage() const;
 
 private:
   friend class Iterator;
@@ -0,0 +1,191 @@
+#include "newline-scan.h"
+#include <algorithm>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && \
+  !defined(__EMSCRIPTEN__)
+#define SUPERSTRING_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using std::vector;
+
+static const uint16_t NEWLINE = '\n';
+
+static size_t count_newlines_scalar(const uint16_t *begin, const uint16_t *end) {
+  size_t result = 0;
+  for (const uint16_t *iter = begin; iter != end; ++iter) {
+    if (*iter == NEWLINE) result++;
+  }
+  return result;
+}
+
+static const uint16_t *find_newline_scalar(const uint16_t *begin, const uint16_t *end, size_t n) {
+  if (n == 0) return end;
+  for (const uint16_t *iter = begin; iter != end; ++iter) {
+    if (*iter == NEWLINE && --n == 0) return iter;
+  }
+  return end;
+}
+
+static const uint16_t *find_last_newline_scalar(const uint16_t *begin, const uint16_t *end) {
+  for (const uint16_t *iter = end; iter != begin;) {
+    if (*--iter == NEWLINE) return iter;
+  }
+  return end;
+}
+
+#ifdef SUPERSTRING_X86_SIMD
+
+// Both vector implementations compare a block of code units against '\n' and
+// turn the result into a bit mask with two bits per code unit, which is what
+// `movemask_epi8` yields for 16-bit lanes. Counting and locating newlines then
+// comes down to popcount and bit scans on that mask.
+
+static const uint16_t *find_in_mask(const uint16_t *block, uint32_t mask, size_t *n) {
+  size_t count = __builtin_popcount(mask) / 2;
+  if (count < *n) {
+    *n -= count;
+    return nullptr;
+  }
+  for (size_t i = 1; i < *n; i++) mask &= mask - 1, mask &= mask - 1;
+  return block + __builtin_ctz(mask) / 2;
+}
+
+__attribute__((target("sse2")))
+static size_t count_newlines_sse2(const uint16_t *begin, const uint16_t *end) {
+  const __m128i newline = _mm_set1_epi16(NEWLINE);
+  size_t result = 0;
+  const uint16_t *iter = begin;
+  while (end - iter >= 8) {
+    // Each lane counts down from zero once per newline. The lanes are summed
+    // as signed 16-bit integers, so flush them before they could overflow.
+    const uint16_t *batch_end = iter + 8 * std::min<size_t>((end - iter) / 8, 0x7fff);
+    __m128i counts = _mm_setzero_si128();
+    for (; iter != batch_end; iter += 8) {
+      __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iter));
+      counts = _mm_sub_epi16(counts, _mm_cmpeq_epi16(block, newline));
+    }
+    __m128i sums = _mm_madd_epi16(counts, _mm_set1_epi16(1));
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), sums);
+    result += static_cast<size_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+  }
+  return result + count_newlines_scalar(iter, end);
+}
+
+__attribute__((target("sse2")))
+static const uint16_t *find_newline_sse2(const uint16_t *begin, const uint16_t *end, size_t n) {
+  if (n == 0) return end;
+  const __m128i newline = _mm_set1_epi16(NEWLINE);
+  const uint16_t *iter = begin;
+  for (; end - iter >= 8; iter += 8) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iter));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(block, newline));
+    if (mask) {
+      const uint16_t *result = find_in_mask(iter, mask, &n);
+      if (result) return result;
+    }
+  }
+  return find_newline_scalar(iter, end, n);
+}
+
+__attribute__((target("sse2")))
+static const uint16_t *find_last_newline_sse2(const uint16_t *begin, const uint16_t *end) {
+  const __m128i newline = _mm_set1_epi16(NEWLINE);
+  const uint16_t *iter = end;
+  for (; iter - begin >= 8; iter -= 8) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(iter - 8));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(block, newline));
+    if (mask) return iter - 8 + (31 - __builtin_clz(mask)) / 2;
+  }
+  const uint16_t *result = find_last_newline_scalar(begin, iter);
+  return result == iter ? end : result;
+}
+
+__attribute__((target("avx2")))
+static size_t count_newlines_avx2(const uint16_t *begin, const uint16_t *end) {
+  const __m256i newline = _mm256_set1_epi16(NEWLINE);
+  size_t result = 0;
+  const uint16_t *iter = begin;
+  while (end - iter >= 16) {
+    const uint16_t *batch_end = iter + 16 * std::min<size_t>((end - iter) / 16, 0x7fff);
+    __m256i counts = _mm256_setzero_si256();
+    for (; iter != batch_end; iter += 16) {
+      __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(iter));
+      counts = _mm256_sub_epi16(counts, _mm256_cmpeq_epi16(block, newline));
+    }
+    __m256i sums = _mm256_madd_epi16(counts, _mm256_set1_epi16(1));
+    uint32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), sums);
+    for (uint32_t lane : lanes) result += lane;
+  }
+  return result + count_newlines_sse2(iter, end);
+}
+
+__attribute__((target("avx2")))
+static const uint16_t *find_newline_avx2(const uint16_t *begin, const uint16_t *end, size_t n) {
+  if (n == 0) return end;
+  const __m256i newline = _mm256_set1_epi16(NEWLINE);
+  const uint16_t *iter = begin;
+  for (; end - iter >= 16; iter += 16) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(iter));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(block, newline));
+    if (mask) {
+      const uint16_t *result = find_in_mask(iter, mask, &n);
+      if (result) return result;
+    }
+  }
+  return find_newline_sse2(iter, end, n);
+}
+
+__attribute__((target("avx2")))
+static const uint16_t *find_last_newline_avx2(const uint16_t *begin, const uint16_t *end) {
+  const __m256i newline = _mm256_set1_epi16(NEWLINE);
+  const uint16_t *iter = end;
+  for (; iter - begin >= 16; iter -= 16) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(iter - 16));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(block, newline));
+    if (mask) return iter - 16 + (31 - __builtin_clz(mask)) / 2;
+  }
+  const uint16_t *result = find_last_newline_sse2(begin, iter);
+  return result == iter ? end : result;
+}
+
+#endif // SUPERSTRING_X86_SIMD
+
+static vector<NewlineScanner> build_newline_scanners() {
+  vector<NewlineScanner> result;
+#ifdef SUPERSTRING_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    result.push_back({"avx2", count_newlines_avx2, find_newline_avx2, find_last_newline_avx2});
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    result.push_back({"sse2", count_newlines_sse2, find_newline_sse2, find_last_newline_sse2});
+  }
+#endif
+  result.push_back({"scalar", count_newlines_scalar, find_newline_scalar, find_last_newline_scalar});
+  return result;
+}
+
+const vector<NewlineScanner> &get_newline_scanners() {
+  static const vector<NewlineScanner> scanners = build_newline_scanners();
+  return scanners;
+}
+
+static const NewlineScanner &get_newline_scanner() {
+  static const NewlineScanner &scanner = get_newline_scanners().front();
+  return scanner;
+}
+
+size_t count_newlines(const uint16_t *begin, const uint16_t *end) {
+  return get_newline_scanner().count_newlines(begin, end);
+}
+
+const uint16_t *find_newline(const uint16_t *begin, const uint16_t *end, size_t n) {
+  return get_newline_scanner().find_newline(begin, end, n);
+}
+
+const uint16_t *find_last_newline(const uint16_t *begin, const uint16_t *end) {
+  return get_newline_scanner().find_last_newline(begin, end);
+}
@@ -0,0 +1,30 @@
+#ifndef SUPERSTRING_NEWLINE_SCAN_H
+#define SUPERSTRING_NEWLINE_SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Counts the newlines in [begin, end).
+size_t count_newlines(const uint16_t *begin, const uint16_t *end);
+
+// Returns the `n`th newline in [begin, end), counting from 1, or `end` if
+// there are fewer than `n`.
+const uint16_t *find_newline(const uint16_t *begin, const uint16_t *end, size_t n = 1);
+
+// Returns the last newline in [begin, end), or `end` if there is none.
+const uint16_t *find_last_newline(const uint16_t *begin, const uint16_t *end);
+
+// The functions above dispatch to the fastest of these implementations that
+// the CPU supports, which is listed first. The others are exposed so that
+// they can be tested and benchmarked against each other.
+struct NewlineScanner {
+  const char *name;
+  size_t (*count_newlines)(const uint16_t *, const uint16_t *);
+  const uint16_t *(*find_newline)(const uint16_t *, const uint16_t *, size_t);
+  const uint16_t *(*find_last_newline)(const uint16_t *, const uint16_t *);
+};
+
+const std::vector<NewlineScanner> &get_newline_scanners();
+
+#endif // SUPERSTRING_NEWLINE_SCAN_H
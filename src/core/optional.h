@@ -1,16 +1,20 @@
 #ifndef SUPERSTRING_OPTIONAL_H
 #define SUPERSTRING_OPTIONAL_H
 
+#include <utility>
+
 template <typename T> class optional {
   T value;
   bool is_some;
 
 public:
   optional(const T &value) : value(value), is_some(true) {}
+  optional(T &&value) : value(std::move(value)), is_some(true) {}
   optional() : value(T()), is_some(false) {}
 
 
   const T &operator*() const { return value; }
+  T &operator*() { return value; }
   operator bool() const { return is_some; }
 };
 
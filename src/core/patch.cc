@@ -1,11 +1,20 @@
 #include "patch.h"
+#include "newline-scan.h"
 #include "optional.h"
+#include "serializer.h"
 #include "text.h"
+#include "text_arena.h"
+#include <algorithm>
 #include <assert.h>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <stdio.h>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #ifdef _WIN32
@@ -21,6 +30,62 @@ using std::ostream;
 using std::endl;
 typedef Patch::Hunk Hunk;
 
+static const size_t MIN_INDEXED_TEXT_SIZE = 1024;
+static const size_t LINE_STARTS_CACHE_SIZE = 4;
+
+// Totals over a run of consecutive hunks. The rows are relative to the start
+// of the run's coordinate space, which for a subtree is the end of its left
+// ancestor, so rotating nodes above a subtree doesn't change its summary.
+struct Patch::ChangeSummary {
+  struct ChangedRows {
+    uint32_t count;
+    uint32_t first;
+    uint32_t last;
+
+    // Appends the rows of a later run, which start `row_offset` rows after
+    // the start of this one. A row shared by both runs is counted once.
+    void append(const ChangedRows &other, uint32_t row_offset) {
+      if (other.count == 0) return;
+      if (count == 0) {
+        *this = {other.count, other.first + row_offset, other.last + row_offset};
+        return;
+      }
+      count += other.count - (last == other.first + row_offset ? 1 : 0);
+      last = other.last + row_offset;
+    }
+  };
+
+  uint32_t hunk_count;
+  size_t old_text_size;
+  size_t new_text_size;
+  ChangedRows old_rows;
+  ChangedRows new_rows;
+
+  // Summarizes a single hunk, relative to the start of the coordinate space
+  // that its positions are given in.
+  static ChangeSummary for_hunk(const Hunk &hunk) {
+    return ChangeSummary{
+      1,
+      hunk.old_text.size(),
+      hunk.new_text.size(),
+      {hunk.old_end.row - hunk.old_start.row + 1, hunk.old_start.row, hunk.old_end.row},
+      {hunk.new_end.row - hunk.new_start.row + 1, hunk.new_start.row, hunk.new_end.row}
+    };
+  }
+
+  void append(const ChangeSummary &other, uint32_t old_row_offset, uint32_t new_row_offset) {
+    hunk_count += other.hunk_count;
+    old_text_size += other.old_text_size;
+    new_text_size += other.new_text_size;
+    old_rows.append(other.old_rows, old_row_offset);
+    new_rows.append(other.new_rows, new_row_offset);
+  }
+
+  ChangeStatistics get_statistics() const {
+    return ChangeStatistics{hunk_count, old_text_size, new_text_size, old_rows.count, new_rows.count};
+  }
+};
+
 struct Patch::Node {
   Node *left;
   Node *right;
@@ -30,8 +95,64 @@ struct Patch::Node {
   Point old_extent;
   Point new_extent;
 
-  unique_ptr<Text> old_text;
-  unique_ptr<Text> new_text;
+  // Views of texts stored in the patch's text arena, or in the buffer that a
+  // viewed patch was deserialized from.
+  TextView old_text;
+  TextView new_text;
+
+  // The number of versions of the patch, or parent nodes in other versions,
+  // that share this node. Shared nodes are never modified.
+  uint32_t reference_count;
+
+  // Totals for this node and its descendants, which must be recomputed
+  // whenever either of them changes or the node gets different children.
+  ChangeSummary subtree_summary;
+
+  void update_subtree_summary() {
+    uint32_t old_start_row = old_distance_from_left_ancestor.row;
+    uint32_t new_start_row = new_distance_from_left_ancestor.row;
+    uint32_t old_end_row = old_start_row + old_extent.row;
+    uint32_t new_end_row = new_start_row + new_extent.row;
+    ChangeSummary summary{
+      1,
+      old_text.size(),
+      new_text.size(),
+      {old_extent.row + 1, old_start_row, old_end_row},
+      {new_extent.row + 1, new_start_row, new_end_row}
+    };
+
+    // Rows are shared with a neighboring subtree only where it ends on the
+    // row this hunk starts on, or starts on the row this hunk ends on.
+    if (left) {
+      const ChangeSummary &left_summary = left->subtree_summary;
+      summary.hunk_count += left_summary.hunk_count;
+      summary.old_text_size += left_summary.old_text_size;
+      summary.new_text_size += left_summary.new_text_size;
+      summary.old_rows.count += left_summary.old_rows.count - (left_summary.old_rows.last == old_start_row);
+      summary.new_rows.count += left_summary.new_rows.count - (left_summary.new_rows.last == new_start_row);
+      summary.old_rows.first = left_summary.old_rows.first;
+      summary.new_rows.first = left_summary.new_rows.first;
+    }
+    if (right) {
+      const ChangeSummary &right_summary = right->subtree_summary;
+      summary.hunk_count += right_summary.hunk_count;
+      summary.old_text_size += right_summary.old_text_size;
+      summary.new_text_size += right_summary.new_text_size;
+      summary.old_rows.count += right_summary.old_rows.count - (right_summary.old_rows.first == 0);
+      summary.new_rows.count += right_summary.new_rows.count - (right_summary.new_rows.first == 0);
+      summary.old_rows.last = old_end_row + right_summary.old_rows.last;
+      summary.new_rows.last = new_end_row + right_summary.new_rows.last;
+    }
+    subtree_summary = summary;
+  }
+
+  // Recomputes the summaries of this node and its children, which are the only
+  // nodes that a splice modifies once it has splayed them to the top.
+  void update_top_subtree_summaries() {
+    if (left && left->reference_count == 1) left->update_subtree_summary();
+    if (right && right->reference_count == 1) right->update_subtree_summary();
+    update_subtree_summary();
+  }
 
   void get_subtree_end(Point *old_end, Point *new_end) {
     Node *node = this;
@@ -46,30 +167,51 @@ struct Patch::Node {
     }
   }
 
-  Node *copy() {
-    return new Node{
+  Hunk get_hunk(Point left_ancestor_old_end, Point left_ancestor_new_end) const {
+    Point old_start = left_ancestor_old_end.traverse(old_distance_from_left_ancestor);
+    Point new_start = left_ancestor_new_end.traverse(new_distance_from_left_ancestor);
+    return Hunk{old_start, old_start.traverse(old_extent),
+                new_start, new_start.traverse(new_extent),
+                old_text, new_text};
+  }
+
+  // Copies this node, sharing its children and texts with the original.
+  Node *copy(slab_allocator<Node> &allocator) {
+    if (left) left->reference_count++;
+    if (right) right->reference_count++;
+    return allocator.allocate(
         left,
         right,
         old_distance_from_left_ancestor,
         new_distance_from_left_ancestor,
         old_extent,
         new_extent,
-        old_text ? unique_ptr<Text>(new Text(*old_text)) : nullptr,
-        new_text ? unique_ptr<Text>(new Text(*new_text)) : nullptr,
-    };
+        old_text,
+        new_text,
+        1u,
+        subtree_summary
+    );
   }
 
-  Node *invert() {
-    return new Node{
+  Node *invert(slab_allocator<Node> &allocator) {
+    return allocator.allocate(
         left,
         right,
         new_distance_from_left_ancestor,
         old_distance_from_left_ancestor,
         new_extent,
         old_extent,
-        new_text ? unique_ptr<Text>(new Text(*new_text)) : nullptr,
-        old_text ? unique_ptr<Text>(new Text(*old_text)) : nullptr,
-    };
+        new_text,
+        old_text,
+        1u,
+        ChangeSummary{
+          subtree_summary.hunk_count,
+          subtree_summary.new_text_size,
+          subtree_summary.old_text_size,
+          subtree_summary.new_rows,
+          subtree_summary.old_rows
+        }
+    );
   }
 
   void write_dot_graph(std::stringstream &result, Point left_ancestor_old_end, Point left_ancestor_new_end) {
@@ -82,8 +224,8 @@ struct Patch::Node {
       << "label=\""
       << "new range: " << node_new_start << " - " << node_new_end << ", " << endl
       << "old range: " << node_old_start << " - " << node_old_end << ", " << endl
-      << "new text: " << new_text.get() << endl << ", "
-      << "old text: " << old_text.get() << endl
+      << "new text: " << new_text << endl << ", "
+      << "old text: " << old_text << endl
       << "\""
       << "tooltip=\"" << this
       << "\"]" << endl;
@@ -141,6 +283,59 @@ struct Patch::PositionStackEntry {
   Point new_end;
 };
 
+// A node along with its absolute start in both coordinate spaces, used while
+// rebuilding a tree from a sorted sequence of hunks.
+struct Patch::PositionedNode {
+  Node *node;
+  Point old_start;
+  Point old_end;
+  Point new_start;
+  Point new_end;
+
+  PositionedNode() : node{nullptr} {}
+
+  PositionedNode(Node *node, Point old_start, Point new_start)
+      : node{node}, old_start{old_start}, old_end{old_start.traverse(node->old_extent)},
+        new_start{new_start}, new_end{new_start.traverse(node->new_extent)} {}
+
+  Hunk hunk() const {
+    return Hunk{old_start, old_end, new_start, new_end,
+                node->old_text, node->new_text};
+  }
+
+  // Text between consecutive hunks is unchanged, so it has the same extent in
+  // both coordinate spaces. This lets a hunk's new start be recovered from
+  // the hunk preceding it after splices have shifted it.
+  void update_new_start(const PositionedNode *preceding_hunk) {
+    if (preceding_hunk) {
+      new_start = preceding_hunk->new_end.traverse(old_start.traversal(preceding_hunk->old_end));
+    } else {
+      new_start = old_start;
+    }
+    new_end = new_start.traverse(node->new_extent);
+  }
+};
+
+// A splice whose texts may be borrowed from another patch, such as a hunk
+// being composed into this one. Borrowed texts are only copied into the text
+// arena if they end up in a node unchanged; otherwise they are sliced directly
+// into merged texts.
+struct Patch::BatchSplice {
+  Point start;
+  Point deletion_extent;
+  Point insertion_extent;
+  TextView deleted_text;
+  TextView inserted_text;
+};
+
+// The line starts of a long text in the text arena, keyed by its location.
+// Texts in the arena never change, so they stay valid until it's compacted.
+struct Patch::CachedLineStarts {
+  const uint16_t *text;
+  size_t size;
+  vector<uint32_t> line_starts;
+};
+
 struct Patch::OldCoordinates {
   static Point distance_from_left_ancestor(const Node *node) {
     return node->old_distance_from_left_ancestor;
@@ -148,6 +343,8 @@ struct Patch::OldCoordinates {
   static Point extent(const Node *node) { return node->old_extent; }
   static Point start(const Hunk &hunk) { return hunk.old_start; }
   static Point end(const Hunk &hunk) { return hunk.old_end; }
+  static TextView text(const Hunk &hunk) { return hunk.old_text; }
+  static Point select(Point old_point, Point) { return old_point; }
 };
 
 struct Patch::NewCoordinates {
@@ -157,267 +354,1241 @@ struct Patch::NewCoordinates {
   static Point extent(const Node *node) { return node->new_extent; }
   static Point start(const Hunk &hunk) { return hunk.new_start; }
   static Point end(const Hunk &hunk) { return hunk.new_end; }
+  static TextView text(const Hunk &hunk) { return hunk.new_text; }
+  static Point select(Point, Point new_point) { return new_point; }
 };
 
-Patch::Patch()
-    : root{nullptr}, frozen_node_array{nullptr}, merges_adjacent_hunks{true},
-      hunk_count{0} {}
+// The B+ tree backend stores hunks in order in its leaves, each positioned by
+// its distance from the end of the hunk before it, so that a splice only
+// changes the hunks it touches and the distance of the hunk that follows them.
+// Internal nodes describe each child by the distances from the end of the
+// hunk before the child to the start of its first hunk and to the end of its
+// last hunk, along with the totals for its hunks. Every field is stored in an
+// array of its own, so that searching a node reads positions packed together.
+// Nodes are searched linearly, since positions are relative to one another,
+// and wider nodes make those scans cost more than the levels they save.
+static const uint32_t BTREE_NODE_CAPACITY = 16;
+static const uint32_t BTREE_MIN_NODE_SIZE = BTREE_NODE_CAPACITY / 2;
 
-Patch::Patch(bool merges_adjacent_hunks)
-    : root{nullptr}, frozen_node_array{nullptr},
-      merges_adjacent_hunks{merges_adjacent_hunks}, hunk_count{0} {}
+template <typename T>
+static void insert_into_array(T *array, uint32_t size, uint32_t index, const T &value) {
+  std::copy_backward(array + index, array + size, array + size + 1);
+  array[index] = value;
+}
 
-Patch::Patch(Patch &&other)
-    : root{nullptr}, frozen_node_array{other.frozen_node_array},
-      merges_adjacent_hunks{other.merges_adjacent_hunks},
-      hunk_count{other.hunk_count} {
-  std::swap(root, other.root);
-  std::swap(left_ancestor_stack, other.left_ancestor_stack);
-  std::swap(node_stack, other.node_stack);
+template <typename T>
+static void erase_from_array(T *array, uint32_t size, uint32_t index) {
+  std::copy(array + index + 1, array + size, array + index);
 }
 
-Patch::Patch(Node *root, uint32_t hunk_count, bool merges_adjacent_hunks)
-    : root{root}, frozen_node_array{nullptr},
-      merges_adjacent_hunks{merges_adjacent_hunks}, hunk_count{hunk_count} {}
+// Moves `count` elements from one array to another, opening a gap for them
+// in the destination and closing the one they leave in the source.
+template <typename T>
+static void move_between_arrays(T *from, uint32_t from_size, uint32_t from_index,
+                                T *to, uint32_t to_size, uint32_t to_index, uint32_t count) {
+  std::copy_backward(to + to_index, to + to_size, to + to_size + count);
+  std::copy(from + from_index, from + from_index + count, to + to_index);
+  std::copy(from + from_index + count, from + from_size, from + from_index);
+}
 
-Patch::Patch(const vector<const Patch *> &patches_to_compose) : Patch() {
-  bool left_to_right = true;
-  for (const Patch *patch : patches_to_compose) {
-    auto hunks = patch->get_hunks();
+struct Patch::BTreeEntry {
+  Point old_distance;
+  Point new_distance;
+  Point old_extent;
+  Point new_extent;
+  TextView old_text;
+  TextView new_text;
+};
+
+struct Patch::BTreeNode {
+  uint32_t count;
+  bool is_leaf;
+
+  BTreeNode(bool is_leaf) : count{0}, is_leaf{is_leaf} {}
+};
+
+// Each array has room for one more entry than a node holds, so that a full
+// node can take an insertion before it is split.
+struct Patch::BTreeLeaf : BTreeNode {
+  Point old_distances[BTREE_NODE_CAPACITY + 1];
+  Point new_distances[BTREE_NODE_CAPACITY + 1];
+  Point old_extents[BTREE_NODE_CAPACITY + 1];
+  Point new_extents[BTREE_NODE_CAPACITY + 1];
+  TextView old_texts[BTREE_NODE_CAPACITY + 1];
+  TextView new_texts[BTREE_NODE_CAPACITY + 1];
+  BTreeLeaf *next;
+
+  BTreeLeaf() : BTreeNode(true), next{nullptr} {}
+
+  Hunk get_hunk(uint32_t i, Point preceding_old_end, Point preceding_new_end) const {
+    Point old_start = preceding_old_end.traverse(old_distances[i]);
+    Point new_start = preceding_new_end.traverse(new_distances[i]);
+    return Hunk{old_start, old_start.traverse(old_extents[i]),
+                new_start, new_start.traverse(new_extents[i]),
+                old_texts[i], new_texts[i]};
+  }
+
+  BTreeEntry get_entry(uint32_t i) const {
+    return BTreeEntry{old_distances[i], new_distances[i], old_extents[i], new_extents[i],
+                      old_texts[i], new_texts[i]};
+  }
 
-    if (left_to_right) {
-      for (auto iter = hunks.begin(), end = hunks.end(); iter != end; ++iter) {
-        splice(iter->new_start, iter->old_end.traversal(iter->old_start),
-               iter->new_end.traversal(iter->new_start),
-               iter->old_text ? unique_ptr<Text>{new Text(*iter->old_text)} : nullptr,
-               iter->new_text ? unique_ptr<Text>{new Text(*iter->new_text)} : nullptr);
+  void set_entry(uint32_t i, const BTreeEntry &entry) {
+    old_distances[i] = entry.old_distance;
+    new_distances[i] = entry.new_distance;
+    old_extents[i] = entry.old_extent;
+    new_extents[i] = entry.new_extent;
+    old_texts[i] = entry.old_text;
+    new_texts[i] = entry.new_text;
+  }
+
+  void insert_entry(uint32_t i, const BTreeEntry &entry) {
+    insert_into_array(old_distances, count, i, entry.old_distance);
+    insert_into_array(new_distances, count, i, entry.new_distance);
+    insert_into_array(old_extents, count, i, entry.old_extent);
+    insert_into_array(new_extents, count, i, entry.new_extent);
+    insert_into_array(old_texts, count, i, entry.old_text);
+    insert_into_array(new_texts, count, i, entry.new_text);
+    count++;
+  }
+
+  void erase_entry(uint32_t i) {
+    erase_from_array(old_distances, count, i);
+    erase_from_array(new_distances, count, i);
+    erase_from_array(old_extents, count, i);
+    erase_from_array(new_extents, count, i);
+    erase_from_array(old_texts, count, i);
+    erase_from_array(new_texts, count, i);
+    count--;
+  }
+
+  void move_entries(uint32_t from_index, BTreeLeaf *to, uint32_t to_index, uint32_t move_count) {
+    move_between_arrays(old_distances, count, from_index, to->old_distances, to->count, to_index, move_count);
+    move_between_arrays(new_distances, count, from_index, to->new_distances, to->count, to_index, move_count);
+    move_between_arrays(old_extents, count, from_index, to->old_extents, to->count, to_index, move_count);
+    move_between_arrays(new_extents, count, from_index, to->new_extents, to->count, to_index, move_count);
+    move_between_arrays(old_texts, count, from_index, to->old_texts, to->count, to_index, move_count);
+    move_between_arrays(new_texts, count, from_index, to->new_texts, to->count, to_index, move_count);
+    count -= move_count;
+    to->count += move_count;
+  }
+};
+
+struct Patch::BTreeInternal : BTreeNode {
+  Point old_distances[BTREE_NODE_CAPACITY + 1];
+  Point new_distances[BTREE_NODE_CAPACITY + 1];
+  Point old_spans[BTREE_NODE_CAPACITY + 1];
+  Point new_spans[BTREE_NODE_CAPACITY + 1];
+  uint32_t hunk_counts[BTREE_NODE_CAPACITY + 1];
+  ChangeSummary summaries[BTREE_NODE_CAPACITY + 1];
+  BTreeNode *children[BTREE_NODE_CAPACITY + 1];
+
+  BTreeInternal() : BTreeNode(false) {}
+
+  // Recomputes the description of a child after its hunks have changed. The
+  // rows of its totals are relative to the end of the hunk before it.
+  void update_child(uint32_t i) {
+    Point old_end, new_end;
+    ChangeSummary summary{};
+    if (children[i]->is_leaf) {
+      const BTreeLeaf *leaf = static_cast<const BTreeLeaf *>(children[i]);
+      for (uint32_t j = 0; j < leaf->count; j++) {
+        Hunk hunk = leaf->get_hunk(j, old_end, new_end);
+        summary.append(ChangeSummary::for_hunk(hunk), 0, 0);
+        old_end = hunk.old_end;
+        new_end = hunk.new_end;
       }
+      old_distances[i] = leaf->old_distances[0];
+      new_distances[i] = leaf->new_distances[0];
     } else {
-      for (auto iter = hunks.rbegin(), end = hunks.rend(); iter != end;
-           ++iter) {
-        splice(iter->old_start, iter->old_end.traversal(iter->old_start),
-               iter->new_end.traversal(iter->new_start),
-               iter->old_text ? unique_ptr<Text>{new Text(*iter->old_text)} : nullptr,
-               iter->new_text ? unique_ptr<Text>{new Text(*iter->new_text)} : nullptr);
+      const BTreeInternal *node = static_cast<const BTreeInternal *>(children[i]);
+      for (uint32_t j = 0; j < node->count; j++) {
+        summary.append(node->summaries[j], old_end.row, new_end.row);
+        old_end = old_end.traverse(node->old_spans[j]);
+        new_end = new_end.traverse(node->new_spans[j]);
       }
+      old_distances[i] = node->old_distances[0];
+      new_distances[i] = node->new_distances[0];
     }
+    old_spans[i] = old_end;
+    new_spans[i] = new_end;
+    hunk_counts[i] = summary.hunk_count;
+    summaries[i] = summary;
+  }
 
-    left_to_right = !left_to_right;
+  void insert_child(uint32_t i, BTreeNode *child) {
+    insert_into_array(old_distances, count, i, Point());
+    insert_into_array(new_distances, count, i, Point());
+    insert_into_array(old_spans, count, i, Point());
+    insert_into_array(new_spans, count, i, Point());
+    insert_into_array(hunk_counts, count, i, 0u);
+    insert_into_array(summaries, count, i, ChangeSummary{});
+    insert_into_array(children, count, i, child);
+    count++;
+    update_child(i);
   }
-}
 
-Patch::~Patch() {
-  if (root) {
-    if (frozen_node_array) {
-      free(frozen_node_array);
-    } else {
-      delete_node(&root);
+  void erase_child(uint32_t i) {
+    erase_from_array(old_distances, count, i);
+    erase_from_array(new_distances, count, i);
+    erase_from_array(old_spans, count, i);
+    erase_from_array(new_spans, count, i);
+    erase_from_array(hunk_counts, count, i);
+    erase_from_array(summaries, count, i);
+    erase_from_array(children, count, i);
+    count--;
+  }
+
+  void move_children(uint32_t from_index, BTreeInternal *to, uint32_t to_index, uint32_t move_count) {
+    move_between_arrays(old_distances, count, from_index, to->old_distances, to->count, to_index, move_count);
+    move_between_arrays(new_distances, count, from_index, to->new_distances, to->count, to_index, move_count);
+    move_between_arrays(old_spans, count, from_index, to->old_spans, to->count, to_index, move_count);
+    move_between_arrays(new_spans, count, from_index, to->new_spans, to->count, to_index, move_count);
+    move_between_arrays(hunk_counts, count, from_index, to->hunk_counts, to->count, to_index, move_count);
+    move_between_arrays(summaries, count, from_index, to->summaries, to->count, to_index, move_count);
+    move_between_arrays(children, count, from_index, to->children, to->count, to_index, move_count);
+    count -= move_count;
+    to->count += move_count;
+  }
+
+  // Returns the child that holds the hunk at the given index, making the
+  // index relative to that child. An index past the last hunk falls in the
+  // last child.
+  uint32_t find_child(uint32_t *index) const {
+    uint32_t i = 0;
+    while (i + 1 < count && *index >= hunk_counts[i]) {
+      *index -= hunk_counts[i];
+      i++;
     }
+    return i;
   }
-}
+};
 
-Patch::Node *Patch::build_node(Node *left, Node *right,
-                       Point old_distance_from_left_ancestor,
-                       Point new_distance_from_left_ancestor, Point old_extent,
-                       Point new_extent, unique_ptr<Text> old_text,
-                       unique_ptr<Text> new_text) {
-  hunk_count++;
-  return new Node{left,
-                  right,
-                  old_distance_from_left_ancestor,
-                  new_distance_from_left_ancestor,
-                  old_extent,
-                  new_extent,
-                  move(old_text),
-                  move(new_text)};
-}
+// A hunk's place in a B+ tree, along with the end of the hunk before it. Past
+// the last hunk, the leaf is null and the end is that of the last hunk.
+struct Patch::BTreePosition {
+  const BTreeLeaf *leaf;
+  uint32_t leaf_index;
+  uint32_t index;
+  Point preceding_old_end;
+  Point preceding_new_end;
+
+  Hunk get_hunk() const {
+    return leaf->get_hunk(leaf_index, preceding_old_end, preceding_new_end);
+  }
 
-void Patch::delete_node(Node **node_to_delete) {
-  if (*node_to_delete) {
-    node_stack.clear();
-    node_stack.push_back(*node_to_delete);
+  BTreeEntry get_entry() const { return leaf->get_entry(leaf_index); }
+};
 
-    while (!node_stack.empty()) {
-      Node *node = node_stack.back();
-      node_stack.pop_back();
-      if (node->left)
-        node_stack.push_back(node->left);
-      if (node->right)
-        node_stack.push_back(node->right);
-      delete node;
-      hunk_count--;
-    }
+struct Patch::BTree {
+  slab_allocator<BTreeLeaf> leaf_allocator;
+  slab_allocator<BTreeInternal> internal_allocator;
+  BTreeNode *root;
+  uint32_t height;
 
-    *node_to_delete = nullptr;
+  BTree() : root{nullptr}, height{0} {}
+
+  BTreePosition get_first_position() const {
+    const BTreeNode *node = root;
+    while (node && !node->is_leaf) node = static_cast<const BTreeInternal *>(node)->children[0];
+    return BTreePosition{static_cast<const BTreeLeaf *>(node), 0, 0, Point(), Point()};
   }
-}
 
-template <typename CoordinateSpace>
-Patch::Node *Patch::splay_node_ending_before(Point target) {
-  Node *splayed_node = nullptr;
-  Point left_ancestor_end = Point();
-  Node *node = root;
+  void advance(BTreePosition *position) const {
+    const BTreeLeaf *leaf = position->leaf;
+    uint32_t i = position->leaf_index;
+    position->preceding_old_end =
+      position->preceding_old_end.traverse(leaf->old_distances[i]).traverse(leaf->old_extents[i]);
+    position->preceding_new_end =
+      position->preceding_new_end.traverse(leaf->new_distances[i]).traverse(leaf->new_extents[i]);
+    position->index++;
+    if (++position->leaf_index == leaf->count) {
+      position->leaf = leaf->next;
+      position->leaf_index = 0;
+    }
+  }
 
-  node_stack.clear();
-  size_t splayed_node_ancestor_count = 0;
-  while (node) {
-    Point node_start = left_ancestor_end.traverse(
-        CoordinateSpace::distance_from_left_ancestor(node));
-    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
-    if (node_end <= target) {
-      splayed_node = node;
-      splayed_node_ancestor_count = node_stack.size();
-      if (node->right) {
-        left_ancestor_end = node_start.traverse(CoordinateSpace::extent(node));
-        node_stack.push_back(node);
-        node = node->right;
-      } else {
-        break;
+  // Finds the last hunk whose start satisfies the predicate, which must hold
+  // for some prefix of the hunks. Returns false if it holds for none of them.
+  template <typename CoordinateSpace, typename Predicate>
+  bool find_last_starting(Predicate predicate, BTreePosition *position) const {
+    if (!root) return false;
+    const BTreeNode *node = root;
+    Point old_first_distance = node->is_leaf ?
+      static_cast<const BTreeLeaf *>(node)->old_distances[0] :
+      static_cast<const BTreeInternal *>(node)->old_distances[0];
+    Point new_first_distance = node->is_leaf ?
+      static_cast<const BTreeLeaf *>(node)->new_distances[0] :
+      static_cast<const BTreeInternal *>(node)->new_distances[0];
+    if (!predicate(CoordinateSpace::select(old_first_distance, new_first_distance))) return false;
+
+    // Each node is entered through a child whose first hunk satisfies the
+    // predicate, so only the later children need to be checked.
+    BTreePosition result{nullptr, 0, 0, Point(), Point()};
+    while (!node->is_leaf) {
+      const BTreeInternal *internal = static_cast<const BTreeInternal *>(node);
+      uint32_t i = 0;
+      while (i + 1 < internal->count) {
+        Point old_end = result.preceding_old_end.traverse(internal->old_spans[i]);
+        Point new_end = result.preceding_new_end.traverse(internal->new_spans[i]);
+        if (!predicate(CoordinateSpace::select(old_end.traverse(internal->old_distances[i + 1]),
+                                               new_end.traverse(internal->new_distances[i + 1])))) {
+          break;
+        }
+        result.preceding_old_end = old_end;
+        result.preceding_new_end = new_end;
+        result.index += internal->hunk_counts[i];
+        i++;
       }
-    } else {
-      if (node->left) {
-        node_stack.push_back(node);
-        node = node->left;
-      } else {
+      node = internal->children[i];
+    }
+
+    const BTreeLeaf *leaf = static_cast<const BTreeLeaf *>(node);
+    uint32_t i = 0;
+    while (i + 1 < leaf->count) {
+      Point old_end = result.preceding_old_end.traverse(leaf->old_distances[i]).traverse(leaf->old_extents[i]);
+      Point new_end = result.preceding_new_end.traverse(leaf->new_distances[i]).traverse(leaf->new_extents[i]);
+      if (!predicate(CoordinateSpace::select(old_end.traverse(leaf->old_distances[i + 1]),
+                                             new_end.traverse(leaf->new_distances[i + 1])))) {
         break;
       }
+      result.preceding_old_end = old_end;
+      result.preceding_new_end = new_end;
+      result.index++;
+      i++;
     }
+    result.leaf = leaf;
+    result.leaf_index = i;
+    *position = result;
+    return true;
   }
 
-  if (splayed_node) {
-    node_stack.resize(splayed_node_ancestor_count);
-    splay_node(splayed_node);
+  // Finds the first hunk whose start satisfies the predicate, which must hold
+  // for some suffix of the hunks.
+  template <typename CoordinateSpace, typename Predicate>
+  BTreePosition find_first_starting(Predicate predicate) const {
+    BTreePosition position;
+    if (!find_last_starting<CoordinateSpace>([&predicate](Point start) { return !predicate(start); },
+                                             &position)) {
+      return get_first_position();
+    }
+    advance(&position);
+    return position;
   }
 
-  return splayed_node;
-}
-
-template <typename CoordinateSpace>
-Patch::Node *Patch::splay_node_starting_before(Point target) {
-  Node *splayed_node = nullptr;
-  Point left_ancestor_end = Point();
-  Node *node = root;
-
-  node_stack.clear();
-  size_t splayed_node_ancestor_count = 0;
-  while (node) {
-    Point node_start = left_ancestor_end.traverse(
-        CoordinateSpace::distance_from_left_ancestor(node));
-    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
-    if (node_start <= target) {
-      splayed_node = node;
-      splayed_node_ancestor_count = node_stack.size();
-      if (node->right) {
-        left_ancestor_end = node_end;
-        node_stack.push_back(node);
-        node = node->right;
-      } else {
-        break;
+  // Finds the first hunk whose end satisfies the predicate, which must hold
+  // for some suffix of the hunks.
+  template <typename CoordinateSpace, typename Predicate>
+  BTreePosition find_first_ending(Predicate predicate) const {
+    BTreePosition result{nullptr, 0, 0, Point(), Point()};
+    const BTreeNode *node = root;
+    if (!node) return result;
+
+    // Only the root can lack a child whose last hunk satisfies the predicate.
+    while (!node->is_leaf) {
+      const BTreeInternal *internal = static_cast<const BTreeInternal *>(node);
+      uint32_t i = 0;
+      for (; i < internal->count; i++) {
+        Point old_end = result.preceding_old_end.traverse(internal->old_spans[i]);
+        Point new_end = result.preceding_new_end.traverse(internal->new_spans[i]);
+        if (predicate(CoordinateSpace::select(old_end, new_end))) break;
+        result.preceding_old_end = old_end;
+        result.preceding_new_end = new_end;
+        result.index += internal->hunk_counts[i];
       }
-    } else {
-      if (node->left) {
-        node_stack.push_back(node);
-        node = node->left;
-      } else {
-        break;
+      if (i == internal->count) return result;
+      node = internal->children[i];
+    }
+
+    const BTreeLeaf *leaf = static_cast<const BTreeLeaf *>(node);
+    for (uint32_t i = 0; i < leaf->count; i++) {
+      Hunk hunk = leaf->get_hunk(i, result.preceding_old_end, result.preceding_new_end);
+      if (predicate(CoordinateSpace::end(hunk))) {
+        result.leaf = leaf;
+        result.leaf_index = i;
+        return result;
       }
+      result.preceding_old_end = hunk.old_end;
+      result.preceding_new_end = hunk.new_end;
+      result.index++;
     }
+    return result;
   }
 
-  if (splayed_node) {
-    node_stack.resize(splayed_node_ancestor_count);
-    splay_node(splayed_node);
+  BTreeEntry get(uint32_t index) const {
+    const BTreeNode *node = root;
+    while (!node->is_leaf) {
+      const BTreeInternal *internal = static_cast<const BTreeInternal *>(node);
+      node = internal->children[internal->find_child(&index)];
+    }
+    return static_cast<const BTreeLeaf *>(node)->get_entry(index);
   }
 
-  return splayed_node;
-}
+  void set(BTreeNode *node, uint32_t index, const BTreeEntry &entry) {
+    if (node->is_leaf) {
+      static_cast<BTreeLeaf *>(node)->set_entry(index, entry);
+      return;
+    }
+    BTreeInternal *internal = static_cast<BTreeInternal *>(node);
+    uint32_t i = internal->find_child(&index);
+    set(internal->children[i], index, entry);
+    internal->update_child(i);
+  }
 
-template <typename CoordinateSpace>
-Patch::Node *Patch::splay_node_ending_after(Point splice_start, Point splice_end) {
-  Node *splayed_node = nullptr;
-  Point left_ancestor_end = Point();
-  Node *node = root;
+  // Returns the new right sibling of the node if the insertion split it.
+  BTreeNode *insert(BTreeNode *node, uint32_t index, const BTreeEntry &entry) {
+    if (node->is_leaf) {
+      BTreeLeaf *leaf = static_cast<BTreeLeaf *>(node);
+      leaf->insert_entry(index, entry);
+      if (leaf->count <= BTREE_NODE_CAPACITY) return nullptr;
+      BTreeLeaf *sibling = leaf_allocator.allocate();
+      leaf->move_entries(leaf->count / 2, sibling, 0, leaf->count - leaf->count / 2);
+      sibling->next = leaf->next;
+      leaf->next = sibling;
+      return sibling;
+    }
 
-  node_stack.clear();
-  size_t splayed_node_ancestor_count = 0;
-  while (node) {
-    Point node_start = left_ancestor_end.traverse(
-        CoordinateSpace::distance_from_left_ancestor(node));
-    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
-    if (node_end >= splice_end && node_end > splice_start) {
-      splayed_node = node;
-      splayed_node_ancestor_count = node_stack.size();
-      if (node->left) {
-        node_stack.push_back(node);
-        node = node->left;
-      } else {
-        break;
-      }
-    } else {
-      if (node->right) {
-        left_ancestor_end = node_end;
-        node_stack.push_back(node);
-        node = node->right;
-      } else {
-        break;
-      }
+    BTreeInternal *internal = static_cast<BTreeInternal *>(node);
+    uint32_t i = internal->find_child(&index);
+    BTreeNode *child_sibling = insert(internal->children[i], index, entry);
+    internal->update_child(i);
+    if (!child_sibling) return nullptr;
+    internal->insert_child(i + 1, child_sibling);
+    if (internal->count <= BTREE_NODE_CAPACITY) return nullptr;
+    BTreeInternal *sibling = internal_allocator.allocate();
+    internal->move_children(internal->count / 2, sibling, 0, internal->count - internal->count / 2);
+    return sibling;
+  }
+
+  void insert(uint32_t index, const BTreeEntry &entry) {
+    if (!root) {
+      root = leaf_allocator.allocate();
+      height = 1;
+    }
+    BTreeNode *sibling = insert(root, index, entry);
+    if (sibling) {
+      BTreeInternal *new_root = internal_allocator.allocate();
+      new_root->insert_child(0, root);
+      new_root->insert_child(1, sibling);
+      root = new_root;
+      height++;
     }
   }
 
-  if (splayed_node) {
-    node_stack.resize(splayed_node_ancestor_count);
-    splay_node(splayed_node);
+  void erase(BTreeNode *node, uint32_t index) {
+    if (node->is_leaf) {
+      static_cast<BTreeLeaf *>(node)->erase_entry(index);
+      return;
+    }
+    BTreeInternal *internal = static_cast<BTreeInternal *>(node);
+    uint32_t i = internal->find_child(&index);
+    erase(internal->children[i], index);
+    if (internal->children[i]->count < BTREE_MIN_NODE_SIZE) {
+      fix_underflow(internal, i);
+    } else {
+      internal->update_child(i);
+    }
   }
 
-  return splayed_node;
-}
+  void erase(uint32_t index) {
+    erase(root, index);
+    if (root->count == 0) {
+      leaf_allocator.destroy(static_cast<BTreeLeaf *>(root));
+      root = nullptr;
+      height = 0;
+    } else if (!root->is_leaf && root->count == 1) {
+      BTreeInternal *old_root = static_cast<BTreeInternal *>(root);
+      root = old_root->children[0];
+      internal_allocator.destroy(old_root);
+      height--;
+    }
+  }
 
-template <typename CoordinateSpace>
-Patch::Node *Patch::splay_node_starting_after(Point splice_start, Point splice_end) {
-  Node *splayed_node = nullptr;
-  Point left_ancestor_end = Point();
-  Node *node = root;
+  // Merges a child that has too few entries with a sibling, or moves entries
+  // over from the sibling if they don't fit in one node. Entries keep their
+  // distances, since they stay in the same order.
+  void fix_underflow(BTreeInternal *node, uint32_t i) {
+    uint32_t left_index = i > 0 ? i - 1 : i;
+    BTreeNode *left = node->children[left_index];
+    BTreeNode *right = node->children[left_index + 1];
+    uint32_t total_count = left->count + right->count;
+    if (total_count <= BTREE_NODE_CAPACITY) {
+      if (left->is_leaf) {
+        BTreeLeaf *left_leaf = static_cast<BTreeLeaf *>(left);
+        BTreeLeaf *right_leaf = static_cast<BTreeLeaf *>(right);
+        right_leaf->move_entries(0, left_leaf, left_leaf->count, right_leaf->count);
+        left_leaf->next = right_leaf->next;
+        leaf_allocator.destroy(right_leaf);
+      } else {
+        BTreeInternal *right_internal = static_cast<BTreeInternal *>(right);
+        right_internal->move_children(0, static_cast<BTreeInternal *>(left), left->count,
+                                      right_internal->count);
+        internal_allocator.destroy(right_internal);
+      }
+      node->erase_child(left_index + 1);
+      node->update_child(left_index);
+      return;
+    }
 
-  node_stack.clear();
-  size_t splayed_node_ancestor_count = 0;
-  while (node) {
-    Point node_start = left_ancestor_end.traverse(
-        CoordinateSpace::distance_from_left_ancestor(node));
-    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
-    if (node_start >= splice_end && node_start > splice_start) {
-      splayed_node = node;
-      splayed_node_ancestor_count = node_stack.size();
-      if (node->left) {
-        node_stack.push_back(node);
-        node = node->left;
+    uint32_t left_count = total_count / 2;
+    if (left->is_leaf) {
+      BTreeLeaf *left_leaf = static_cast<BTreeLeaf *>(left);
+      BTreeLeaf *right_leaf = static_cast<BTreeLeaf *>(right);
+      if (left_leaf->count > left_count) {
+        left_leaf->move_entries(left_count, right_leaf, 0, left_leaf->count - left_count);
       } else {
-        break;
+        right_leaf->move_entries(0, left_leaf, left_leaf->count, left_count - left_leaf->count);
       }
     } else {
-      if (node->right) {
-        left_ancestor_end = node_end;
-        node_stack.push_back(node);
-        node = node->right;
+      BTreeInternal *left_internal = static_cast<BTreeInternal *>(left);
+      BTreeInternal *right_internal = static_cast<BTreeInternal *>(right);
+      if (left_internal->count > left_count) {
+        left_internal->move_children(left_count, right_internal, 0, left_internal->count - left_count);
       } else {
-        break;
+        right_internal->move_children(0, left_internal, left_internal->count,
+                                      left_count - left_internal->count);
       }
     }
+    node->update_child(left_index);
+    node->update_child(left_index + 1);
+  }
+
+  // Builds the tree bottom-up, spreading the entries evenly over as few nodes
+  // as will hold them.
+  void assign(const vector<BTreeEntry> &entries) {
+    clear();
+    if (entries.empty()) return;
+
+    vector<BTreeNode *> level;
+    size_t leaf_count = (entries.size() + BTREE_NODE_CAPACITY - 1) / BTREE_NODE_CAPACITY;
+    BTreeLeaf *previous_leaf = nullptr;
+    for (size_t i = 0, entry_index = 0; i < leaf_count; i++) {
+      BTreeLeaf *leaf = leaf_allocator.allocate();
+      size_t size = entries.size() / leaf_count + (i < entries.size() % leaf_count ? 1 : 0);
+      for (size_t j = 0; j < size; j++) leaf->set_entry(j, entries[entry_index++]);
+      leaf->count = size;
+      if (previous_leaf) previous_leaf->next = leaf;
+      previous_leaf = leaf;
+      level.push_back(leaf);
+    }
+    height = 1;
+
+    while (level.size() > 1) {
+      vector<BTreeNode *> parents;
+      size_t parent_count = (level.size() + BTREE_NODE_CAPACITY - 1) / BTREE_NODE_CAPACITY;
+      for (size_t i = 0, child_index = 0; i < parent_count; i++) {
+        BTreeInternal *parent = internal_allocator.allocate();
+        size_t size = level.size() / parent_count + (i < level.size() % parent_count ? 1 : 0);
+        for (size_t j = 0; j < size; j++) parent->insert_child(j, level[child_index++]);
+        parents.push_back(parent);
+      }
+      level = move(parents);
+      height++;
+    }
+    root = level[0];
+  }
+
+  void clear() {
+    leaf_allocator.clear();
+    internal_allocator.clear();
+    root = nullptr;
+    height = 0;
+  }
+
+  // Appends the totals for the hunks with indices in [start, end) within the
+  // subtree, whose rows are made absolute given the end of the hunk before it.
+  void summarize(const BTreeNode *node, uint32_t start, uint32_t end, Point preceding_old_end,
+                 Point preceding_new_end, ChangeSummary *result) const {
+    if (node->is_leaf) {
+      const BTreeLeaf *leaf = static_cast<const BTreeLeaf *>(node);
+      for (uint32_t i = 0; i < leaf->count && i < end; i++) {
+        Hunk hunk = leaf->get_hunk(i, preceding_old_end, preceding_new_end);
+        if (i >= start) result->append(ChangeSummary::for_hunk(hunk), 0, 0);
+        preceding_old_end = hunk.old_end;
+        preceding_new_end = hunk.new_end;
+      }
+      return;
+    }
+
+    const BTreeInternal *internal = static_cast<const BTreeInternal *>(node);
+    uint32_t child_start = 0;
+    for (uint32_t i = 0; i < internal->count && child_start < end; i++) {
+      uint32_t child_end = child_start + internal->hunk_counts[i];
+      if (start <= child_start && child_end <= end) {
+        result->append(internal->summaries[i], preceding_old_end.row, preceding_new_end.row);
+      } else if (start < child_end) {
+        summarize(internal->children[i], start > child_start ? start - child_start : 0,
+                  std::min(end, child_end) - child_start, preceding_old_end, preceding_new_end, result);
+      }
+      child_start = child_end;
+      preceding_old_end = preceding_old_end.traverse(internal->old_spans[i]);
+      preceding_new_end = preceding_new_end.traverse(internal->new_spans[i]);
+    }
+  }
+
+  ChangeSummary summarize(uint32_t start, uint32_t end) const {
+    ChangeSummary result{};
+    if (root) summarize(root, start, end, Point(), Point(), &result);
+    return result;
+  }
+};
+
+Patch::HunkCursor::HunkCursor(const Node *root, const BTree *btree)
+    : root{root}, btree{btree}, leaf{nullptr}, leaf_index{0} {
+  reset();
+}
+
+void Patch::HunkCursor::push_left_spine(const Node *node, Point left_ancestor_old_end,
+                                        Point left_ancestor_new_end) {
+  for (; node; node = node->left) {
+    stack.push_back({node, left_ancestor_old_end, left_ancestor_new_end});
+  }
+}
+
+void Patch::HunkCursor::load_hunk() {
+  if (!stack.empty()) {
+    const StackEntry &entry = stack.back();
+    hunk = entry.node->get_hunk(entry.left_ancestor_old_end, entry.left_ancestor_new_end);
+  }
+}
+
+// The top of the stack is the current node and every entry below it is the
+// next node in order after the one above, so advancing pops the current node
+// and pushes the left spine of its right subtree.
+void Patch::HunkCursor::next() {
+  if (leaf) {
+    if (++leaf_index == leaf->count) {
+      leaf = leaf->next;
+      leaf_index = 0;
+    }
+    if (leaf) hunk = leaf->get_hunk(leaf_index, hunk.old_end, hunk.new_end);
+    return;
+  }
+
+  const Node *node = stack.back().node;
+  stack.pop_back();
+  push_left_spine(node->right, hunk.old_end, hunk.new_end);
+  load_hunk();
+}
+
+void Patch::HunkCursor::reset() {
+  if (btree) {
+    BTreePosition position = btree->get_first_position();
+    leaf = position.leaf;
+    leaf_index = 0;
+    if (leaf) hunk = position.get_hunk();
+    return;
+  }
+
+  stack.clear();
+  push_left_spine(root, Point(), Point());
+  load_hunk();
+}
+
+// Returns the number of nodes visited.
+template <typename CoordinateSpace>
+size_t Patch::HunkCursor::seek(Point target) {
+  if (btree) {
+    BTreePosition position;
+    if (!btree->find_last_starting<CoordinateSpace>([target](Point start) { return start <= target; },
+                                                    &position)) {
+      position = btree->get_first_position();
+    }
+    leaf = position.leaf;
+    leaf_index = position.leaf_index;
+    if (leaf) hunk = position.get_hunk();
+    return btree->height;
+  }
+
+  stack.clear();
+
+  // Descend to the last node starting before the target, remembering the
+  // nodes we pass on their left. Those above the lower bound follow it in
+  // order; those below it are in its right subtree and will be pushed again
+  // once the cursor moves past it.
+  size_t lower_bound_stack_size = 0;
+  StackEntry lower_bound{nullptr, Point(), Point()};
+  size_t depth = 0;
+  const Node *node = root;
+  Point left_ancestor_old_end, left_ancestor_new_end;
+  while (node) {
+    depth++;
+    Hunk node_hunk = node->get_hunk(left_ancestor_old_end, left_ancestor_new_end);
+    if (CoordinateSpace::start(node_hunk) <= target) {
+      lower_bound = {node, left_ancestor_old_end, left_ancestor_new_end};
+      lower_bound_stack_size = stack.size();
+      left_ancestor_old_end = node_hunk.old_end;
+      left_ancestor_new_end = node_hunk.new_end;
+      node = node->right;
+    } else {
+      stack.push_back({node, left_ancestor_old_end, left_ancestor_new_end});
+      node = node->left;
+    }
+  }
+
+  if (lower_bound.node) {
+    stack.resize(lower_bound_stack_size);
+    stack.push_back(lower_bound);
+  }
+  load_hunk();
+  return depth;
+}
+
+void Patch::HunkCursor::seek_to_old_position(Point target) {
+  seek<OldCoordinates>(target);
+}
+
+void Patch::HunkCursor::seek_to_new_position(Point target) {
+  seek<NewCoordinates>(target);
+}
+
+Patch::Patch()
+    : root{nullptr}, frozen{false}, merges_adjacent_hunks{true},
+      hunk_count{0}, compacted_text_size{0}, max_depth_factor{4},
+      deep_access_work{0} {}
+
+Patch::Patch(bool merges_adjacent_hunks)
+    : root{nullptr}, frozen{false},
+      merges_adjacent_hunks{merges_adjacent_hunks}, hunk_count{0},
+      compacted_text_size{0}, max_depth_factor{4}, deep_access_work{0} {}
+
+Patch::Patch(bool merges_adjacent_hunks, Backend backend) : Patch(merges_adjacent_hunks) {
+  if (backend == Backend::BTree) btree.reset(new BTree());
+}
+
+Patch::Patch(Patch &&other)
+    : node_allocator{move(other.node_allocator)}, text_arena{move(other.text_arena)},
+      root{nullptr}, btree{move(other.btree)}, frozen{other.frozen},
+      merges_adjacent_hunks{other.merges_adjacent_hunks},
+      hunk_count{other.hunk_count}, compacted_text_size{other.compacted_text_size},
+      max_depth_factor{other.max_depth_factor},
+      deep_access_work{other.deep_access_work.load(std::memory_order_relaxed)} {
+  std::swap(root, other.root);
+  std::swap(left_ancestor_stack, other.left_ancestor_stack);
+  std::swap(node_stack, other.node_stack);
+  std::swap(line_starts_cache, other.line_starts_cache);
+  other.hunk_count = 0;
+  other.compacted_text_size = 0;
+}
+
+Patch::Patch(const vector<const Patch *> &patches_to_compose) : Patch() {
+  for (const Patch *patch : patches_to_compose) {
+    splice_hunks(*patch);
+  }
+}
+
+// A fixed set of threads that run batches of jobs, so that the levels of a
+// parallel composition can reuse the same threads. The thread calling `run`
+// also works on the batch until it's finished.
+class ThreadPool {
+  vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable job_available;
+  std::condition_variable batch_finished;
+  const std::function<void(size_t)> *job;
+  size_t next_job_index;
+  size_t job_count;
+  size_t finished_job_count;
+  bool stopping;
+
+  void run_jobs(std::unique_lock<std::mutex> &lock) {
+    while (next_job_index < job_count) {
+      size_t job_index = next_job_index++;
+      lock.unlock();
+      (*job)(job_index);
+      lock.lock();
+      if (++finished_job_count == job_count) batch_finished.notify_all();
+    }
+  }
+
+public:
+  ThreadPool(unsigned thread_count)
+      : job{nullptr}, next_job_index{0}, job_count{0}, finished_job_count{0}, stopping{false} {
+    for (unsigned i = 1; i < thread_count; i++) {
+      threads.emplace_back([this]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+          job_available.wait(lock, [this]() { return stopping || next_job_index < job_count; });
+          if (stopping) return;
+          run_jobs(lock);
+        }
+      });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    job_available.notify_all();
+    for (std::thread &thread : threads) thread.join();
+  }
+
+  void run(size_t count, const std::function<void(size_t)> &job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    this->job = &job;
+    next_job_index = 0;
+    job_count = count;
+    finished_job_count = 0;
+    job_available.notify_all();
+    run_jobs(lock);
+    batch_finished.wait(lock, [this]() { return finished_job_count == job_count; });
+    next_job_index = job_count = 0;
+  }
+};
+
+Patch::Patch(const vector<const Patch *> &patches_to_compose, unsigned thread_count) : Patch() {
+#ifdef __EMSCRIPTEN__
+  thread_count = 1;
+#endif
+
+  // Composing pairs out of order only matches composing from left to right
+  // when every text is known. Otherwise, whether a merged hunk's text is known
+  // depends on which hunks it was merged with first.
+  bool has_all_text = true;
+  for (const Patch *patch : patches_to_compose) {
+    for (HunkCursor hunk = patch->get_hunk_cursor(); hunk && has_all_text; hunk.next()) {
+      has_all_text = hunk->old_text && hunk->new_text;
+    }
+  }
+
+  if (thread_count <= 1 || patches_to_compose.size() <= 2 || !has_all_text) {
+    for (const Patch *patch : patches_to_compose) {
+      splice_hunks(*patch);
+    }
+    return;
+  }
+
+  // Compose adjacent pairs level by level until one patch remains. An odd
+  // patch out at the end of a level is carried up to the next one as is.
+  // Compositions from the previous level are spliced into in place, just as
+  // the sequential composition splices into the patches composed so far.
+  ThreadPool thread_pool(thread_count);
+  vector<const Patch *> level = patches_to_compose;
+  vector<unique_ptr<Patch>> level_compositions(level.size());
+  while (level.size() > 1) {
+    size_t pair_count = level.size() / 2;
+    vector<unique_ptr<Patch>> next_level_compositions(pair_count);
+    thread_pool.run(pair_count, [&](size_t i) {
+      unique_ptr<Patch> composition = move(level_compositions[2 * i]);
+      if (!composition) {
+        composition.reset(new Patch());
+        composition->splice_hunks(*level[2 * i]);
+      }
+      if (level_compositions[2 * i + 1]) {
+        composition->splice_hunks(*level_compositions[2 * i + 1]);
+      } else {
+        composition->splice_hunks(*level[2 * i + 1]);
+      }
+      next_level_compositions[i] = move(composition);
+    });
+
+    vector<const Patch *> next_level;
+    for (const unique_ptr<Patch> &composition : next_level_compositions) {
+      next_level.push_back(composition.get());
+    }
+    if (level.size() % 2 == 1) {
+      next_level.push_back(level.back());
+      next_level_compositions.push_back(move(level_compositions.back()));
+    }
+    level = move(next_level);
+    level_compositions = move(next_level_compositions);
+  }
+
+  Patch &composition = *level_compositions[0];
+  node_allocator.swap(composition.node_allocator);
+  text_arena.swap(composition.text_arena);
+  std::swap(root, composition.root);
+  std::swap(hunk_count, composition.hunk_count);
+  std::swap(compacted_text_size, composition.compacted_text_size);
+  std::swap(line_starts_cache, composition.line_starts_cache);
+}
+
+Patch Patch::from_hunks(const vector<Hunk> &hunks, Backend backend) {
+  Patch result{true, backend};
+  result.splice_sorted_hunks(hunks);
+  return result;
+}
+
+Patch::~Patch() {
+  // Unless copies of this patch still share its nodes, don't bother returning
+  // them to the free list. The allocator frees its slabs all at once, and the
+  // text arena frees the nodes' texts.
+  if (root && is_shared()) {
+    node_stack.clear();
+    node_stack.push_back(root);
+
+    while (!node_stack.empty()) {
+      Node *node = node_stack.back();
+      node_stack.pop_back();
+      if (node->reference_count > 1) {
+        node->reference_count--;
+        continue;
+      }
+      if (node->left)
+        node_stack.push_back(node->left);
+      if (node->right)
+        node_stack.push_back(node->right);
+      node_allocator->destroy(node);
+    }
+  }
+}
+
+Patch::Node *Patch::build_node(Node *left, Node *right,
+                       Point old_distance_from_left_ancestor,
+                       Point new_distance_from_left_ancestor, Point old_extent,
+                       Point new_extent, TextView old_text,
+                       TextView new_text) {
+  hunk_count++;
+  Node *node = get_node_allocator().allocate(left,
+                                             right,
+                                             old_distance_from_left_ancestor,
+                                             new_distance_from_left_ancestor,
+                                             old_extent,
+                                             new_extent,
+                                             old_text,
+                                             new_text,
+                                             1u,
+                                             ChangeSummary{});
+  node->update_subtree_summary();
+  return node;
+}
+
+void Patch::delete_node(Node **node_to_delete) {
+  if (*node_to_delete) {
+    node_stack.clear();
+    node_stack.push_back(*node_to_delete);
+
+    while (!node_stack.empty()) {
+      Node *node = node_stack.back();
+      node_stack.pop_back();
+
+      // A shared subtree leaves this version of the patch, but stays intact
+      // for the others.
+      if (node->reference_count > 1) {
+        node->reference_count--;
+        hunk_count -= node->subtree_summary.hunk_count;
+        continue;
+      }
+
+      if (node->left)
+        node_stack.push_back(node->left);
+      if (node->right)
+        node_stack.push_back(node->right);
+      node_allocator->destroy(node);
+      hunk_count--;
+    }
+
+    *node_to_delete = nullptr;
+  }
+}
+
+slab_allocator<Patch::Node> &Patch::get_node_allocator() {
+  if (!node_allocator) node_allocator = std::make_shared<slab_allocator<Node>>();
+  return *node_allocator;
+}
+
+bool Patch::is_shared() const {
+  return node_allocator.use_count() > 1;
+}
+
+TextArena &Patch::get_text_arena() {
+  if (!text_arena) text_arena = std::make_shared<TextArena>();
+  return *text_arena;
+}
+
+TextView Patch::store_text(TextView text) {
+  return get_text_arena().store(text);
+}
+
+// Concatenates slices into the text arena. If any of them have line starts,
+// so that the result was probably sliced out of a long text, the line starts
+// of the result are composed from theirs instead of being recomputed later.
+TextView Patch::store_text(TextSlice a, TextSlice b, TextSlice c) {
+  TextView result = get_text_arena().store(a, b, c);
+  if ((a.line_starts || b.line_starts || c.line_starts) &&
+      result.size() >= MIN_INDEXED_TEXT_SIZE && result.size() <= UINT32_MAX) {
+    vector<uint32_t> line_starts;
+    a.append_line_starts(&line_starts, 0);
+    b.append_line_starts(&line_starts, a.size());
+    c.append_line_starts(&line_starts, a.size() + b.size());
+    cache_line_starts(result, move(line_starts));
+  }
+  return result;
+}
+
+// Slices a text stored in the text arena. Long texts are sliced along with
+// their line starts, which are computed the first time they're needed and
+// cached for the few texts that were sliced most recently, since a run of
+// splices tends to split the same hunk over and over.
+TextSlice Patch::slice_text(TextView text) {
+  if (text.size() < MIN_INDEXED_TEXT_SIZE || text.size() > UINT32_MAX) return TextSlice(text);
+
+  for (auto entry = line_starts_cache.begin(); entry != line_starts_cache.end(); ++entry) {
+    if (entry->text == text.data() && entry->size == text.size()) {
+      std::rotate(entry, entry + 1, line_starts_cache.end());
+      return TextSlice(text, line_starts_cache.back().line_starts);
+    }
+  }
+
+  cache_line_starts(text, TextSlice::get_line_starts(text));
+  return TextSlice(text, line_starts_cache.back().line_starts);
+}
+
+void Patch::cache_line_starts(TextView text, vector<uint32_t> &&line_starts) {
+  if (line_starts_cache.size() == LINE_STARTS_CACHE_SIZE) {
+    line_starts_cache.erase(line_starts_cache.begin());
+  }
+  line_starts_cache.push_back(CachedLineStarts{text.data(), text.size(), move(line_starts)});
+}
+
+// Copies the texts still in use into a new arena once the current one holds
+// at least as much text as was in use after the last compaction, plus some
+// slack in proportion to the number of hunks, so that the cost of visiting
+// every node is spread over enough splices. While copies or inversions of
+// this patch share the arena, it is left to them, and the nodes this patch
+// shares with them are copied first so that theirs keep viewing the old one.
+void Patch::compact_text_if_needed() {
+  if (!text_arena) return;
+  if (text_arena->size() < 2 * compacted_text_size + 8 * hunk_count + 16 * 1024) return;
+  if (text_arena.use_count() > 1) unshare_tree();
+
+  auto compacted_text_arena = std::make_shared<TextArena>();
+  compacted_text_size = 0;
+  if (btree) {
+    BTreeNode *node = btree->root;
+    while (node && !node->is_leaf) node = static_cast<BTreeInternal *>(node)->children[0];
+    for (BTreeLeaf *leaf = static_cast<BTreeLeaf *>(node); leaf; leaf = leaf->next) {
+      for (uint32_t i = 0; i < leaf->count; i++) {
+        leaf->old_texts[i] = compacted_text_arena->store(leaf->old_texts[i]);
+        leaf->new_texts[i] = compacted_text_arena->store(leaf->new_texts[i]);
+        compacted_text_size += leaf->old_texts[i].size() + leaf->new_texts[i].size();
+      }
+    }
+  }
+  node_stack.clear();
+  if (root) node_stack.push_back(root);
+  while (!node_stack.empty()) {
+    Node *node = node_stack.back();
+    node_stack.pop_back();
+    node->old_text = compacted_text_arena->store(node->old_text);
+    node->new_text = compacted_text_arena->store(node->new_text);
+    compacted_text_size += node->old_text.size() + node->new_text.size();
+    if (node->left) node_stack.push_back(node->left);
+    if (node->right) node_stack.push_back(node->right);
+  }
+  text_arena = move(compacted_text_arena);
+  line_starts_cache.clear();
+}
+
+void Patch::unshare_node(Node **node) {
+  if ((*node)->reference_count > 1) {
+    (*node)->reference_count--;
+    *node = (*node)->copy(*node_allocator);
+  }
+}
+
+void Patch::unshare_tree() {
+  if (!root || !is_shared()) return;
+
+  unshare_node(&root);
+  node_stack.clear();
+  node_stack.push_back(root);
+  while (!node_stack.empty()) {
+    Node *node = node_stack.back();
+    node_stack.pop_back();
+    if (node->left) {
+      unshare_node(&node->left);
+      node_stack.push_back(node->left);
+    }
+    if (node->right) {
+      unshare_node(&node->right);
+      node_stack.push_back(node->right);
+    }
+  }
+}
+
+template <typename CoordinateSpace>
+Patch::Node *Patch::splay_node_ending_before(Point target) {
+  Node *splayed_node = nullptr;
+  Point left_ancestor_end = Point();
+  Node *node = root;
+
+  node_stack.clear();
+  size_t splayed_node_ancestor_count = 0;
+  while (node) {
+    Point node_start = left_ancestor_end.traverse(
+        CoordinateSpace::distance_from_left_ancestor(node));
+    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
+    if (node_end <= target) {
+      splayed_node = node;
+      splayed_node_ancestor_count = node_stack.size();
+      if (node->right) {
+        left_ancestor_end = node_start.traverse(CoordinateSpace::extent(node));
+        node_stack.push_back(node);
+        node = node->right;
+      } else {
+        break;
+      }
+    } else {
+      if (node->left) {
+        node_stack.push_back(node);
+        node = node->left;
+      } else {
+        break;
+      }
+    }
+  }
+
+  if (node) record_access_depth(node_stack.size() + 1);
+
+  if (splayed_node) {
+    node_stack.resize(splayed_node_ancestor_count);
+    splayed_node = splay_node(splayed_node);
+  }
+
+  return splayed_node;
+}
+
+template <typename CoordinateSpace>
+Patch::Node *Patch::splay_node_starting_before(Point target) {
+  Node *splayed_node = nullptr;
+  Point left_ancestor_end = Point();
+  Node *node = root;
+
+  node_stack.clear();
+  size_t splayed_node_ancestor_count = 0;
+  while (node) {
+    Point node_start = left_ancestor_end.traverse(
+        CoordinateSpace::distance_from_left_ancestor(node));
+    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
+    if (node_start <= target) {
+      splayed_node = node;
+      splayed_node_ancestor_count = node_stack.size();
+      if (node->right) {
+        left_ancestor_end = node_end;
+        node_stack.push_back(node);
+        node = node->right;
+      } else {
+        break;
+      }
+    } else {
+      if (node->left) {
+        node_stack.push_back(node);
+        node = node->left;
+      } else {
+        break;
+      }
+    }
+  }
+
+  if (node) record_access_depth(node_stack.size() + 1);
+
+  if (splayed_node) {
+    node_stack.resize(splayed_node_ancestor_count);
+    splayed_node = splay_node(splayed_node);
+  }
+
+  return splayed_node;
+}
+
+template <typename CoordinateSpace>
+Patch::Node *Patch::splay_node_ending_after(Point splice_start, Point splice_end) {
+  Node *splayed_node = nullptr;
+  Point left_ancestor_end = Point();
+  Node *node = root;
+
+  node_stack.clear();
+  size_t splayed_node_ancestor_count = 0;
+  while (node) {
+    Point node_start = left_ancestor_end.traverse(
+        CoordinateSpace::distance_from_left_ancestor(node));
+    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
+    if (node_end >= splice_end && node_end > splice_start) {
+      splayed_node = node;
+      splayed_node_ancestor_count = node_stack.size();
+      if (node->left) {
+        node_stack.push_back(node);
+        node = node->left;
+      } else {
+        break;
+      }
+    } else {
+      if (node->right) {
+        left_ancestor_end = node_end;
+        node_stack.push_back(node);
+        node = node->right;
+      } else {
+        break;
+      }
+    }
+  }
+
+  if (node) record_access_depth(node_stack.size() + 1);
+
+  if (splayed_node) {
+    node_stack.resize(splayed_node_ancestor_count);
+    splayed_node = splay_node(splayed_node);
+  }
+
+  return splayed_node;
+}
+
+template <typename CoordinateSpace>
+Patch::Node *Patch::splay_node_starting_after(Point splice_start, Point splice_end) {
+  Node *splayed_node = nullptr;
+  Point left_ancestor_end = Point();
+  Node *node = root;
+
+  node_stack.clear();
+  size_t splayed_node_ancestor_count = 0;
+  while (node) {
+    Point node_start = left_ancestor_end.traverse(
+        CoordinateSpace::distance_from_left_ancestor(node));
+    Point node_end = node_start.traverse(CoordinateSpace::extent(node));
+    if (node_start >= splice_end && node_start > splice_start) {
+      splayed_node = node;
+      splayed_node_ancestor_count = node_stack.size();
+      if (node->left) {
+        node_stack.push_back(node);
+        node = node->left;
+      } else {
+        break;
+      }
+    } else {
+      if (node->right) {
+        left_ancestor_end = node_end;
+        node_stack.push_back(node);
+        node = node->right;
+      } else {
+        break;
+      }
+    }
+  }
+
+  if (node) record_access_depth(node_stack.size() + 1);
+
+  if (splayed_node) {
+    node_stack.resize(splayed_node_ancestor_count);
+    splayed_node = splay_node(splayed_node);
   }
 
-  if (splayed_node) {
-    node_stack.resize(splayed_node_ancestor_count);
-    splay_node(splayed_node);
-  }
-
   return splayed_node;
 }
 
 template <typename CoordinateSpace>
 vector<Hunk> Patch::get_hunks_in_range(Point start, Point end, bool inclusive) {
+  if (btree) {
+    const Patch &patch = *this;
+    return patch.get_hunks_in_range<CoordinateSpace>(start, end, inclusive);
+  }
+
   vector<Hunk> result;
   if (!root)
     return result;
 
+  rebalance_if_needed();
   Node *lower_bound = splay_node_starting_before<CoordinateSpace>(start);
 
   node_stack.clear();
@@ -430,6 +1601,7 @@ vector<Hunk> Patch::get_hunks_in_range(Point start, Point end, bool inclusive) {
       node_stack.push_back(node);
       node = node->left;
     }
+    record_access_depth(node_stack.size() + 1);
   }
 
   while (node) {
@@ -441,8 +1613,8 @@ vector<Hunk> Patch::get_hunks_in_range(Point start, Point end, bool inclusive) {
         node->new_distance_from_left_ancestor);
     Point old_end = old_start.traverse(node->old_extent);
     Point new_end = new_start.traverse(node->new_extent);
-    Text *old_text = node->old_text.get();
-    Text *new_text = node->new_text.get();
+    TextView old_text = node->old_text;
+    TextView new_text = node->new_text;
     Hunk hunk = {old_start, old_end, new_start, new_end, old_text, new_text};
 
     if (inclusive) {
@@ -494,20 +1666,102 @@ vector<Hunk> Patch::get_hunks_in_range(Point start, Point end, bool inclusive) {
 
 template <typename CoordinateSpace>
 optional<Hunk> Patch::hunk_for_position(Point target) {
+  if (btree) {
+    const Patch &patch = *this;
+    return patch.hunk_for_position<CoordinateSpace>(target);
+  }
+
+  rebalance_if_needed();
+
+  // No later hunk starts before the end of the root's hunk, or at its end
+  // unless the following hunk is right there, so positions up to that end
+  // are found without a search, as when looking up the cursor while typing.
+  if (root) {
+    Hunk hunk = root->get_hunk(Point(), Point());
+    if (CoordinateSpace::start(hunk) <= target && target <= CoordinateSpace::end(hunk)) {
+      if (target < CoordinateSpace::end(hunk) || !root->right) return hunk;
+      const Node *following_node = root->right;
+      while (following_node->left) following_node = following_node->left;
+      if (!CoordinateSpace::distance_from_left_ancestor(following_node).is_zero()) return hunk;
+    }
+  }
+
   Node *lower_bound = splay_node_starting_before<CoordinateSpace>(target);
   if (lower_bound) {
     Point old_start = lower_bound->old_distance_from_left_ancestor;
     Point new_start = lower_bound->new_distance_from_left_ancestor;
     Point old_end = old_start.traverse(lower_bound->old_extent);
     Point new_end = new_start.traverse(lower_bound->new_extent);
-    Text *old_text = lower_bound->old_text.get();
-    Text *new_text = lower_bound->new_text.get();
+    TextView old_text = lower_bound->old_text;
+    TextView new_text = lower_bound->new_text;
     return Hunk{old_start, old_end, new_start, new_end, old_text, new_text};
   } else {
     return optional<Hunk>{};
   }
 }
 
+template <typename CoordinateSpace>
+vector<Hunk> Patch::get_hunks_in_range(Point start, Point end, bool inclusive) const {
+  vector<Hunk> result;
+
+  HunkCursor cursor = get_hunk_cursor();
+  record_access_depth(cursor.seek<CoordinateSpace>(start));
+  for (; cursor; cursor.next()) {
+    const Hunk &hunk = *cursor;
+
+    if (inclusive) {
+      if (CoordinateSpace::start(hunk) > end) {
+        break;
+      }
+
+      if (CoordinateSpace::end(hunk) >= start) {
+        result.push_back(hunk);
+      }
+    } else {
+      if (CoordinateSpace::start(hunk) >= end) {
+        break;
+      }
+
+      if (CoordinateSpace::end(hunk) > start) {
+        result.push_back(hunk);
+      }
+    }
+  }
+
+  return result;
+}
+
+template <typename CoordinateSpace>
+optional<Hunk> Patch::hunk_for_position(Point target) const {
+  if (btree) {
+    BTreePosition position;
+    if (btree->find_last_starting<CoordinateSpace>([target](Point start) { return start <= target; },
+                                                   &position)) {
+      return position.get_hunk();
+    }
+    return optional<Hunk>{};
+  }
+
+  optional<Hunk> result;
+  size_t depth = 0;
+  const Node *node = root;
+  Point left_ancestor_old_end, left_ancestor_new_end;
+  while (node) {
+    depth++;
+    Hunk hunk = node->get_hunk(left_ancestor_old_end, left_ancestor_new_end);
+    if (CoordinateSpace::start(hunk) <= target) {
+      result = hunk;
+      left_ancestor_old_end = hunk.old_end;
+      left_ancestor_new_end = hunk.new_end;
+      node = node->right;
+    } else {
+      node = node->left;
+    }
+  }
+  record_access_depth(depth);
+  return result;
+}
+
 bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
                    Point new_insertion_extent, unique_ptr<Text> deleted_text,
                    unique_ptr<Text> inserted_text) {
@@ -515,23 +1769,96 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
     return false;
   }
 
+  splice_views(new_splice_start, new_deletion_extent, new_insertion_extent,
+               deleted_text.get(), inserted_text.get());
+  compact_text_if_needed();
+  return true;
+}
+
+// The root is the hunk that the last splice or query touched, and its
+// distances are its absolute positions, since it has no left ancestor. A
+// burst of typing keeps splicing within that hunk, which can then be edited in
+// place without searching for its neighbors, as long as neither of them
+// touches the splice. The result is the same as that of the general case.
+bool Patch::splice_within_root(Point new_splice_start, Point new_deletion_extent,
+                               Point new_insertion_extent, TextView deleted_text,
+                               TextView inserted_text) {
+  Point root_new_start = root->new_distance_from_left_ancestor;
+  Point root_new_end = root_new_start.traverse(root->new_extent);
+  Point new_deletion_end = new_splice_start.traverse(new_deletion_extent);
+  if (new_splice_start < root_new_start || new_deletion_end > root_new_end) return false;
+
+  if (merges_adjacent_hunks) {
+    if (new_splice_start == root_new_start && root->left) {
+      Point preceding_old_end, preceding_new_end;
+      root->left->get_subtree_end(&preceding_old_end, &preceding_new_end);
+      if (preceding_new_end == root_new_start) return false;
+    }
+    if (new_deletion_end == root_new_end && root->right) {
+      Node *following_node = root->right;
+      while (following_node->left) following_node = following_node->left;
+      if (following_node->new_distance_from_left_ancestor.is_zero()) return false;
+    }
+  } else if (!(new_splice_start < root_new_end && new_deletion_end > root_new_start)) {
+    return false;
+  }
+
+  unshare_node(&root);
+  Point new_extent_prefix = new_splice_start.traversal(root_new_start);
+  Point new_extent_suffix = root_new_end.traversal(new_deletion_end);
+  if (inserted_text && root->new_text) {
+    TextSlice new_text = slice_text(root->new_text);
+    root->new_text = store_text(new_text.prefix(new_extent_prefix), TextSlice(inserted_text),
+                                new_text.suffix(new_deletion_end.traversal(root_new_start)));
+  } else {
+    root->new_text = nullptr;
+  }
+  if (!deleted_text) root->old_text = nullptr;
+  root->new_extent = new_extent_prefix.traverse(new_insertion_extent).traverse(new_extent_suffix);
+
+  if (root->old_extent.is_zero() && root->new_extent.is_zero()) {
+    delete_root();
+  } else {
+    root->update_subtree_summary();
+  }
+  return true;
+}
+
+// Splices texts that are copied into the text arena as needed, so they only
+// have to remain valid for the duration of the call.
+void Patch::splice_views(Point new_splice_start, Point new_deletion_extent,
+                         Point new_insertion_extent, TextView deleted_text,
+                         TextView inserted_text) {
   if (new_deletion_extent.is_zero() && new_insertion_extent.is_zero()) {
-    return true;
+    return;
+  }
+
+  if (btree) {
+    splice_btree(new_splice_start, new_deletion_extent, new_insertion_extent,
+                 deleted_text, inserted_text);
+    return;
   }
 
+  rebalance_if_needed();
+
   if (!root) {
     root = build_node(nullptr, nullptr, new_splice_start, new_splice_start,
                      new_deletion_extent, new_insertion_extent,
-                     move(deleted_text), move(inserted_text));
-    return true;
+                     store_text(deleted_text), store_text(inserted_text));
+    return;
+  }
+
+  if (splice_within_root(new_splice_start, new_deletion_extent, new_insertion_extent,
+                         deleted_text, inserted_text)) {
+    return;
   }
 
   Point new_deletion_end = new_splice_start.traverse(new_deletion_extent);
   Point new_insertion_end = new_splice_start.traverse(new_insertion_extent);
 
   Node *lower_bound = splay_node_starting_before<NewCoordinates>(new_splice_start);
-  unique_ptr<Text> old_text =
-      compute_old_text(move(deleted_text), new_splice_start, new_deletion_end);
+  TextView old_text = store_text(
+      compute_old_text(deleted_text, new_splice_start, new_deletion_end).get());
   Node *upper_bound =
       splay_node_ending_after<NewCoordinates>(new_splice_start, new_deletion_end);
   if (upper_bound && lower_bound && lower_bound != upper_bound) {
@@ -579,16 +1906,16 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
 
       if (inserted_text && lower_bound->new_text && upper_bound->new_text) {
         TextSlice new_text_prefix =
-            TextSlice(*lower_bound->new_text).prefix(new_extent_prefix);
-        TextSlice new_text_suffix = TextSlice(*upper_bound->new_text).suffix(
+            slice_text(lower_bound->new_text).prefix(new_extent_prefix);
+        TextSlice new_text_suffix = slice_text(upper_bound->new_text).suffix(
             new_deletion_end.traversal(upper_bound_new_start));
-        upper_bound->new_text = unique_ptr<Text>{new Text(TextSlice::concat(
-            new_text_prefix, TextSlice(*inserted_text), new_text_suffix))};
+        upper_bound->new_text = store_text(
+            new_text_prefix, TextSlice(inserted_text), new_text_suffix);
       } else {
         upper_bound->new_text = nullptr;
       }
 
-      upper_bound->old_text = move(old_text);
+      upper_bound->old_text = old_text;
 
       if (lower_bound == upper_bound) {
         if (root->old_extent.is_zero() && root->new_extent.is_zero()) {
@@ -612,15 +1939,15 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
           new_insertion_extent.traverse(new_extent_suffix);
 
       if (inserted_text && upper_bound->new_text) {
-        TextSlice new_text_suffix = TextSlice(*upper_bound->new_text).suffix(
+        TextSlice new_text_suffix = slice_text(upper_bound->new_text).suffix(
             new_deletion_end.traversal(upper_bound_new_start));
         upper_bound->new_text =
-            unique_ptr<Text>{new Text(TextSlice::concat(TextSlice(*inserted_text), new_text_suffix))};
+            store_text(TextSlice(inserted_text), new_text_suffix);
       } else {
         upper_bound->new_text = nullptr;
       }
 
-      upper_bound->old_text = move(old_text);
+      upper_bound->old_text = old_text;
 
       delete_node(&lower_bound->right);
       if (upper_bound->left != lower_bound) {
@@ -644,14 +1971,14 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
           new_extent_prefix.traverse(new_insertion_extent);
       if (inserted_text && lower_bound->new_text) {
         TextSlice new_text_prefix =
-            TextSlice(*lower_bound->new_text).prefix(new_extent_prefix);
+            slice_text(lower_bound->new_text).prefix(new_extent_prefix);
         lower_bound->new_text =
-            unique_ptr<Text>{new Text(TextSlice::concat(new_text_prefix, TextSlice(*inserted_text)))};
+            store_text(new_text_prefix, TextSlice(inserted_text));
       } else {
         lower_bound->new_text = nullptr;
       }
 
-      lower_bound->old_text = move(old_text);
+      lower_bound->old_text = old_text;
 
       delete_node(&lower_bound->right);
       rotate_node_right(lower_bound, upper_bound, nullptr);
@@ -667,8 +1994,8 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
 
         root = build_node(upper_bound->left, upper_bound, upper_bound_old_start,
                          upper_bound_new_start, Point(),
-                         new_insertion_extent, move(old_text),
-                         move(inserted_text));
+                         new_insertion_extent, old_text,
+                         store_text(inserted_text));
 
         upper_bound->left = nullptr;
         upper_bound->old_distance_from_left_ancestor = Point();
@@ -685,7 +2012,7 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
         root = build_node(
             lower_bound, upper_bound, old_splice_start, new_splice_start,
             old_deletion_end.traversal(old_splice_start), new_insertion_extent,
-            move(old_text), move(inserted_text));
+            old_text, store_text(inserted_text));
 
         delete_node(&lower_bound->right);
         upper_bound->left = nullptr;
@@ -720,22 +2047,22 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
       lower_bound->new_extent =
           new_insertion_end.traversal(lower_bound_new_start);
       if (inserted_text && lower_bound->new_text) {
-        TextSlice new_text_prefix = TextSlice(*lower_bound->new_text).prefix(
+        TextSlice new_text_prefix = slice_text(lower_bound->new_text).prefix(
             new_splice_start.traversal(lower_bound_new_start));
         lower_bound->new_text =
-            unique_ptr<Text>{new Text(TextSlice::concat(new_text_prefix, TextSlice(*inserted_text)))};
+            store_text(new_text_prefix, TextSlice(inserted_text));
       } else {
         lower_bound->new_text = nullptr;
       }
 
-      lower_bound->old_text = move(old_text);
+      lower_bound->old_text = old_text;
     } else {
       Point old_splice_start = lower_bound_old_end.traverse(
           new_splice_start.traversal(lower_bound_new_end));
       root =
           build_node(lower_bound, nullptr, old_splice_start, new_splice_start,
                     old_deletion_end.traversal(old_splice_start),
-                    new_insertion_extent, move(old_text), move(inserted_text));
+                    new_insertion_extent, old_text, store_text(inserted_text));
     }
 
   } else if (upper_bound) {
@@ -769,20 +2096,20 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
           upper_bound_new_end.traversal(new_deletion_end));
 
       if (inserted_text && upper_bound->new_text) {
-        TextSlice new_text_suffix = TextSlice(*upper_bound->new_text).suffix(
+        TextSlice new_text_suffix = slice_text(upper_bound->new_text).suffix(
             new_deletion_end.traversal(upper_bound_new_start));
         upper_bound->new_text =
-            unique_ptr<Text>{new Text(TextSlice::concat(TextSlice(*inserted_text), new_text_suffix))};
+            store_text(TextSlice(inserted_text), new_text_suffix);
       } else {
         upper_bound->new_text = nullptr;
       }
 
-      upper_bound->old_text = move(old_text);
+      upper_bound->old_text = old_text;
     } else {
       root =
           build_node(nullptr, upper_bound, new_splice_start, new_splice_start,
                     old_deletion_end.traversal(new_splice_start),
-                    new_insertion_extent, move(old_text), move(inserted_text));
+                    new_insertion_extent, old_text, store_text(inserted_text));
       Point distance_from_end_of_root_to_start_of_upper_bound =
           upper_bound_new_start.traversal(new_deletion_end);
       upper_bound->old_distance_from_left_ancestor =
@@ -799,22 +2126,307 @@ bool Patch::splice(Point new_splice_start, Point new_deletion_extent,
     delete_node(&root);
     root = build_node(nullptr, nullptr, new_splice_start, new_splice_start,
                      old_deletion_end.traversal(new_splice_start),
-                     new_insertion_extent, move(old_text), move(inserted_text));
+                     new_insertion_extent, old_text, store_text(inserted_text));
   }
 
+  if (root) root->update_top_subtree_summaries();
+}
+
+bool Patch::splice_batch(vector<Splice> splices) {
+  if (is_frozen()) {
+    return false;
+  }
+
+  for (size_t i = 1; i < splices.size(); i++) {
+    if (splices[i - 1].start.traverse(splices[i - 1].deletion_extent) > splices[i].start) {
+      return false;
+    }
+  }
+
+  vector<BatchSplice> batch;
+  batch.reserve(splices.size());
+  for (Splice &splice : splices) {
+    batch.push_back(BatchSplice{
+      splice.start,
+      splice.deletion_extent,
+      splice.insertion_extent,
+      splice.deleted_text.get(),
+      splice.inserted_text.get()
+    });
+  }
+  splice_sorted(batch);
+  compact_text_if_needed();
   return true;
 }
 
+// Builds the tree out of sorted hunks, which must be spliced into an empty
+// patch. Before any of them is applied, each hunk's new start is its old start.
+void Patch::splice_sorted_hunks(const vector<Hunk> &hunks) {
+  if (btree) {
+    assign_hunks(hunks);
+    return;
+  }
+
+  vector<BatchSplice> splices;
+  splices.reserve(hunks.size());
+  for (const Hunk &hunk : hunks) {
+    splices.push_back(BatchSplice{
+      hunk.old_start,
+      hunk.old_end.traversal(hunk.old_start),
+      hunk.new_end.traversal(hunk.new_start),
+      hunk.old_text,
+      hunk.new_text
+    });
+  }
+  splice_sorted(splices);
+}
+
+void Patch::splice_hunks(const Patch &patch) {
+  // The patch's hunks are expressed in its old coordinates, which are this
+  // patch's new coordinates.
+  vector<BatchSplice> splices;
+  splices.reserve(patch.hunk_count);
+  for (HunkCursor hunk = patch.get_hunk_cursor(); hunk; hunk.next()) {
+    splices.push_back(BatchSplice{
+      hunk->old_start,
+      hunk->old_end.traversal(hunk->old_start),
+      hunk->new_end.traversal(hunk->new_start),
+      hunk->old_text,
+      hunk->new_text
+    });
+  }
+  splice_sorted(splices);
+  compact_text_if_needed();
+}
+
+void Patch::get_positioned_nodes(vector<PositionedNode> &hunks) {
+  hunks.reserve(hunks.size() + hunk_count);
+  node_stack.clear();
+  left_ancestor_stack.clear();
+  Point left_ancestor_old_end, left_ancestor_new_end;
+  for (Node *node = root; node || !node_stack.empty();) {
+    if (node) {
+      node_stack.push_back(node);
+      left_ancestor_stack.push_back({left_ancestor_old_end, left_ancestor_new_end});
+      node = node->left;
+    } else {
+      node = node_stack.back();
+      PositionStackEntry left_ancestor_position = left_ancestor_stack.back();
+      node_stack.pop_back();
+      left_ancestor_stack.pop_back();
+      PositionedNode hunk(
+        node,
+        left_ancestor_position.old_end.traverse(node->old_distance_from_left_ancestor),
+        left_ancestor_position.new_end.traverse(node->new_distance_from_left_ancestor)
+      );
+      hunks.push_back(hunk);
+      left_ancestor_old_end = hunk.old_end;
+      left_ancestor_new_end = hunk.new_end;
+      node = node->right;
+    }
+  }
+}
+
+void Patch::splice_sorted(vector<BatchSplice> &splices) {
+  // Merging rebuilds the whole tree, which only pays off when the batch is
+  // large relative to the patch. A B+ tree is always spliced one splice at a
+  // time, which already costs no more than a few nodes per splice.
+  if (btree || splices.size() * 32 < hunk_count) {
+    for (auto splice = splices.rbegin(), end = splices.rend(); splice != end; ++splice) {
+      splice_views(splice->start, splice->deletion_extent, splice->insertion_extent,
+                   splice->deleted_text, splice->inserted_text);
+    }
+    return;
+  }
+
+  // Every node is either reused or deleted.
+  unshare_tree();
+  vector<PositionedNode> hunks;
+  get_positioned_nodes(hunks);
+
+  // Walk the splices and hunks from right to left, so every splice sees the
+  // hunks to its right as the previous splices left them, exactly as if they
+  // had been applied one at a time. Old positions never change, and neither
+  // do the new positions of hunks to the left of the splices applied so far.
+  vector<PositionedNode> spliced_hunks;
+  spliced_hunks.reserve(hunks.size() + splices.size());
+  vector<PositionedNode> overlapping_hunks;
+  vector<PositionedNode> preceding_spliced_hunks;
+  vector<Hunk> overlapping_hunk_views;
+  size_t remaining_hunk_count = hunks.size();
+  for (auto splice = splices.rbegin(), end = splices.rend(); splice != end; ++splice) {
+    if (splice->deletion_extent.is_zero() && splice->insertion_extent.is_zero()) {
+      continue;
+    }
+
+    Point new_splice_start = splice->start;
+    Point new_deletion_end = splice->start.traverse(splice->deletion_extent);
+
+    auto follows_splice = [&](const PositionedNode &hunk) {
+      if (merges_adjacent_hunks) {
+        return hunk.new_start > new_deletion_end;
+      } else {
+        return hunk.new_start >= new_deletion_end && hunk.new_end > new_splice_start;
+      }
+    };
+
+    auto overlaps_splice = [&](const PositionedNode &hunk) {
+      if (merges_adjacent_hunks) {
+        return hunk.new_start <= new_deletion_end && hunk.new_end >= new_splice_start;
+      } else {
+        return hunk.new_start < new_deletion_end && hunk.new_end > new_splice_start;
+      }
+    };
+
+    // Hunks that were already passed over have shifted since, so refresh
+    // the new position of the leftmost one before comparing it.
+    if (!spliced_hunks.empty()) {
+      spliced_hunks.back().update_new_start(
+        remaining_hunk_count > 0 ? &hunks[remaining_hunk_count - 1] : nullptr);
+    }
+
+    // Without merging, empty hunks left at this splice's start by previous
+    // splices precede the hunk this splice inserts.
+    preceding_spliced_hunks.clear();
+    while (!spliced_hunks.empty() && !follows_splice(spliced_hunks.back()) &&
+           !overlaps_splice(spliced_hunks.back())) {
+      preceding_spliced_hunks.push_back(spliced_hunks.back());
+      spliced_hunks.pop_back();
+      if (!spliced_hunks.empty()) {
+        spliced_hunks.back().update_new_start(&preceding_spliced_hunks.back());
+      }
+    }
+
+    while (remaining_hunk_count > 0 && follows_splice(hunks[remaining_hunk_count - 1])) {
+      spliced_hunks.push_back(hunks[--remaining_hunk_count]);
+    }
+
+    size_t overlapping_hunks_end = remaining_hunk_count;
+    while (remaining_hunk_count > 0 && overlaps_splice(hunks[remaining_hunk_count - 1])) {
+      remaining_hunk_count--;
+    }
+    overlapping_hunks.assign(hunks.begin() + remaining_hunk_count,
+                             hunks.begin() + overlapping_hunks_end);
+    if (!spliced_hunks.empty() && overlaps_splice(spliced_hunks.back())) {
+      overlapping_hunks.push_back(spliced_hunks.back());
+      spliced_hunks.pop_back();
+    }
+
+    const PositionedNode *preceding_hunk =
+      !preceding_spliced_hunks.empty() ? &preceding_spliced_hunks.back() :
+      remaining_hunk_count > 0 ? &hunks[remaining_hunk_count - 1] : nullptr;
+    auto old_position_for_new_position = [&](Point new_position) {
+      if (!preceding_hunk) return new_position;
+      return preceding_hunk->old_end.traverse(new_position.traversal(preceding_hunk->new_end));
+    };
+
+    PositionedNode spliced_hunk;
+    if (overlapping_hunks.empty()) {
+      Point old_splice_start = old_position_for_new_position(new_splice_start);
+      Node *node = build_node(
+        nullptr, nullptr, Point(), Point(),
+        old_position_for_new_position(new_deletion_end).traversal(old_splice_start),
+        splice->insertion_extent, store_text(splice->deleted_text), store_text(splice->inserted_text)
+      );
+      spliced_hunk = PositionedNode(node, old_splice_start, new_splice_start);
+    } else {
+      const PositionedNode &first = overlapping_hunks.front();
+      const PositionedNode &last = overlapping_hunks.back();
+      bool overlaps_first_start = first.new_start <= new_splice_start;
+      bool overlaps_last_end = last.new_end >= new_deletion_end && last.new_end > new_splice_start;
+      Point new_extent_prefix = first.new_start < new_splice_start ?
+        new_splice_start.traversal(first.new_start) : Point();
+      Point new_extent_suffix = last.new_end > new_deletion_end ?
+        last.new_end.traversal(new_deletion_end) : Point();
+
+      Point old_start = overlaps_first_start ?
+        first.old_start : old_position_for_new_position(new_splice_start);
+      Point new_start = std::min(first.new_start, new_splice_start);
+      Point old_end = last.new_end >= new_deletion_end ?
+        last.old_end : last.old_end.traverse(new_deletion_end.traversal(last.new_end));
+
+      unique_ptr<Text> old_text;
+      if (splice->deleted_text) {
+        overlapping_hunk_views.clear();
+        for (const PositionedNode &hunk : overlapping_hunks) {
+          overlapping_hunk_views.push_back(hunk.hunk());
+        }
+        old_text = compute_old_text(splice->deleted_text, new_splice_start,
+                                    overlapping_hunk_views);
+      }
+
+      TextView new_text;
+      if (splice->inserted_text &&
+          (!overlaps_first_start || first.node->new_text) &&
+          (!overlaps_last_end || last.node->new_text)) {
+        Text empty_text;
+        TextSlice new_text_prefix = overlaps_first_start ?
+          slice_text(first.node->new_text).prefix(new_extent_prefix) : TextSlice(empty_text);
+        TextSlice new_text_suffix = overlaps_last_end ?
+          slice_text(last.node->new_text).suffix(new_deletion_end.traversal(last.new_start)) :
+          TextSlice(empty_text);
+        new_text = store_text(new_text_prefix, TextSlice(splice->inserted_text), new_text_suffix);
+      }
+
+      Node *merged_node = first.node;
+      merged_node->old_extent = old_end.traversal(old_start);
+      merged_node->new_extent = new_extent_prefix
+        .traverse(splice->insertion_extent)
+        .traverse(new_extent_suffix);
+      merged_node->old_text = store_text(old_text.get());
+      merged_node->new_text = new_text;
+      spliced_hunk = PositionedNode(merged_node, old_start, new_start);
+
+      for (size_t i = 1; i < overlapping_hunks.size(); i++) {
+        Node *node = overlapping_hunks[i].node;
+        node->left = node->right = nullptr;
+        delete_node(&node);
+      }
+
+      // Like splice, only discard an emptied hunk if the splice fell within it.
+      if (overlapping_hunks.size() == 1 && overlaps_first_start && overlaps_last_end &&
+          spliced_hunk.node->old_extent.is_zero() && spliced_hunk.node->new_extent.is_zero()) {
+        spliced_hunk.node->left = spliced_hunk.node->right = nullptr;
+        delete_node(&spliced_hunk.node);
+      }
+    }
+
+    if (spliced_hunk.node) spliced_hunks.push_back(spliced_hunk);
+    spliced_hunks.insert(spliced_hunks.end(), preceding_spliced_hunks.rbegin(),
+                         preceding_spliced_hunks.rend());
+  }
+
+  while (remaining_hunk_count > 0) {
+    spliced_hunks.push_back(hunks[--remaining_hunk_count]);
+  }
+
+  std::reverse(spliced_hunks.begin(), spliced_hunks.end());
+  for (size_t i = 0; i < spliced_hunks.size(); i++) {
+    spliced_hunks[i].update_new_start(i > 0 ? &spliced_hunks[i - 1] : nullptr);
+  }
+  root = build_balanced_tree(spliced_hunks.data(), spliced_hunks.data() + spliced_hunks.size(),
+                             Point(), Point());
+  deep_access_work.store(0, std::memory_order_relaxed);
+}
+
 bool Patch::splice_old(Point old_splice_start, Point old_deletion_extent,
                       Point old_insertion_extent) {
   if (is_frozen()) {
     return false;
   }
 
+  if (btree) {
+    splice_old_btree(old_splice_start, old_deletion_extent, old_insertion_extent);
+    compact_text_if_needed();
+    return true;
+  }
+
   if (!root) {
     return true;
   }
 
+  rebalance_if_needed();
+
   Point old_deletion_end = old_splice_start.traverse(old_deletion_extent);
   Point old_insertion_end = old_splice_start.traverse(old_insertion_extent);
 
@@ -833,6 +2445,7 @@ bool Patch::splice_old(Point old_splice_start, Point old_deletion_extent,
         root->old_distance_from_left_ancestor.traverse(old_insertion_extent);
     root->new_distance_from_left_ancestor =
         root->new_distance_from_left_ancestor.traverse(old_insertion_extent);
+    root->update_subtree_summary();
     return true;
   }
 
@@ -883,12 +2496,7 @@ bool Patch::splice_old(Point old_splice_start, Point old_deletion_extent,
         upper_bound->old_extent =
             lower_bound->old_extent.traverse(upper_bound->old_extent);
         if (lower_bound->old_text && upper_bound->old_text) {
-          lower_bound->old_text->insert(
-            lower_bound->old_text->end(),
-            upper_bound->old_text->begin(),
-            upper_bound->old_text->end()
-          );
-          std::swap(upper_bound->old_text, lower_bound->old_text);
+          upper_bound->old_text = store_text(lower_bound->old_text, upper_bound->old_text);
         } else {
           upper_bound->old_text = nullptr;
         }
@@ -896,12 +2504,7 @@ bool Patch::splice_old(Point old_splice_start, Point old_deletion_extent,
         upper_bound->new_extent =
             lower_bound->new_extent.traverse(upper_bound->new_extent);
         if (lower_bound->new_text && upper_bound->new_text) {
-          lower_bound->new_text->insert(
-            lower_bound->new_text->end(),
-            upper_bound->new_text->begin(),
-            upper_bound->new_text->end()
-          );
-          std::swap(upper_bound->new_text, lower_bound->new_text);
+          upper_bound->new_text = store_text(lower_bound->new_text, upper_bound->new_text);
         } else {
           upper_bound->new_text = nullptr;
         }
@@ -915,58 +2518,1090 @@ bool Patch::splice_old(Point old_splice_start, Point old_deletion_extent,
     }
   }
 
+  root->update_top_subtree_summaries();
+  compact_text_if_needed();
   return true;
 }
 
+// Splices the way splice_sorted() treats each splice of a batch: the hunks
+// that overlap the splice are merged with it into a single hunk, and the
+// hunks that follow it only need the distance of the first of them updated.
+void Patch::splice_btree(Point new_splice_start, Point new_deletion_extent,
+                         Point new_insertion_extent, TextView deleted_text,
+                         TextView inserted_text) {
+  Point new_deletion_end = new_splice_start.traverse(new_deletion_extent);
+  Point new_insertion_end = new_splice_start.traverse(new_insertion_extent);
+
+  BTreePosition following_hunk, first_overlapping_hunk;
+  if (merges_adjacent_hunks) {
+    following_hunk = btree->find_first_starting<NewCoordinates>([new_deletion_end](Point start) {
+      return start > new_deletion_end;
+    });
+    first_overlapping_hunk = btree->find_first_ending<NewCoordinates>([new_splice_start](Point end) {
+      return end >= new_splice_start;
+    });
+  } else {
+    following_hunk = btree->find_first_starting<NewCoordinates>([new_deletion_end](Point start) {
+      return start >= new_deletion_end;
+    });
+    first_overlapping_hunk = btree->find_first_ending<NewCoordinates>([new_splice_start](Point end) {
+      return end > new_splice_start;
+    });
+    if (following_hunk.index < first_overlapping_hunk.index) following_hunk = first_overlapping_hunk;
+  }
+  if (first_overlapping_hunk.index > following_hunk.index) first_overlapping_hunk = following_hunk;
+
+  vector<Hunk> overlapping_hunks;
+  for (BTreePosition position = first_overlapping_hunk; position.index < following_hunk.index;
+       btree->advance(&position)) {
+    overlapping_hunks.push_back(position.get_hunk());
+  }
+
+  Point preceding_old_end = first_overlapping_hunk.preceding_old_end;
+  Point preceding_new_end = first_overlapping_hunk.preceding_new_end;
+  auto old_position_for_new_position = [&](Point new_position) {
+    return preceding_old_end.traverse(new_position.traversal(preceding_new_end));
+  };
+
+  Hunk spliced_hunk;
+  bool keeps_spliced_hunk = true;
+  if (overlapping_hunks.empty()) {
+    spliced_hunk = Hunk{
+      old_position_for_new_position(new_splice_start), old_position_for_new_position(new_deletion_end),
+      new_splice_start, new_insertion_end,
+      store_text(deleted_text), store_text(inserted_text)
+    };
+  } else {
+    const Hunk &first = overlapping_hunks.front();
+    const Hunk &last = overlapping_hunks.back();
+    bool overlaps_first_start = first.new_start <= new_splice_start;
+    bool overlaps_last_end = last.new_end >= new_deletion_end && last.new_end > new_splice_start;
+    Point new_extent_prefix = first.new_start < new_splice_start ?
+      new_splice_start.traversal(first.new_start) : Point();
+    Point new_extent_suffix = last.new_end > new_deletion_end ?
+      last.new_end.traversal(new_deletion_end) : Point();
+
+    spliced_hunk.old_start = overlaps_first_start ?
+      first.old_start : old_position_for_new_position(new_splice_start);
+    spliced_hunk.new_start = std::min(first.new_start, new_splice_start);
+    spliced_hunk.old_end = last.new_end >= new_deletion_end ?
+      last.old_end : last.old_end.traverse(new_deletion_end.traversal(last.new_end));
+    spliced_hunk.new_end = spliced_hunk.new_start.traverse(
+      new_extent_prefix.traverse(new_insertion_extent).traverse(new_extent_suffix));
+    spliced_hunk.old_text = store_text(
+      compute_old_text(deleted_text, new_splice_start, overlapping_hunks).get());
+    if (inserted_text &&
+        (!overlaps_first_start || first.new_text) &&
+        (!overlaps_last_end || last.new_text)) {
+      Text empty_text;
+      TextSlice new_text_prefix = overlaps_first_start ?
+        slice_text(first.new_text).prefix(new_extent_prefix) : TextSlice(empty_text);
+      TextSlice new_text_suffix = overlaps_last_end ?
+        slice_text(last.new_text).suffix(new_deletion_end.traversal(last.new_start)) :
+        TextSlice(empty_text);
+      spliced_hunk.new_text = store_text(new_text_prefix, TextSlice(inserted_text), new_text_suffix);
+    }
+
+    // Like splice, only discard an emptied hunk if the splice fell within it.
+    keeps_spliced_hunk = !(overlapping_hunks.size() == 1 && overlaps_first_start && overlaps_last_end &&
+                           spliced_hunk.old_end == spliced_hunk.old_start &&
+                           spliced_hunk.new_end == spliced_hunk.new_start);
+  }
+
+  BTreeEntry replacements[2];
+  uint32_t replacement_count = 0;
+  if (keeps_spliced_hunk) {
+    replacements[replacement_count++] = BTreeEntry{
+      spliced_hunk.old_start.traversal(preceding_old_end),
+      spliced_hunk.new_start.traversal(preceding_new_end),
+      spliced_hunk.old_end.traversal(spliced_hunk.old_start),
+      spliced_hunk.new_end.traversal(spliced_hunk.new_start),
+      spliced_hunk.old_text,
+      spliced_hunk.new_text
+    };
+    preceding_old_end = spliced_hunk.old_end;
+    preceding_new_end = spliced_hunk.new_end;
+  }
+
+  uint32_t replaced_count = following_hunk.index - first_overlapping_hunk.index;
+  if (following_hunk.leaf) {
+    Hunk hunk = following_hunk.get_hunk();
+    BTreeEntry &entry = replacements[replacement_count++] = following_hunk.get_entry();
+    entry.old_distance = hunk.old_start.traversal(preceding_old_end);
+    entry.new_distance = new_insertion_end.traverse(hunk.new_start.traversal(new_deletion_end))
+      .traversal(preceding_new_end);
+    replaced_count++;
+  }
+
+  replace_btree_hunks(first_overlapping_hunk.index, replaced_count, replacements, replacement_count);
+}
+
+// Mirrors splice_old(): the hunks between the last one that ends before the
+// splice and the first one that starts after it are removed, and the latter
+// is shifted, merging it with the former if they end up adjacent.
+void Patch::splice_old_btree(Point old_splice_start, Point old_deletion_extent,
+                             Point old_insertion_extent) {
+  Point old_deletion_end = old_splice_start.traverse(old_deletion_extent);
+  Point old_insertion_end = old_splice_start.traverse(old_insertion_extent);
+
+  BTreePosition first_removed_hunk = btree->find_first_ending<OldCoordinates>([old_splice_start](Point end) {
+    return end > old_splice_start;
+  });
+  BTreePosition upper_bound = btree->find_first_starting<OldCoordinates>(
+    [old_splice_start, old_deletion_end](Point start) {
+      return start >= old_deletion_end && start > old_splice_start;
+    });
+
+  bool has_lower_bound = first_removed_hunk.index > 0;
+  Point lower_bound_old_end = first_removed_hunk.preceding_old_end;
+  Point lower_bound_new_end = first_removed_hunk.preceding_new_end;
+  uint32_t removed_count = upper_bound.index - first_removed_hunk.index;
+  if (!upper_bound.leaf) {
+    replace_btree_hunks(first_removed_hunk.index, removed_count, nullptr, 0);
+    return;
+  }
+
+  Hunk upper_bound_hunk = upper_bound.get_hunk();
+  Point new_insertion_end = has_lower_bound ?
+    lower_bound_new_end.traverse(old_insertion_end.traversal(lower_bound_old_end)) : old_insertion_end;
+  Point distance_between_splice_and_upper_bound = upper_bound_hunk.old_start.traversal(old_deletion_end);
+  BTreeEntry entry = upper_bound.get_entry();
+  entry.old_distance = old_insertion_end.traverse(distance_between_splice_and_upper_bound)
+    .traversal(lower_bound_old_end);
+  entry.new_distance = new_insertion_end.traverse(distance_between_splice_and_upper_bound)
+    .traversal(lower_bound_new_end);
+
+  if (!has_lower_bound || !entry.old_distance.is_zero()) {
+    replace_btree_hunks(first_removed_hunk.index, removed_count + 1, &entry, 1);
+    return;
+  }
+
+  BTreeEntry merged_entry = btree->get(first_removed_hunk.index - 1);
+  merged_entry.old_extent = merged_entry.old_extent.traverse(entry.old_extent);
+  merged_entry.new_extent = merged_entry.new_extent.traverse(entry.new_extent);
+  if (merged_entry.old_text && entry.old_text) {
+    merged_entry.old_text = store_text(merged_entry.old_text, entry.old_text);
+  } else {
+    merged_entry.old_text = nullptr;
+  }
+  if (merged_entry.new_text && entry.new_text) {
+    merged_entry.new_text = store_text(merged_entry.new_text, entry.new_text);
+  } else {
+    merged_entry.new_text = nullptr;
+  }
+  replace_btree_hunks(first_removed_hunk.index - 1, removed_count + 2, &merged_entry, 1);
+}
+
+// Replaces a run of consecutive hunks, overwriting as many of them in place
+// as there are replacements.
+void Patch::replace_btree_hunks(uint32_t index, uint32_t replaced_count,
+                                const BTreeEntry *replacements, uint32_t replacement_count) {
+  uint32_t i = 0;
+  for (; i < replaced_count && i < replacement_count; i++) {
+    btree->set(btree->root, index + i, replacements[i]);
+  }
+  for (uint32_t j = i; j < replaced_count; j++) {
+    btree->erase(index + i);
+  }
+  for (; i < replacement_count; i++) {
+    btree->insert(index + i, replacements[i]);
+  }
+  hunk_count = hunk_count - replaced_count + replacement_count;
+}
+
+// Returns the hunks in order, each positioned relative to the one before it.
+vector<Patch::BTreeEntry> Patch::get_btree_entries() const {
+  vector<BTreeEntry> result;
+  result.reserve(hunk_count);
+  Point old_end, new_end;
+  for (HunkCursor hunk = get_hunk_cursor(); hunk; hunk.next()) {
+    result.push_back(BTreeEntry{
+      hunk->old_start.traversal(old_end),
+      hunk->new_start.traversal(new_end),
+      hunk->old_end.traversal(hunk->old_start),
+      hunk->new_end.traversal(hunk->new_start),
+      hunk->old_text,
+      hunk->new_text
+    });
+    old_end = hunk->old_end;
+    new_end = hunk->new_end;
+  }
+  return result;
+}
+
+// Builds the tree out of hunks that are sorted and don't overlap, copying
+// their texts. Unlike with splice_sorted_hunks(), the first hunk may start at
+// different positions in the old and new text. Empty hunks are dropped, as
+// splicing would have. The patch must be empty.
+void Patch::assign_hunks(const vector<Hunk> &hunks) {
+  auto is_empty = [](const Hunk &hunk) {
+    return hunk.old_end == hunk.old_start && hunk.new_end == hunk.new_start;
+  };
+
+  if (btree) {
+    vector<BTreeEntry> entries;
+    entries.reserve(hunks.size());
+    Point old_end, new_end;
+    for (const Hunk &hunk : hunks) {
+      if (is_empty(hunk)) continue;
+      entries.push_back(BTreeEntry{
+        hunk.old_start.traversal(old_end),
+        hunk.new_start.traversal(new_end),
+        hunk.old_end.traversal(hunk.old_start),
+        hunk.new_end.traversal(hunk.new_start),
+        store_text(hunk.old_text),
+        store_text(hunk.new_text)
+      });
+      old_end = hunk.old_end;
+      new_end = hunk.new_end;
+    }
+    btree->assign(entries);
+    hunk_count = entries.size();
+    return;
+  }
+
+  vector<PositionedNode> nodes;
+  nodes.reserve(hunks.size());
+  for (const Hunk &hunk : hunks) {
+    if (is_empty(hunk)) continue;
+    Node *node = build_node(nullptr, nullptr, Point(), Point(),
+                            hunk.old_end.traversal(hunk.old_start),
+                            hunk.new_end.traversal(hunk.new_start),
+                            store_text(hunk.old_text), store_text(hunk.new_text));
+    nodes.push_back(PositionedNode(node, hunk.old_start, hunk.new_start));
+  }
+  root = build_balanced_tree(nodes.data(), nodes.data() + nodes.size(), Point(), Point());
+}
+
+// Serialization and the debugging output describe the shape of a splay tree,
+// so a B+ tree is first copied into one.
+Patch Patch::get_splay_tree_copy() const {
+  Patch result{merges_adjacent_hunks};
+  result.assign_hunks(get_hunks());
+  return result;
+}
+
+template <typename CoordinateSpace>
+Patch Patch::split_btree_at(Point position) {
+  Patch result{merges_adjacent_hunks, Backend::BTree};
+  result.max_depth_factor = max_depth_factor;
+  result.frozen = frozen;
+  result.text_arena = text_arena;
+  result.compacted_text_size = compacted_text_size;
+
+  BTreePosition first_moved_hunk = btree->find_first_ending<CoordinateSpace>([position](Point end) {
+    return end > position;
+  });
+  if (!first_moved_hunk.leaf) return result;
+
+  // The first hunk that moves is no longer preceded by another one, so its
+  // distances become its start.
+  Hunk hunk = first_moved_hunk.get_hunk();
+  vector<BTreeEntry> entries = get_btree_entries();
+  vector<BTreeEntry> moved_entries(entries.begin() + first_moved_hunk.index, entries.end());
+  moved_entries.front().old_distance = hunk.old_start;
+  moved_entries.front().new_distance = hunk.new_start;
+  entries.resize(first_moved_hunk.index);
+  btree->assign(entries);
+  result.btree->assign(moved_entries);
+  hunk_count = entries.size();
+  result.hunk_count = moved_entries.size();
+  return result;
+}
+
 Patch Patch::copy() {
-  Node *new_root = nullptr;
-  if (root) {
-    new_root = root->copy();
+  Patch result{merges_adjacent_hunks, get_backend()};
+  result.max_depth_factor = max_depth_factor;
+  if (btree) {
+    // B+ tree nodes aren't shared between patches, so the copy gets its own.
+    vector<BTreeEntry> entries = get_btree_entries();
+    if (frozen) {
+      for (BTreeEntry &entry : entries) {
+        entry.old_text = result.store_text(entry.old_text);
+        entry.new_text = result.store_text(entry.new_text);
+      }
+    } else {
+      result.text_arena = text_arena;
+      result.compacted_text_size = compacted_text_size;
+    }
+    result.btree->assign(entries);
+    result.hunk_count = hunk_count;
+    return result;
+  }
+  if (!root) return result;
+
+  // Deserialized patches may borrow their text from a buffer that the copy
+  // must not depend on, and can't be spliced anyway, so copy them in full.
+  if (frozen) {
+    slab_allocator<Node> &allocator = result.get_node_allocator();
+    result.root = root->copy(allocator);
+    node_stack.clear();
+    node_stack.push_back(result.root);
+
+    while (!node_stack.empty()) {
+      Node *node = node_stack.back();
+      node_stack.pop_back();
+      node->old_text = result.store_text(node->old_text);
+      node->new_text = result.store_text(node->new_text);
+      if (node->left) {
+        node->left->reference_count--;
+        node->left = node->left->copy(allocator);
+        node_stack.push_back(node->left);
+      }
+      if (node->right) {
+        node->right->reference_count--;
+        node->right = node->right->copy(allocator);
+        node_stack.push_back(node->right);
+      }
+    }
+  } else {
+    result.node_allocator = node_allocator;
+    result.text_arena = text_arena;
+    result.compacted_text_size = compacted_text_size;
+    result.root = root;
+    root->reference_count++;
+  }
+
+  result.hunk_count = hunk_count;
+  return result;
+}
+
+Patch Patch::invert() {
+  Patch result{merges_adjacent_hunks, get_backend()};
+  result.max_depth_factor = max_depth_factor;
+  if (btree) {
+    vector<BTreeEntry> entries = get_btree_entries();
+    for (BTreeEntry &entry : entries) {
+      std::swap(entry.old_distance, entry.new_distance);
+      std::swap(entry.old_extent, entry.new_extent);
+      std::swap(entry.old_text, entry.new_text);
+      if (frozen) {
+        entry.old_text = result.store_text(entry.old_text);
+        entry.new_text = result.store_text(entry.new_text);
+      }
+    }
+    if (!frozen) {
+      result.text_arena = text_arena;
+      result.compacted_text_size = compacted_text_size;
+    }
+    result.btree->assign(entries);
+  } else if (root) {
+    // Share the text arena, unless texts may be borrowed from a serialized
+    // buffer, as in copy().
+    if (!frozen) {
+      result.text_arena = text_arena;
+      result.compacted_text_size = compacted_text_size;
+    }
+
+    slab_allocator<Node> &allocator = result.get_node_allocator();
+    result.root = root->invert(allocator);
     node_stack.clear();
-    node_stack.push_back(new_root);
+    node_stack.push_back(result.root);
 
     while (!node_stack.empty()) {
       Node *node = node_stack.back();
       node_stack.pop_back();
+      if (frozen) {
+        node->old_text = result.store_text(node->old_text);
+        node->new_text = result.store_text(node->new_text);
+      }
       if (node->left) {
-        node->left = node->left->copy();
+        node->left = node->left->invert(allocator);
         node_stack.push_back(node->left);
       }
       if (node->right) {
-        node->right = node->right->copy();
+        node->right = node->right->invert(allocator);
         node_stack.push_back(node->right);
       }
     }
   }
-
-  return Patch{new_root, hunk_count, merges_adjacent_hunks};
+
+  result.hunk_count = hunk_count;
+  return result;
+}
+
+optional<Text> Patch::apply(const Text &old_text) const {
+  return apply_hunks<OldCoordinates, NewCoordinates>(old_text);
+}
+
+optional<Text> Patch::apply_inverse(const Text &new_text) const {
+  return apply_hunks<NewCoordinates, OldCoordinates>(new_text);
+}
+
+// Finds the character at `target` in a text, scanning forward from the last
+// position found. Returns false if the text has no such position.
+static bool advance_to_position(Point target, const uint16_t **current,
+                                const uint16_t **line_start, unsigned *row,
+                                const uint16_t *end) {
+  if (target.row > *row) {
+    const uint16_t *newline = find_newline(*line_start, end, target.row - *row);
+    if (newline == end) return false;
+    *line_start = newline + 1;
+    *row = target.row;
+    *current = *line_start;
+  }
+  if (static_cast<size_t>(end - *line_start) < target.column) return false;
+  const uint16_t *result = *line_start + target.column;
+  if (result < *current || find_newline(*current, result) != result) return false;
+  *current = result;
+  return true;
+}
+
+template <typename SourceSpace, typename TargetSpace>
+optional<Text> Patch::apply_hunks(const Text &source_text) const {
+  struct Replacement {
+    const uint16_t *start;
+    const uint16_t *end;
+    TextView text;
+  };
+
+  // Locate each hunk in the source text first, so that the result can be
+  // allocated at its final size.
+  vector<Replacement> replacements;
+  replacements.reserve(hunk_count);
+  const uint16_t *current = source_text.data(), *line_start = current;
+  const uint16_t *source_end = source_text.data() + source_text.size();
+  unsigned row = 0;
+  size_t result_size = source_text.size();
+  for (HunkCursor cursor = get_hunk_cursor(); cursor; cursor.next()) {
+    TextView replaced_text = SourceSpace::text(*cursor);
+    TextView replacement_text = TargetSpace::text(*cursor);
+    if (!replacement_text) return optional<Text>{};
+
+    const uint16_t *start = current;
+    if (!advance_to_position(SourceSpace::start(*cursor), &start, &line_start, &row, source_end)) {
+      return optional<Text>{};
+    }
+    const uint16_t *end = start;
+    if (!advance_to_position(SourceSpace::end(*cursor), &end, &line_start, &row, source_end)) {
+      return optional<Text>{};
+    }
+    if (replaced_text && replaced_text != TextView{start, static_cast<size_t>(end - start)}) {
+      return optional<Text>{};
+    }
+
+    replacements.push_back(Replacement{start, end, replacement_text});
+    result_size = result_size - (end - start) + replacement_text.size();
+    current = end;
+  }
+
+  Text result;
+  result.reserve(result_size);
+  current = source_text.data();
+  for (const Replacement &replacement : replacements) {
+    result.insert(result.end(), current, replacement.start);
+    result.insert(result.end(), replacement.text.begin(), replacement.text.end());
+    current = replacement.end;
+  }
+  result.insert(result.end(), current, source_end);
+  return optional<Text>{move(result)};
+}
+
+vector<Point> Patch::translate_old_positions(const vector<Point> &positions, ClipMode clip_mode) const {
+  return translate_positions<OldCoordinates, NewCoordinates>(positions, clip_mode);
+}
+
+vector<Point> Patch::translate_new_positions(const vector<Point> &positions, ClipMode clip_mode) const {
+  return translate_positions<NewCoordinates, OldCoordinates>(positions, clip_mode);
+}
+
+template <typename SourceSpace, typename TargetSpace>
+vector<Point> Patch::translate_positions(const vector<Point> &positions, ClipMode clip_mode) const {
+  vector<Point> result;
+  result.reserve(positions.size());
+
+  // The text between the end of the last hunk passed and the start of the
+  // next one is unchanged, so positions there keep their distance from it.
+  HunkCursor hunk = get_hunk_cursor();
+  Point source_base, target_base, previous_position;
+  for (Point position : positions) {
+    if (position < previous_position) {
+      hunk.reset();
+      source_base = target_base = Point();
+    }
+    previous_position = position;
+
+    // Pass the hunks that end before the position, and those that end at it
+    // unless they only insert text there and the position is clipped to the
+    // start of that text.
+    while (hunk) {
+      Point start = SourceSpace::start(*hunk), end = SourceSpace::end(*hunk);
+      if (end < position || (end == position && (start < end || clip_mode == ClipMode::Forward))) {
+        source_base = end;
+        target_base = TargetSpace::end(*hunk);
+        hunk.next();
+      } else {
+        break;
+      }
+    }
+
+    if (hunk && SourceSpace::start(*hunk) < position) {
+      result.push_back(clip_mode == ClipMode::Backward ? TargetSpace::start(*hunk) : TargetSpace::end(*hunk));
+    } else {
+      result.push_back(target_base.traverse(position.traversal(source_base)));
+    }
+  }
+  return result;
+}
+
+bool Patch::coalesce(Point max_distance) {
+  return coalesce_hunks(max_distance, nullptr);
+}
+
+bool Patch::coalesce(Point max_distance, const Text &new_text) {
+  return coalesce_hunks(max_distance, &new_text);
+}
+
+bool Patch::coalesce_hunks(Point max_distance, const Text *new_text) {
+  if (is_frozen()) {
+    return false;
+  }
+
+  vector<Hunk> hunks = get_hunks();
+  vector<std::pair<size_t, size_t>> runs;
+  for (size_t i = 0; i < hunks.size();) {
+    size_t run_end = i + 1;
+    while (run_end < hunks.size() &&
+           hunks[run_end].new_start.traversal(hunks[run_end - 1].new_end) < max_distance) {
+      run_end++;
+    }
+    if (run_end - i > 1) runs.push_back({i, run_end});
+    i = run_end;
+  }
+  if (runs.empty()) return true;
+
+  // Join the texts of each run's hunks with the unchanged text between them,
+  // which is available when it's empty or when the new text is given.
+  vector<Text> merged_texts;
+  merged_texts.reserve(runs.size() * 2);
+  const uint16_t *current = nullptr, *line_start = nullptr, *text_end = nullptr;
+  unsigned row = 0;
+  if (new_text) {
+    current = line_start = new_text->data();
+    text_end = new_text->data() + new_text->size();
+  }
+
+  vector<Hunk> merged_hunks;
+  merged_hunks.reserve(hunks.size());
+  size_t next_hunk = 0;
+  for (const std::pair<size_t, size_t> &run : runs) {
+    merged_hunks.insert(merged_hunks.end(), hunks.begin() + next_hunk, hunks.begin() + run.first);
+    next_hunk = run.second;
+
+    Text old_text, new_text_in_run;
+    bool has_old_text = true, has_new_text = true;
+    for (size_t i = run.first; i < run.second; i++) {
+      const Hunk &hunk = hunks[i];
+      if (i > run.first) {
+        const uint16_t *gap_start = current, *gap_end;
+        if (new_text) {
+          if (!advance_to_position(hunks[i - 1].new_end, &gap_start, &line_start, &row, text_end)) {
+            return false;
+          }
+          gap_end = gap_start;
+          if (!advance_to_position(hunk.new_start, &gap_end, &line_start, &row, text_end)) {
+            return false;
+          }
+          current = gap_end;
+        } else if (hunk.new_start == hunks[i - 1].new_end) {
+          gap_start = gap_end = nullptr;
+        } else {
+          has_old_text = has_new_text = false;
+          continue;
+        }
+        old_text.insert(old_text.end(), gap_start, gap_end);
+        new_text_in_run.insert(new_text_in_run.end(), gap_start, gap_end);
+      }
+      if (hunk.old_text) {
+        old_text.insert(old_text.end(), hunk.old_text.begin(), hunk.old_text.end());
+      } else {
+        has_old_text = false;
+      }
+      if (hunk.new_text) {
+        new_text_in_run.insert(new_text_in_run.end(), hunk.new_text.begin(), hunk.new_text.end());
+      } else {
+        has_new_text = false;
+      }
+    }
+
+    TextView merged_old_text, merged_new_text;
+    if (has_old_text) {
+      merged_texts.push_back(move(old_text));
+      merged_old_text = TextView(&merged_texts.back());
+    }
+    if (has_new_text) {
+      merged_texts.push_back(move(new_text_in_run));
+      merged_new_text = TextView(&merged_texts.back());
+    }
+    const Hunk &first_hunk = hunks[run.first], &last_hunk = hunks[run.second - 1];
+    merged_hunks.push_back(Hunk{
+      first_hunk.old_start, last_hunk.old_end,
+      first_hunk.new_start, last_hunk.new_end,
+      merged_old_text, merged_new_text
+    });
+  }
+  merged_hunks.insert(merged_hunks.end(), hunks.begin() + next_hunk, hunks.end());
+
+  // Rebuild the tree in a new patch, whose texts are copied out of this one's
+  // before it is replaced.
+  Patch coalesced_patch{merges_adjacent_hunks, get_backend()};
+  coalesced_patch.splice_sorted_hunks(merged_hunks);
+
+  node_allocator.swap(coalesced_patch.node_allocator);
+  btree.swap(coalesced_patch.btree);
+  text_arena.swap(coalesced_patch.text_arena);
+  std::swap(root, coalesced_patch.root);
+  std::swap(hunk_count, coalesced_patch.hunk_count);
+  std::swap(compacted_text_size, coalesced_patch.compacted_text_size);
+  std::swap(line_starts_cache, coalesced_patch.line_starts_cache);
+  deep_access_work.store(0, std::memory_order_relaxed);
+  return true;
+}
+
+Patch Patch::split_at_old_position(Point position) {
+  return split_at<OldCoordinates>(position);
+}
+
+Patch Patch::split_at_new_position(Point position) {
+  return split_at<NewCoordinates>(position);
+}
+
+template <typename CoordinateSpace>
+Patch Patch::split_at(Point position) {
+  if (btree) return split_btree_at<CoordinateSpace>(position);
+  Patch result{merges_adjacent_hunks};
+  result.max_depth_factor = max_depth_factor;
+  result.frozen = frozen;
+  result.node_allocator = node_allocator;
+  result.text_arena = text_arena;
+  result.compacted_text_size = compacted_text_size;
+  if (!root) return result;
+
+  Node *last_node = splay_node_ending_before<CoordinateSpace>(position);
+  if (!last_node) {
+    std::swap(root, result.root);
+    std::swap(hunk_count, result.hunk_count);
+    return result;
+  }
+
+  result.root = last_node->right;
+  last_node->right = nullptr;
+  if (!result.root) return result;
+  last_node->update_subtree_summary();
+
+  // The detached nodes were positioned relative to the end of the last node
+  // that stays behind. Their first node has no left subtree once it's the
+  // root, so only its own distance needs to become absolute.
+  result.hunk_count = result.root->subtree_summary.hunk_count;
+  hunk_count -= result.hunk_count;
+  Point old_end = last_node->old_distance_from_left_ancestor.traverse(last_node->old_extent);
+  Point new_end = last_node->new_distance_from_left_ancestor.traverse(last_node->new_extent);
+  Node *first_node = result.splay_leftmost_node();
+  first_node->old_distance_from_left_ancestor = old_end.traverse(first_node->old_distance_from_left_ancestor);
+  first_node->new_distance_from_left_ancestor = new_end.traverse(first_node->new_distance_from_left_ancestor);
+  first_node->update_subtree_summary();
+  return result;
+}
+
+optional<Patch> Patch::concat(Patch &&first, Patch &&second) {
+  if (first.btree || second.btree) {
+    // There are no subtrees to hang off one another, so rebuild the result
+    // from both patches' hunks, the second ones shifted to follow the first.
+    vector<Hunk> hunks = first.get_hunks();
+    Point old_end, new_end;
+    if (!hunks.empty()) {
+      old_end = hunks.back().old_end;
+      new_end = hunks.back().new_end;
+    }
+    vector<Hunk> second_hunks = second.get_hunks();
+    if (!second_hunks.empty() && second_hunks.front().old_start < old_end) return optional<Patch>{};
+
+    Patch result{first.merges_adjacent_hunks, first.get_backend()};
+    result.max_depth_factor = first.max_depth_factor;
+    result.frozen = first.frozen || second.frozen;
+    Text merged_old_text, merged_new_text;
+    Point second_new_end;
+    for (size_t i = 0; i < second_hunks.size(); i++) {
+      Hunk hunk = second_hunks[i];
+      Point new_distance = i == 0 ?
+        hunk.old_start.traversal(old_end) : hunk.new_start.traversal(second_new_end);
+      second_new_end = hunk.new_end;
+      Point new_extent = hunk.new_end.traversal(hunk.new_start);
+      hunk.new_start = new_end.traverse(new_distance);
+      hunk.new_end = hunk.new_start.traverse(new_extent);
+      new_end = hunk.new_end;
+
+      // Merge the hunks that meet at the boundary, as a splice would have.
+      if (i == 0 && result.merges_adjacent_hunks && !hunks.empty() && new_distance.is_zero()) {
+        Hunk &last_hunk = hunks.back();
+        if (last_hunk.old_text && hunk.old_text) {
+          merged_old_text = TextSlice::concat(TextSlice(last_hunk.old_text), TextSlice(hunk.old_text));
+          last_hunk.old_text = TextView(&merged_old_text);
+        } else {
+          last_hunk.old_text = TextView();
+        }
+        if (last_hunk.new_text && hunk.new_text) {
+          merged_new_text = TextSlice::concat(TextSlice(last_hunk.new_text), TextSlice(hunk.new_text));
+          last_hunk.new_text = TextView(&merged_new_text);
+        } else {
+          last_hunk.new_text = TextView();
+        }
+        last_hunk.old_end = hunk.old_end;
+        last_hunk.new_end = hunk.new_end;
+      } else {
+        hunks.push_back(hunk);
+      }
+    }
+    result.assign_hunks(hunks);
+    Patch released_first{move(first)}, released_second{move(second)};
+    return optional<Patch>{move(result)};
+  }
+
+  // Bring the last hunk of `first` and the first hunk of `second` to the
+  // roots, so that the second tree can hang off the right of the first.
+  Point old_end, new_end, old_start;
+  Node *last_node = first.root ? first.splay_rightmost_node() : nullptr;
+  if (last_node) {
+    old_end = last_node->old_distance_from_left_ancestor.traverse(last_node->old_extent);
+    new_end = last_node->new_distance_from_left_ancestor.traverse(last_node->new_extent);
+  }
+  Node *first_node = second.root ? second.splay_leftmost_node() : nullptr;
+  if (first_node) {
+    old_start = first_node->old_distance_from_left_ancestor;
+    if (old_start < old_end) return optional<Patch>{};
+  }
+
+  // Both patches are left empty. Whatever `result` doesn't take over from
+  // `second` is released along with `rest`.
+  Patch result{move(first)};
+  Patch rest{move(second)};
+  result.frozen = result.frozen || rest.frozen;
+  if (!first_node) return optional<Patch>{move(result)};
+
+  // Take over the nodes and texts of `second` if nothing else uses them, or
+  // copy them otherwise.
+  bool copied_nodes = false;
+  if (rest.node_allocator != result.node_allocator) {
+    if (rest.node_allocator.use_count() == 1) {
+      result.get_node_allocator().absorb(move(*rest.node_allocator));
+    } else {
+      // The original nodes are left to `rest`, which releases them.
+      copied_nodes = true;
+      slab_allocator<Node> &allocator = result.get_node_allocator();
+      first_node = first_node->copy(allocator);
+      rest.node_stack.clear();
+      rest.node_stack.push_back(first_node);
+      while (!rest.node_stack.empty()) {
+        Node *node = rest.node_stack.back();
+        rest.node_stack.pop_back();
+        if (node->left) {
+          node->left->reference_count--;
+          node->left = node->left->copy(allocator);
+          rest.node_stack.push_back(node->left);
+        }
+        if (node->right) {
+          node->right->reference_count--;
+          node->right = node->right->copy(allocator);
+          rest.node_stack.push_back(node->right);
+        }
+      }
+    }
+  }
+  if (rest.text_arena && rest.text_arena != result.text_arena) {
+    if (rest.text_arena.use_count() == 1 && !copied_nodes) {
+      result.get_text_arena().absorb(move(*rest.text_arena));
+      result.compacted_text_size += rest.compacted_text_size;
+    } else {
+      rest.node_stack.clear();
+      rest.node_stack.push_back(first_node);
+      while (!rest.node_stack.empty()) {
+        Node *node = rest.node_stack.back();
+        rest.node_stack.pop_back();
+        node->old_text = result.store_text(node->old_text);
+        node->new_text = result.store_text(node->new_text);
+        if (node->left) rest.node_stack.push_back(node->left);
+        if (node->right) rest.node_stack.push_back(node->right);
+      }
+    }
+  }
+
+  Point distance = old_start.traversal(old_end);
+  first_node->old_distance_from_left_ancestor = distance;
+  first_node->new_distance_from_left_ancestor = distance;
+  first_node->update_subtree_summary();
+  result.hunk_count += rest.hunk_count;
+  if (rest.root == first_node) rest.root = nullptr;
+  rest.hunk_count = 0;
+  if (!last_node) {
+    result.root = first_node;
+    return optional<Patch>{move(result)};
+  }
+  last_node->right = first_node;
+
+  // Merge the hunks that meet at the boundary, as a splice would have.
+  if (result.merges_adjacent_hunks && distance.is_zero()) {
+    TextView old_text, new_text;
+    if (last_node->old_text && first_node->old_text) {
+      old_text = result.store_text(TextSlice(last_node->old_text), TextSlice(first_node->old_text),
+                                   TextSlice(TextView{nullptr, 0}));
+    }
+    if (last_node->new_text && first_node->new_text) {
+      new_text = result.store_text(TextSlice(last_node->new_text), TextSlice(first_node->new_text),
+                                   TextSlice(TextView{nullptr, 0}));
+    }
+    last_node->old_extent = last_node->old_extent.traverse(first_node->old_extent);
+    last_node->new_extent = last_node->new_extent.traverse(first_node->new_extent);
+    last_node->old_text = old_text;
+    last_node->new_text = new_text;
+    last_node->right = first_node->right;
+    result.node_allocator->destroy(first_node);
+    result.hunk_count--;
+  }
+  last_node->update_subtree_summary();
+
+  return optional<Patch>{move(result)};
+}
+
+// Presents a patch's hunks as the operations that turn its old text into its
+// new text: keeping the text before each hunk, then inserting the hunk's new
+// text and deleting its old text. Operations are positioned in the old text,
+// and the text after the last hunk is kept indefinitely.
+struct PatchOperationCursor {
+  enum Type { Retain, Insert, Delete };
+
+  Patch::HunkCursor hunk;
+  size_t hunk_index;
+  Type type;
+  Point position;
+  Point end;
+  TextSlice deleted_text;
+
+  PatchOperationCursor(const Patch &patch)
+    : hunk{patch.get_hunk_cursor()}, hunk_index{0}, type{Retain}, deleted_text{TextView()} {
+    if (hunk) end = hunk->old_start;
+    skip_empty_operations();
+  }
+
+  bool is_done() const { return type == Retain && !hunk; }
+
+  Point insertion_extent() const { return hunk->new_end.traversal(hunk->new_start); }
+
+  void finish_insertion() {
+    type = Delete;
+    end = hunk->old_end;
+    deleted_text = TextSlice(hunk->old_text);
+    skip_empty_operations();
+  }
+
+  // Moves to `target`, which must not lie past the end of the current
+  // operation, and returns the old text deleted along the way.
+  TextSlice advance_to(Point target) {
+    TextSlice result{TextView()};
+    if (type == Delete && deleted_text.text) {
+      auto split = deleted_text.split(target.traversal(position));
+      result = split.first;
+      deleted_text = split.second;
+    }
+    position = target;
+    skip_empty_operations();
+    return result;
+  }
+
+  void skip_empty_operations() {
+    while (hunk) {
+      switch (type) {
+        case Retain:
+          if (position < end) return;
+          type = Insert;
+          break;
+        case Insert:
+          if (!(hunk->new_start == hunk->new_end)) return;
+          finish_insertion();
+          return;
+        case Delete:
+          if (position < end) return;
+          hunk.next();
+          hunk_index++;
+          type = Retain;
+          if (hunk) end = hunk->old_start;
+          break;
+      }
+    }
+  }
+};
+
+// Accumulates the operations of a transformed patch into the nodes of a new
+// patch, which are arranged into a balanced tree once all of them are known.
+struct Patch::TransformedHunkBuilder {
+  Patch &patch;
+  vector<PositionedNode> nodes;
+  Point old_position;
+  Point new_position;
+  bool in_hunk;
+  size_t source_hunk_index;
+  Point hunk_old_start;
+  Point hunk_new_start;
+  Text old_text;
+  Text new_text;
+  bool has_old_text;
+  bool has_new_text;
+
+  TransformedHunkBuilder(Patch &patch, size_t expected_hunk_count) : patch(patch), in_hunk{false} {
+    nodes.reserve(expected_hunk_count);
+  }
+
+  void retain(Point extent) {
+    if (extent.is_zero()) return;
+    close_hunk();
+    old_position = old_position.traverse(extent);
+    new_position = new_position.traverse(extent);
+  }
+
+  void remove(Point extent, TextSlice text, size_t source_hunk_index) {
+    open_hunk(source_hunk_index);
+    old_position = old_position.traverse(extent);
+    if (text.text) {
+      old_text.insert(old_text.end(), text.begin(), text.end());
+    } else {
+      has_old_text = false;
+    }
+  }
+
+  void insert(Point extent, TextView text, size_t source_hunk_index) {
+    open_hunk(source_hunk_index);
+    new_position = new_position.traverse(extent);
+    if (text) {
+      new_text.insert(new_text.end(), text.begin(), text.end());
+    } else {
+      has_new_text = false;
+    }
+  }
+
+  // Hunks that end up adjacent are kept apart if the original patch keeps
+  // adjacent hunks apart.
+  void open_hunk(size_t hunk_index) {
+    if (in_hunk) {
+      if (patch.merges_adjacent_hunks || hunk_index == source_hunk_index) return;
+      close_hunk();
+    }
+    in_hunk = true;
+    source_hunk_index = hunk_index;
+    hunk_old_start = old_position;
+    hunk_new_start = new_position;
+    old_text.clear();
+    new_text.clear();
+    has_old_text = true;
+    has_new_text = true;
+  }
+
+  void close_hunk() {
+    if (!in_hunk) return;
+    in_hunk = false;
+    Node *node = patch.build_node(
+      nullptr, nullptr, Point(), Point(),
+      old_position.traversal(hunk_old_start), new_position.traversal(hunk_new_start),
+      has_old_text ? patch.store_text(TextView(&old_text)) : TextView(),
+      has_new_text ? patch.store_text(TextView(&new_text)) : TextView()
+    );
+    nodes.push_back(PositionedNode(node, hunk_old_start, hunk_new_start));
+  }
+
+  void finish() {
+    close_hunk();
+    patch.root = build_balanced_tree(nodes.data(), nodes.data() + nodes.size(), Point(), Point());
+  }
+};
+
+Patch Patch::transform(const Patch &a, const Patch &b, InsertionOrder order) {
+  // Walk both patches' operations on their common old text in step, as in
+  // the usual transformation of text operations. The result keeps the text
+  // that `a` inserts and deletes what `b` deletes of the text `a` keeps.
+  // When both patches insert text at the same position, the insertion that
+  // comes first in the given order is made first.
+  Patch result{b.merges_adjacent_hunks};
+  TransformedHunkBuilder builder{result, b.hunk_count};
+  PatchOperationCursor a_operation{a}, b_operation{b};
+  for (;;) {
+    if (a_operation.type == PatchOperationCursor::Insert &&
+        (order == InsertionOrder::AFirst || b_operation.type != PatchOperationCursor::Insert)) {
+      builder.retain(a_operation.insertion_extent());
+      a_operation.finish_insertion();
+      continue;
+    }
+
+    if (b_operation.type == PatchOperationCursor::Insert) {
+      builder.insert(b_operation.insertion_extent(), b_operation.hunk->new_text, b_operation.hunk_index);
+      b_operation.finish_insertion();
+      continue;
+    }
+
+    if (a_operation.is_done() && b_operation.is_done()) break;
+
+    Point end;
+    if (a_operation.is_done()) {
+      end = b_operation.end;
+    } else if (b_operation.is_done()) {
+      end = a_operation.end;
+    } else {
+      end = Point::min(a_operation.end, b_operation.end);
+    }
+
+    Point extent = end.traversal(b_operation.position);
+    size_t b_hunk_index = b_operation.hunk_index;
+    bool b_deletes = b_operation.type == PatchOperationCursor::Delete;
+    TextSlice deleted_text = b_operation.advance_to(end);
+    if (a_operation.type == PatchOperationCursor::Retain) {
+      if (b_deletes) {
+        builder.remove(extent, deleted_text, b_hunk_index);
+      } else {
+        builder.retain(extent);
+      }
+    }
+    a_operation.advance_to(end);
+  }
+
+  builder.finish();
+  return result;
+}
+
+Patch::Node *Patch::splay_leftmost_node() {
+  node_stack.clear();
+  Node *node = root;
+  while (node->left) {
+    node_stack.push_back(node);
+    node = node->left;
+  }
+  record_access_depth(node_stack.size() + 1);
+  return splay_node(node);
 }
 
-Patch Patch::invert() {
-  Node *inverted_root = nullptr;
-  if (root) {
-    inverted_root = root->invert();
-    node_stack.clear();
-    node_stack.push_back(inverted_root);
+Patch::Node *Patch::splay_rightmost_node() {
+  node_stack.clear();
+  Node *node = root;
+  while (node->right) {
+    node_stack.push_back(node);
+    node = node->right;
+  }
+  record_access_depth(node_stack.size() + 1);
+  return splay_node(node);
+}
 
-    while (!node_stack.empty()) {
-      Node *node = node_stack.back();
-      node_stack.pop_back();
-      if (node->left) {
-        node->left = node->left->invert();
-        node_stack.push_back(node->left);
-      }
-      if (node->right) {
-        node->right = node->right->invert();
-        node_stack.push_back(node->right);
+Patch::Node *Patch::splay_node(Node *node) {
+  // Copy any nodes on the path to the node that are shared with copies of this
+  // patch before rotating them.
+  if (is_shared()) {
+    Node **link = &root;
+    for (size_t i = 0; i <= node_stack.size(); i++) {
+      Node *&path_node = i < node_stack.size() ? node_stack[i] : node;
+      unshare_node(link);
+      path_node = *link;
+      if (i < node_stack.size()) {
+        Node *child = i + 1 < node_stack.size() ? node_stack[i + 1] : node;
+        link = path_node->left == child ? &path_node->left : &path_node->right;
       }
     }
   }
 
-  return Patch{inverted_root, hunk_count, merges_adjacent_hunks};
-}
-
-void Patch::splay_node(Node *node) {
   while (!node_stack.empty()) {
     Node *parent = node_stack.back();
     node_stack.pop_back();
@@ -1006,6 +3641,8 @@ void Patch::splay_node(Node *node) {
       }
     }
   }
+
+  return node;
 }
 
 void Patch::rotate_node_left(Node *pivot, Node *root, Node *root_parent) {
@@ -1028,6 +3665,11 @@ void Patch::rotate_node_left(Node *pivot, Node *root, Node *root_parent) {
   pivot->new_distance_from_left_ancestor =
       root->new_distance_from_left_ancestor.traverse(root->new_extent)
           .traverse(pivot->new_distance_from_left_ancestor);
+
+  // The pivot now covers the same hunks that the root did, relative to the
+  // same left ancestor.
+  pivot->subtree_summary = root->subtree_summary;
+  root->update_subtree_summary();
 }
 
 void Patch::rotate_node_right(Node *pivot, Node *root, Node *root_parent) {
@@ -1050,19 +3692,28 @@ void Patch::rotate_node_right(Node *pivot, Node *root, Node *root_parent) {
   root->new_distance_from_left_ancestor =
       root->new_distance_from_left_ancestor.traversal(
           pivot->new_distance_from_left_ancestor.traverse(pivot->new_extent));
+
+  pivot->subtree_summary = root->subtree_summary;
+  root->update_subtree_summary();
 }
 
 void Patch::delete_root() {
+  unshare_node(&root);
   Node *node = root, *parent = nullptr;
+  vector<Node *> ancestors;
   while (true) {
     if (node->left) {
+      unshare_node(&node->left);
       Node *left = node->left;
       rotate_node_right(node->left, node, parent);
       parent = left;
+      ancestors.push_back(parent);
     } else if (node->right) {
+      unshare_node(&node->right);
       Node *right = node->right;
       rotate_node_left(node->right, node, parent);
       parent = right;
+      ancestors.push_back(parent);
     } else if (parent) {
       if (parent->left == node) {
         delete_node(&parent->left);
@@ -1076,10 +3727,16 @@ void Patch::delete_root() {
       break;
     }
   }
+
+  // The nodes rotated above the deleted one still count it.
+  for (auto iter = ancestors.rbegin(); iter != ancestors.rend(); ++iter) {
+    (*iter)->update_subtree_summary();
+  }
 }
 
 std::string Patch::get_dot_graph() const {
   std::stringstream result;
+  if (btree) return get_splay_tree_copy().get_dot_graph();
   result << "digraph patch {" << endl;
   if (root) root->write_dot_graph(result, Point(), Point());
   result << "}" << endl;
@@ -1087,6 +3744,7 @@ std::string Patch::get_dot_graph() const {
 }
 
 std::string Patch::get_json() const {
+  if (btree) return get_splay_tree_copy().get_json();
   std::stringstream result;
   if (root) root->write_json(result, Point(), Point());
   return result.str();
@@ -1094,10 +3752,144 @@ std::string Patch::get_json() const {
 
 size_t Patch::get_hunk_count() const { return hunk_count; }
 
+Patch::Backend Patch::get_backend() const {
+  return btree ? Backend::BTree : Backend::SplayTree;
+}
+
+Patch::ChangeStatistics Patch::get_change_statistics() const {
+  if (btree) return btree->summarize(0, hunk_count).get_statistics();
+  return root ? root->subtree_summary.get_statistics() : ChangeSummary{}.get_statistics();
+}
+
+Patch::ChangeStatistics Patch::get_change_statistics_in_old_range(Point start, Point end) const {
+  return get_change_statistics_in_range<OldCoordinates>(start, end);
+}
+
+Patch::ChangeStatistics Patch::get_change_statistics_in_new_range(Point start, Point end) const {
+  return get_change_statistics_in_range<NewCoordinates>(start, end);
+}
+
+template <typename CoordinateSpace>
+Patch::ChangeStatistics Patch::get_change_statistics_in_range(Point start, Point end) const {
+  if (btree) {
+    uint32_t start_index = btree->find_first_starting<CoordinateSpace>([start](Point hunk_start) {
+      return hunk_start >= start;
+    }).index;
+    uint32_t end_index = btree->find_first_starting<CoordinateSpace>([end](Point hunk_start) {
+      return hunk_start >= end;
+    }).index;
+    return btree->summarize(start_index, end_index).get_statistics();
+  }
+
+  // Find the highest node that starts in the range. The other hunks in the
+  // range are then those in its left subtree that don't start before the
+  // range, and those in its right subtree that start before its end, which
+  // consist of whole subtrees hanging off of one path down each side.
+  size_t depth = 0;
+  const Node *node = root;
+  Hunk hunk;
+  Point left_ancestor_old_end, left_ancestor_new_end;
+  while (node) {
+    depth++;
+    hunk = node->get_hunk(left_ancestor_old_end, left_ancestor_new_end);
+    if (CoordinateSpace::start(hunk) < start) {
+      left_ancestor_old_end = hunk.old_end;
+      left_ancestor_new_end = hunk.new_end;
+      node = node->right;
+    } else if (CoordinateSpace::start(hunk) >= end) {
+      node = node->left;
+    } else {
+      break;
+    }
+  }
+
+  if (!node) {
+    record_access_depth(depth);
+    return ChangeSummary{}.get_statistics();
+  }
+
+  ChangeSummary result = ChangeSummary::for_hunk(hunk);
+
+  size_t left_depth = depth;
+  Point old_end = left_ancestor_old_end, new_end = left_ancestor_new_end;
+  for (const Node *left = node->left; left;) {
+    left_depth++;
+    Hunk left_hunk = left->get_hunk(old_end, new_end);
+    if (CoordinateSpace::start(left_hunk) >= start) {
+      ChangeSummary summary = ChangeSummary::for_hunk(left_hunk);
+      if (left->right) {
+        summary.append(left->right->subtree_summary, left_hunk.old_end.row, left_hunk.new_end.row);
+      }
+      summary.append(result, 0, 0);
+      result = summary;
+      left = left->left;
+    } else {
+      old_end = left_hunk.old_end;
+      new_end = left_hunk.new_end;
+      left = left->right;
+    }
+  }
+
+  size_t right_depth = depth;
+  old_end = hunk.old_end;
+  new_end = hunk.new_end;
+  for (const Node *right = node->right; right;) {
+    right_depth++;
+    Hunk right_hunk = right->get_hunk(old_end, new_end);
+    if (CoordinateSpace::start(right_hunk) < end) {
+      if (right->left) result.append(right->left->subtree_summary, old_end.row, new_end.row);
+      result.append(ChangeSummary::for_hunk(right_hunk), 0, 0);
+      old_end = right_hunk.old_end;
+      new_end = right_hunk.new_end;
+      right = right->right;
+    } else {
+      right = right->left;
+    }
+  }
+
+  record_access_depth(std::max(left_depth, right_depth));
+  return result.get_statistics();
+}
+
+Patch::MemoryUsage Patch::get_memory_usage() const {
+  MemoryUsage result{0, 0, 0};
+  if (node_allocator) result.nodes = node_allocator->capacity() * sizeof(Node);
+  if (btree) {
+    result.nodes += btree->leaf_allocator.capacity() * sizeof(BTreeLeaf) +
+                    btree->internal_allocator.capacity() * sizeof(BTreeInternal);
+  }
+  if (text_arena) result.text = text_arena->capacity() * sizeof(uint16_t);
+  result.caches = node_stack.capacity() * sizeof(Node *) +
+                  left_ancestor_stack.capacity() * sizeof(PositionStackEntry) +
+                  line_starts_cache.capacity() * sizeof(CachedLineStarts);
+  for (const CachedLineStarts &entry : line_starts_cache) {
+    result.caches += entry.line_starts.capacity() * sizeof(uint32_t);
+  }
+  return result;
+}
+
+Patch::Node *Patch::build_balanced_tree(PositionedNode *begin, PositionedNode *end,
+                                        Point left_ancestor_old_end,
+                                        Point left_ancestor_new_end) {
+  if (begin == end) return nullptr;
+
+  PositionedNode *middle = begin + (end - begin) / 2;
+  Node *node = middle->node;
+  node->old_distance_from_left_ancestor = middle->old_start.traversal(left_ancestor_old_end);
+  node->new_distance_from_left_ancestor = middle->new_start.traversal(left_ancestor_new_end);
+  node->left = build_balanced_tree(begin, middle, left_ancestor_old_end, left_ancestor_new_end);
+  node->right = build_balanced_tree(middle + 1, end, middle->old_end, middle->new_end);
+  node->update_subtree_summary();
+  return node;
+}
+
 void Patch::rebalance() {
-  if (!root)
+  deep_access_work.store(0, std::memory_order_relaxed);
+  if (btree || !root)
     return;
 
+  unshare_tree();
+
   // Transform tree to vine
   Node *pseudo_root = root, *pseudo_root_parent = nullptr;
   while (pseudo_root) {
@@ -1122,6 +3914,33 @@ void Patch::rebalance() {
   }
 }
 
+void Patch::set_max_depth_factor(float factor) {
+  max_depth_factor = factor;
+}
+
+static uint32_t get_bit_length(uint32_t value) {
+  uint32_t result = 0;
+  for (; value; value >>= 1) result++;
+  return result;
+}
+
+// Splaying a deeply nested node shortens its path, but sequential edits can
+// leave a long spine elsewhere, and const queries never splay. Rather than
+// reacting to a single deep access, add up the work of deep accesses so that
+// rebalancing never costs more than the accesses that prompted it. Const
+// queries record their depth too, so the counter is atomic.
+void Patch::record_access_depth(size_t depth) const {
+  if (max_depth_factor > 0 && depth > max_depth_factor * get_bit_length(hunk_count)) {
+    deep_access_work.fetch_add(depth, std::memory_order_relaxed);
+  }
+}
+
+void Patch::rebalance_if_needed() {
+  if (hunk_count > 0 && deep_access_work.load(std::memory_order_relaxed) >= hunk_count) {
+    rebalance();
+  }
+}
+
 void Patch::perform_rebalancing_rotations(uint32_t count) {
   Node *pseudo_root = root, *pseudo_root_parent = nullptr;
   for (uint32_t i = 0; i < count; i++) {
@@ -1138,61 +3957,17 @@ void Patch::perform_rebalancing_rotations(uint32_t count) {
 
 vector<Hunk> Patch::get_hunks() const {
   vector<Hunk> result;
-  if (!root) {
-    return result;
-  }
-
-  Node *node = root;
-  node_stack.clear();
-  left_ancestor_stack.clear();
-  left_ancestor_stack.push_back({Point(), Point()});
-
-  while (node->left) {
-    node_stack.push_back(node);
-    node = node->left;
-  }
-
-  while (node) {
-    PositionStackEntry &left_ancestor_position = left_ancestor_stack.back();
-    Point old_start = left_ancestor_position.old_end.traverse(
-        node->old_distance_from_left_ancestor);
-    Point new_start = left_ancestor_position.new_end.traverse(
-        node->new_distance_from_left_ancestor);
-    Point old_end = old_start.traverse(node->old_extent);
-    Point new_end = new_start.traverse(node->new_extent);
-    Text *old_text = node->old_text.get();
-    Text *new_text = node->new_text.get();
-    result.push_back(
-        Hunk{old_start, old_end, new_start, new_end, old_text, new_text});
-
-    if (node->right) {
-      left_ancestor_stack.push_back(PositionStackEntry{old_end, new_end});
-      node_stack.push_back(node);
-      node = node->right;
-
-      while (node->left) {
-        node_stack.push_back(node);
-        node = node->left;
-      }
-    } else {
-      while (!node_stack.empty() && node_stack.back()->right == node) {
-        node = node_stack.back();
-        node_stack.pop_back();
-        left_ancestor_stack.pop_back();
-      }
-
-      if (node_stack.empty()) {
-        node = nullptr;
-      } else {
-        node = node_stack.back();
-        node_stack.pop_back();
-      }
-    }
+  result.reserve(hunk_count);
+  for (HunkCursor cursor = get_hunk_cursor(); cursor; cursor.next()) {
+    result.push_back(*cursor);
   }
-
   return result;
 }
 
+Patch::HunkCursor Patch::get_hunk_cursor() const {
+  return HunkCursor{root, btree.get()};
+}
+
 vector<Hunk> Patch::get_hunks_in_old_range(Point start, Point end) {
   return get_hunks_in_range<OldCoordinates>(start, end);
 }
@@ -1209,18 +3984,44 @@ optional<Hunk> Patch::hunk_for_new_position(Point target) {
   return hunk_for_position<NewCoordinates>(target);
 }
 
-unique_ptr<Text> Patch::compute_old_text(unique_ptr<Text> deleted_text,
+vector<Hunk> Patch::get_hunks_in_old_range(Point start, Point end) const {
+  return get_hunks_in_range<OldCoordinates>(start, end, false);
+}
+
+vector<Hunk> Patch::get_hunks_in_new_range(Point start, Point end, bool inclusive) const {
+  return get_hunks_in_range<NewCoordinates>(start, end, inclusive);
+}
+
+optional<Hunk> Patch::hunk_for_old_position(Point target) const {
+  return hunk_for_position<OldCoordinates>(target);
+}
+
+optional<Hunk> Patch::hunk_for_new_position(Point target) const {
+  return hunk_for_position<NewCoordinates>(target);
+}
+
+unique_ptr<Text> Patch::compute_old_text(TextView deleted_text,
                                        Point new_splice_start,
                                        Point new_deletion_end) {
-  if (!deleted_text.get())
+  if (!deleted_text)
     return nullptr;
 
-  unique_ptr<Text> result {new Text()};
   Point range_start = new_splice_start, range_end = new_deletion_end;
+  return compute_old_text(
+    deleted_text,
+    new_splice_start,
+    get_hunks_in_new_range(range_start, range_end, merges_adjacent_hunks)
+  );
+}
+
+unique_ptr<Text> Patch::compute_old_text(TextView deleted_text,
+                                       Point new_splice_start,
+                                       const vector<Hunk> &overlapping_hunks) {
+  if (!deleted_text)
+    return nullptr;
 
-  auto overlapping_hunks =
-      get_hunks_in_new_range(range_start, range_end, merges_adjacent_hunks);
-  TextSlice deleted_text_slice = TextSlice(*deleted_text);
+  unique_ptr<Text> result {new Text()};
+  TextSlice deleted_text_slice = TextSlice(deleted_text);
   Point deleted_text_slice_start = new_splice_start;
 
   for (const Hunk &hunk : overlapping_hunks) {
@@ -1235,7 +4036,7 @@ unique_ptr<Text> Patch::compute_old_text(unique_ptr<Text> deleted_text,
       result->insert(result->end(), split_result.first.begin(), split_result.first.end());
     }
 
-    result->insert(result->end(), hunk.old_text->begin(), hunk.old_text->end());
+    result->insert(result->end(), hunk.old_text.begin(), hunk.old_text.end());
     deleted_text_slice = deleted_text_slice.suffix(
         hunk.new_end.traversal(deleted_text_slice_start));
     deleted_text_slice_start = hunk.new_end;
@@ -1245,17 +4046,11 @@ unique_ptr<Text> Patch::compute_old_text(unique_ptr<Text> deleted_text,
   return result;
 }
 
-static const uint32_t SERIALIZATION_VERSION = 1;
+static const uint32_t SERIALIZATION_VERSION = 2;
 
 enum Transition : uint32_t { None, Left, Right, Up };
 
-template <typename T>
-void append_to_buffer(vector<uint8_t> *output, T value) {
-  for (auto t = 0u; t < sizeof(T); ++t) {
-    output->push_back(value & 0xFF);
-    value >>= 8;
-  }
-}
+enum ChildFlags : uint8_t { HasLeftChild = 1, HasRightChild = 2 };
 
 template <typename T>
 T get_from_buffer(const uint8_t **data, const uint8_t *end) {
@@ -1280,87 +4075,235 @@ void get_point_from_buffer(const uint8_t **data, const uint8_t *end,
   point->column = get_from_buffer<uint32_t>(data, end);
 }
 
-void append_point_to_buffer(vector<uint8_t> *output, const Point &point) {
-  append_to_buffer(output, point.row);
-  append_to_buffer(output, point.column);
+void append_point_to_buffer(Serializer &output, const Point &point) {
+  output.append(point.row);
+  output.append(point.column);
 }
 
-void append_text_to_buffer(vector<uint8_t> *output, const Text *text) {
+void append_text_to_buffer(Serializer &output, TextView text) {
   if (text) {
-    append_to_buffer<uint32_t>(output, 1);
-    append_to_buffer(output, static_cast<uint32_t>(text->size()));
-    for (uint16_t character : *text) {
-      append_to_buffer(output, character);
+    output.append<uint32_t>(1);
+    output.append(static_cast<uint32_t>(text.size()));
+    for (uint16_t character : text) {
+      output.append(character);
     }
   } else {
-    append_to_buffer<uint32_t>(output, 0);
+    output.append<uint32_t>(0);
   }
 }
 
-unique_ptr<Text> get_text_from_buffer(const uint8_t **data, const uint8_t *end) {
+TextView get_text_from_buffer(const uint8_t **data, const uint8_t *end, TextArena &arena,
+                              bool borrows_text) {
   if (get_from_buffer<uint32_t>(data, end)) {
     uint32_t length = get_from_buffer<uint32_t>(data, end);
-    unique_ptr<Text> result {new Text()};
-    result->reserve(length);
+    size_t available_length = (end - *data) / sizeof(uint16_t);
+    if (length > available_length) length = available_length;
+    if (borrows_text) {
+      TextView result{reinterpret_cast<const uint16_t *>(*data), length};
+      *data += length * sizeof(uint16_t);
+      return result;
+    }
+
+    uint16_t *characters = arena.allocate(length);
     for (uint32_t i = 0; i < length; i++) {
-      result->push_back(get_from_buffer<uint16_t>(data, end));
+      characters[i] = get_from_buffer<uint16_t>(data, end);
     }
-    return result;
+    return TextView{characters, length};
   } else {
     return nullptr;
   }
 }
 
-void get_node_from_buffer(const uint8_t **data, const uint8_t *end, Patch::Node *node) {
+void get_node_from_buffer(const uint8_t **data, const uint8_t *end, Patch::Node *node,
+                          TextArena &arena, bool borrows_text) {
   get_point_from_buffer(data, end, &node->old_extent);
   get_point_from_buffer(data, end, &node->new_extent);
   get_point_from_buffer(data, end, &node->old_distance_from_left_ancestor);
   get_point_from_buffer(data, end, &node->new_distance_from_left_ancestor);
-  node->old_text = get_text_from_buffer(data, end);
-  node->new_text = get_text_from_buffer(data, end);
+  node->old_text = get_text_from_buffer(data, end, arena, borrows_text);
+  node->new_text = get_text_from_buffer(data, end, arena, borrows_text);
   node->left = nullptr;
   node->right = nullptr;
+  node->reference_count = 1;
 }
 
-void append_node_to_buffer(vector<uint8_t> *output, const Patch::Node &node) {
+void append_node_to_buffer(Serializer &output, const Patch::Node &node) {
   append_point_to_buffer(output, node.old_extent);
   append_point_to_buffer(output, node.new_extent);
   append_point_to_buffer(output, node.old_distance_from_left_ancestor);
   append_point_to_buffer(output, node.new_distance_from_left_ancestor);
-  append_text_to_buffer(output, node.old_text.get());
-  append_text_to_buffer(output, node.new_text.get());
+  append_text_to_buffer(output, node.old_text);
+  append_text_to_buffer(output, node.new_text);
 }
 
-void Patch::serialize(vector<uint8_t> *output) const {
-  if (!root)
+template <typename T>
+void append_varint_to_buffer(Serializer &output, T value) {
+  while (value >= 0x80) {
+    output.append(static_cast<uint8_t>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  output.append(static_cast<uint8_t>(value));
+}
+
+template <typename T>
+T get_varint_from_buffer(const uint8_t **data, const uint8_t *end) {
+  T value = 0;
+  for (auto shift = 0u; *data < end && shift < 8 * sizeof(T); shift += 7) {
+    uint8_t byte = *((*data)++);
+    value |= static_cast<T>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) break;
+  }
+  return value;
+}
+
+// Points are written as LEB128 varints. Points that tend to resemble another
+// point in the same node, such as a hunk's new extent and its old extent, are
+// written as zigzag-encoded differences from that point instead.
+void append_compact_point_to_buffer(Serializer &output, const Point &point) {
+  append_varint_to_buffer<uint32_t>(output, point.row);
+  append_varint_to_buffer<uint32_t>(output, point.column);
+}
+
+void get_compact_point_from_buffer(const uint8_t **data, const uint8_t *end, Point *point) {
+  point->row = get_varint_from_buffer<uint32_t>(data, end);
+  point->column = get_varint_from_buffer<uint32_t>(data, end);
+}
+
+static uint64_t zigzag_encode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+void append_point_delta_to_buffer(Serializer &output, const Point &base, const Point &point) {
+  append_varint_to_buffer(output, zigzag_encode(static_cast<int64_t>(point.row) - base.row));
+  append_varint_to_buffer(output, zigzag_encode(static_cast<int64_t>(point.column) - base.column));
+}
+
+void get_point_delta_from_buffer(const uint8_t **data, const uint8_t *end, const Point &base, Point *point) {
+  point->row = base.row + zigzag_decode(get_varint_from_buffer<uint64_t>(data, end));
+  point->column = base.column + zigzag_decode(get_varint_from_buffer<uint64_t>(data, end));
+}
+
+// Texts start with a varint that is zero for missing text, and otherwise
+// holds the length and whether every code unit fits in a single byte. Wide
+// texts are padded to an even offset from the start of the serialization, so
+// that a patch viewing an aligned buffer can point directly at them.
+void append_compact_text_to_buffer(Serializer &output, size_t serialization_start, TextView text) {
+  if (!text) {
+    append_varint_to_buffer<uint64_t>(output, 0);
     return;
+  }
+
+  bool is_narrow = std::all_of(text.begin(), text.end(), [](uint16_t character) {
+    return character <= 0xFF;
+  });
+  append_varint_to_buffer<uint64_t>(output, ((text.size() << 1) | is_narrow) + 1);
+
+  if (is_narrow) {
+    for (uint16_t character : text) {
+      output.append(static_cast<uint8_t>(character));
+    }
+  } else {
+    if ((output.position() - serialization_start) % 2) output.append(static_cast<uint8_t>(0));
+    for (uint16_t character : text) {
+      output.append(character);
+    }
+  }
+}
+
+TextView get_compact_text_from_buffer(const uint8_t **data, const uint8_t *begin,
+                                      const uint8_t *end, TextArena &arena, bool borrows_text) {
+  uint64_t header = get_varint_from_buffer<uint64_t>(data, end);
+  if (header == 0) return nullptr;
+
+  bool is_narrow = (header - 1) & 1;
+  uint64_t length = (header - 1) >> 1;
+
+  if (is_narrow) {
+    if (length > static_cast<uint64_t>(end - *data)) length = end - *data;
+    uint16_t *characters = arena.allocate(length);
+    std::copy(*data, *data + length, characters);
+    *data += length;
+    return TextView{characters, static_cast<size_t>(length)};
+  }
+
+  if ((*data - begin) % 2 && *data < end) ++*data;
+  uint64_t available_length = (end - *data) / sizeof(uint16_t);
+  if (length > available_length) length = available_length;
+
+  if (borrows_text) {
+    TextView result{reinterpret_cast<const uint16_t *>(*data), length};
+    *data += length * sizeof(uint16_t);
+    return result;
+  }
+
+  uint16_t *characters = arena.allocate(length);
+  for (uint64_t i = 0; i < length; i++) {
+    characters[i] = get_from_buffer<uint16_t>(data, end);
+  }
+  return TextView{characters, static_cast<size_t>(length)};
+}
 
-  append_to_buffer(output, SERIALIZATION_VERSION);
+void Patch::serialize(vector<uint8_t> *output) const {
+  serialize(output, SERIALIZATION_VERSION);
+}
+
+void Patch::serialize(vector<uint8_t> *output, uint32_t version) const {
+  uint8_t buffer[4096];
+  Serializer serializer(buffer, sizeof(buffer), [output](const uint8_t *data, size_t size) {
+    output->insert(output->end(), data, data + size);
+    return true;
+  });
+  serialize(serializer, version);
+}
+
+bool Patch::serialize(Serializer &output) const {
+  return serialize(output, SERIALIZATION_VERSION);
+}
+
+bool Patch::serialize(Serializer &output, uint32_t version) const {
+  if (btree) return get_splay_tree_copy().serialize(output, version);
+  if (root) {
+    if (version == 1) {
+      serialize_version_1(output);
+    } else {
+      serialize_version_2(output);
+    }
+  }
 
-  append_to_buffer(output, hunk_count);
+  return output.flush();
+}
+
+void Patch::serialize_version_1(Serializer &output) const {
+  output.append<uint32_t>(1);
+
+  output.append(hunk_count);
 
   append_node_to_buffer(output, *root);
 
-  Node *node = root;
-  node_stack.clear();
+  const Node *node = root;
+  vector<const Node *> node_stack;
   int previous_node_child_index = -1;
 
   while (node) {
     if (node->left && previous_node_child_index < 0) {
-      append_to_buffer<uint32_t>(output, Left);
+      output.append<uint32_t>(Left);
       append_node_to_buffer(output, *node->left);
       node_stack.push_back(node);
       node = node->left;
       previous_node_child_index = -1;
     } else if (node->right && previous_node_child_index < 1) {
-      append_to_buffer<uint32_t>(output, Right);
+      output.append<uint32_t>(Right);
       append_node_to_buffer(output, *node->right);
       node_stack.push_back(node);
       node = node->right;
       previous_node_child_index = -1;
     } else if (!node_stack.empty()) {
-      append_to_buffer<uint32_t>(output, Up);
-      Node *parent = node_stack.back();
+      output.append<uint32_t>(Up);
+      const Node *parent = node_stack.back();
       node_stack.pop_back();
       previous_node_child_index = (node == parent->left) ? 0 : 1;
       node = parent;
@@ -1370,55 +4313,204 @@ void Patch::serialize(vector<uint8_t> *output) const {
   }
 }
 
-bool Patch::is_frozen() const { return frozen_node_array != nullptr; }
+// Version 2 writes the tree's shape up front as two bits of child flags per
+// node, packed four nodes to a byte, followed by every node in pre-order.
+void Patch::serialize_version_2(Serializer &output) const {
+  size_t serialization_start = output.position();
+  output.append<uint32_t>(2);
+  append_varint_to_buffer(output, hunk_count);
+
+  uint8_t shape_byte = 0;
+  uint32_t node_index = 0;
+  vector<const Node *> node_stack{root};
+  while (!node_stack.empty()) {
+    const Node *node = node_stack.back();
+    node_stack.pop_back();
+
+    uint8_t child_flags = (node->left ? HasLeftChild : 0) | (node->right ? HasRightChild : 0);
+    shape_byte |= child_flags << (2 * (node_index % 4));
+    if (++node_index % 4 == 0) {
+      output.append(shape_byte);
+      shape_byte = 0;
+    }
+
+    if (node->right) node_stack.push_back(node->right);
+    if (node->left) node_stack.push_back(node->left);
+  }
+  if (node_index % 4 != 0) output.append(shape_byte);
+
+  node_stack.push_back(root);
+  while (!node_stack.empty()) {
+    const Node *node = node_stack.back();
+    node_stack.pop_back();
+
+    append_compact_point_to_buffer(output, node->old_extent);
+    append_point_delta_to_buffer(output, node->old_extent, node->new_extent);
+    append_compact_point_to_buffer(output, node->old_distance_from_left_ancestor);
+    append_point_delta_to_buffer(output, node->old_distance_from_left_ancestor,
+                                 node->new_distance_from_left_ancestor);
+    append_compact_text_to_buffer(output, serialization_start, node->old_text);
+    append_compact_text_to_buffer(output, serialization_start, node->new_text);
+
+    if (node->right) node_stack.push_back(node->right);
+    if (node->left) node_stack.push_back(node->left);
+  }
+}
+
+bool Patch::is_frozen() const { return frozen; }
 
-Patch::Patch(const vector<uint8_t> &input)
-    : root{nullptr}, frozen_node_array{nullptr}, merges_adjacent_hunks{true} {
-  const uint8_t *begin = input.data();
-  const uint8_t *data = begin;
-  const uint8_t *end = data + input.size();
+Patch::Patch(const vector<uint8_t> &input) : Patch() {
+  deserialize(input.data(), input.size(), false);
+}
+
+Patch Patch::view(const uint8_t *data, size_t size) {
+  // Texts can only point into the buffer if its code units are laid out the
+  // way this machine reads them. Wide texts are stored at even offsets in
+  // every serialization version, so they are aligned whenever the buffer is.
+  const uint16_t byte_order_probe = 1;
+  bool is_little_endian = *reinterpret_cast<const uint8_t *>(&byte_order_probe) == 1;
+  bool is_aligned = reinterpret_cast<uintptr_t>(data) % alignof(uint16_t) == 0;
+
+  Patch result;
+  result.deserialize(data, size, is_little_endian && is_aligned);
+  return result;
+}
 
-  uint32_t serialization_version = get_from_buffer<uint32_t>(&data, end);
-  if (serialization_version != SERIALIZATION_VERSION) {
+void Patch::deserialize(const uint8_t *data, size_t size, bool borrows_text) {
+  const uint8_t *begin = data;
+  const uint8_t *end = data + size;
+
+  bool succeeded;
+  switch (get_from_buffer<uint32_t>(&data, end)) {
+  case 1:
+    hunk_count = get_from_buffer<uint32_t>(&data, end);
+    if (hunk_count == 0) return;
+    succeeded = deserialize_version_1(&data, end, borrows_text);
+    break;
+  case 2:
+    hunk_count = get_varint_from_buffer<uint32_t>(&data, end);
+    if (hunk_count == 0) return;
+    succeeded = deserialize_version_2(&data, begin, end, borrows_text);
+    break;
+  default:
     return;
   }
 
-  hunk_count = get_from_buffer<uint32_t>(&data, end);
-  if (hunk_count == 0) {
+  frozen = true;
+  if (!succeeded) {
+    delete_node(&root);
+    hunk_count = 0;
     return;
   }
 
-  node_stack.reserve(hunk_count);
-  frozen_node_array = static_cast<Node *>(calloc(hunk_count, sizeof(Node)));
-  root = frozen_node_array;
-  Node *node = root, *next_node = root + 1;
-  get_node_from_buffer(&data, end, node);
+  // Every node follows its ancestors in pre-order, so visiting the nodes in
+  // reverse summarizes each subtree before its root.
+  vector<Node *> nodes;
+  nodes.reserve(hunk_count);
+  node_stack.clear();
+  node_stack.push_back(root);
+  while (!node_stack.empty()) {
+    Node *node = node_stack.back();
+    node_stack.pop_back();
+    nodes.push_back(node);
+    if (node->right) node_stack.push_back(node->right);
+    if (node->left) node_stack.push_back(node->left);
+  }
+  for (auto iter = nodes.rbegin(); iter != nodes.rend(); ++iter) {
+    (*iter)->update_subtree_summary();
+  }
+}
+
+bool Patch::deserialize_version_1(const uint8_t **data, const uint8_t *end, bool borrows_text) {
+  // Each node takes at least four points and two text flags, so a corrupt
+  // hunk count can't make us reserve more than the buffer could hold.
+  if (hunk_count > static_cast<size_t>(end - *data) / (4 * 2 * sizeof(uint32_t) + 2 * sizeof(uint32_t))) {
+    return false;
+  }
 
-  while (next_node < root + hunk_count) {
-    switch (get_from_buffer<uint32_t>(&data, end)) {
+  node_stack.reserve(hunk_count);
+  slab_allocator<Node> &node_allocator = get_node_allocator();
+  node_allocator.reserve(hunk_count);
+  root = node_allocator.allocate();
+  Node *node = root, *next_node;
+  get_node_from_buffer(data, end, node, get_text_arena(), borrows_text);
+
+  for (uint32_t i = 1; i < hunk_count;) {
+    switch (get_from_buffer<uint32_t>(data, end)) {
     case Left:
-      get_node_from_buffer(&data, end, next_node);
+      next_node = node_allocator.allocate();
+      get_node_from_buffer(data, end, next_node, get_text_arena(), borrows_text);
       node->left = next_node;
       node_stack.push_back(node);
       node = next_node;
-      next_node++;
+      i++;
       break;
     case Right:
-      get_node_from_buffer(&data, end, next_node);
+      next_node = node_allocator.allocate();
+      get_node_from_buffer(data, end, next_node, get_text_arena(), borrows_text);
       node->right = next_node;
       node_stack.push_back(node);
       node = next_node;
-      next_node++;
+      i++;
       break;
     case Up:
+      if (node_stack.empty()) return false;
       node = node_stack.back();
       node_stack.pop_back();
       break;
     default:
-      delete[] root;
-      return;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Patch::deserialize_version_2(const uint8_t **data, const uint8_t *begin, const uint8_t *end,
+                                  bool borrows_text) {
+  const uint8_t *shape = *data;
+  if (static_cast<size_t>(end - shape) < (hunk_count + 3) / 4) return false;
+  *data += (hunk_count + 3) / 4;
+
+  // Nodes whose right child hasn't been read yet, and the node (if any) whose
+  // left child is read next.
+  node_stack.clear();
+  node_stack.reserve(hunk_count);
+  slab_allocator<Node> &node_allocator = get_node_allocator();
+  node_allocator.reserve(hunk_count);
+  Node *left_parent = nullptr;
+
+  for (uint32_t i = 0; i < hunk_count; i++) {
+    if (*data >= end) return false;
+
+    Node *node = node_allocator.allocate();
+    node->reference_count = 1;
+    if (i == 0) {
+      root = node;
+    } else if (left_parent) {
+      left_parent->left = node;
+    } else if (!node_stack.empty()) {
+      node_stack.back()->right = node;
+      node_stack.pop_back();
+    } else {
+      node_allocator.destroy(node);
+      return false;
     }
+
+    get_compact_point_from_buffer(data, end, &node->old_extent);
+    get_point_delta_from_buffer(data, end, node->old_extent, &node->new_extent);
+    get_compact_point_from_buffer(data, end, &node->old_distance_from_left_ancestor);
+    get_point_delta_from_buffer(data, end, node->old_distance_from_left_ancestor,
+                                &node->new_distance_from_left_ancestor);
+    node->old_text = get_compact_text_from_buffer(data, begin, end, get_text_arena(), borrows_text);
+    node->new_text = get_compact_text_from_buffer(data, begin, end, get_text_arena(), borrows_text);
+
+    uint8_t child_flags = shape[i / 4] >> (2 * (i % 4));
+    if (child_flags & HasRightChild) node_stack.push_back(node);
+    left_parent = (child_flags & HasLeftChild) ? node : nullptr;
   }
+
+  return !left_parent && node_stack.empty();
 }
 
 ostream &operator<<(ostream &stream, const Patch::Hunk &hunk) {
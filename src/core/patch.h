@@ -2,23 +2,46 @@
 
 #include "optional.h"
 #include "point.h"
+#include "slab_allocator.h"
 #include "text.h"
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <ostream>
 
+class Serializer;
+class TextArena;
+
 class Patch {
   struct Node;
   struct OldCoordinates;
   struct NewCoordinates;
   struct PositionStackEntry;
+  struct PositionedNode;
+  struct BatchSplice;
+  struct CachedLineStarts;
+  struct TransformedHunkBuilder;
+  struct ChangeSummary;
+  struct BTree;
+  struct BTreeNode;
+  struct BTreeLeaf;
+  struct BTreeInternal;
+  struct BTreeEntry;
+  struct BTreePosition;
 
   mutable std::vector<PositionStackEntry> left_ancestor_stack;
   mutable std::vector<Node *> node_stack;
+  std::shared_ptr<slab_allocator<Node>> node_allocator;
+  std::shared_ptr<TextArena> text_arena;
   Node *root;
-  Node *frozen_node_array;
+  std::unique_ptr<BTree> btree;
+  bool frozen;
   bool merges_adjacent_hunks;
   uint32_t hunk_count;
+  size_t compacted_text_size;
+  std::vector<CachedLineStarts> line_starts_cache;
+  float max_depth_factor;
+  mutable std::atomic<size_t> deep_access_work;
 
 public:
   struct Hunk {
@@ -26,33 +49,221 @@ public:
     Point old_end;
     Point new_start;
     Point new_end;
-    Text *old_text;
-    Text *new_text;
+    TextView old_text;
+    TextView new_text;
+  };
+
+  // The heap memory a patch holds onto, in bytes.
+  struct MemoryUsage {
+    size_t nodes;
+    size_t text;
+    size_t caches;
+  };
+
+  // Totals over a set of hunks. Texts that a hunk doesn't store count as
+  // empty. A row counts as changed if any hunk covers part of it, including a
+  // hunk that only inserts or deletes text there.
+  struct ChangeStatistics {
+    uint32_t hunk_count;
+    size_t old_text_size;
+    size_t new_text_size;
+    uint32_t old_changed_row_count;
+    uint32_t new_changed_row_count;
+  };
+
+  // How a patch stores its hunks. The splay tree moves the hunks that are
+  // spliced or looked up to its root, which makes bursts of nearby edits
+  // cheap. The B+ tree stores hunks in order in wide nodes, with their
+  // positions packed into arrays, which keeps the cost of each access close
+  // to a few cache lines when a patch holds very many hunks and is edited or
+  // queried at scattered positions. Both give the same results, but the B+
+  // tree has nothing like splaying to make consecutive edits cheap, so a run
+  // of sequential splices takes several times longer with it. Composition,
+  // transformation and deserialization always build splay trees, and a B+
+  // tree is copied into a splay tree to be serialized.
+  enum class Backend {
+    SplayTree,
+    BTree
+  };
+
+  // Which of two patches passed to transform() has its text come first
+  // where both insert text at the same position.
+  enum class InsertionOrder {
+    AFirst,
+    BFirst
+  };
+
+  // Where positions inside a hunk, which have no counterpart on the other
+  // side of it, end up: at the start or at the end of the hunk's other side.
+  enum class ClipMode {
+    Backward,
+    Forward
+  };
+
+  struct Splice {
+    Point start;
+    Point deletion_extent;
+    Point insertion_extent;
+    std::unique_ptr<Text> deleted_text;
+    std::unique_ptr<Text> inserted_text;
+  };
+
+  // Walks a patch's hunks in order, visiting nodes only as it advances. The
+  // patch must not be modified while a cursor is in use.
+  class HunkCursor {
+    struct StackEntry {
+      const Node *node;
+      Point left_ancestor_old_end;
+      Point left_ancestor_new_end;
+    };
+
+    const Node *root;
+    std::vector<StackEntry> stack;
+    const BTree *btree;
+    const BTreeLeaf *leaf;
+    uint32_t leaf_index;
+    Hunk hunk;
+
+    HunkCursor(const Node *root, const BTree *btree);
+    void push_left_spine(const Node *, Point, Point);
+    void load_hunk();
+    template <typename CoordinateSpace> size_t seek(Point);
+
+    friend class Patch;
+
+  public:
+    explicit operator bool() const { return !stack.empty() || leaf; }
+    const Hunk &operator*() const { return hunk; }
+    const Hunk *operator->() const { return &hunk; }
+    void next();
+    void reset();
+    // Moves to the last hunk starting at or before the given position, or to
+    // the first hunk if there is none.
+    void seek_to_old_position(Point);
+    void seek_to_new_position(Point);
   };
 
   Patch();
   Patch(bool merges_adjacent_hunks);
+  // Patches built by other means than splicing into an empty patch, such as
+  // compositions, transformations and deserialized patches, use the splay
+  // tree. Copies, inversions and the parts of a split patch keep the backend
+  // of the original, and concatenations keep that of the first patch.
+  Patch(bool merges_adjacent_hunks, Backend backend);
   Patch(const std::vector<uint8_t> &);
+  // Composes the given patches in order, merging each one's hunks into the
+  // result in a single pass rather than splicing them in one at a time.
   Patch(const std::vector<const Patch *> &);
-  Patch(Node *root, uint32_t hunk_count, bool merges_adjacent_hunks);
+  // Composes the given patches by composing adjacent pairs, then pairs of
+  // those compositions and so on, on up to `thread_count` threads. The result
+  // has the same hunks as the sequential composition above.
+  Patch(const std::vector<const Patch *> &, unsigned thread_count);
+  // Deserializes a frozen patch whose hunk texts point into `data` instead of
+  // being copied, except for texts that were serialized with one byte per
+  // code unit. The buffer must outlive the patch and remain unmodified.
+  static Patch view(const uint8_t *data, size_t size);
+  // Builds a balanced tree out of hunks that are sorted and don't overlap,
+  // copying their texts and dropping empty hunks.
+  static Patch from_hunks(const std::vector<Hunk> &, Backend backend = Backend::SplayTree);
   Patch(Patch &&);
   ~Patch();
   bool splice(Point start, Point deletion_extent, Point insertion_extent) { return this->splice(start, deletion_extent, insertion_extent, {}, {}); }
   bool splice(Point start, Point deletion_extent, Point insertion_extent, std::unique_ptr<Text> old_text, std::unique_ptr<Text> new_text);
   bool splice_old(Point start, Point deletion_extent, Point insertion_extent);
+  // Applies splices that are sorted by start and don't overlap, all expressed
+  // in the patch's current new coordinates, as if they were spliced one at a
+  // time from last to first. Large batches are merged with the existing hunks
+  // in a single pass instead of splaying once per splice.
+  bool splice_batch(std::vector<Splice> splices);
+  // Returns a snapshot that shares all of this patch's nodes. Splicing either
+  // patch afterward copies only the nodes along the paths it touches, so each
+  // snapshot costs memory in proportion to the edits made since. A patch and
+  // its copies share the memory for their nodes and texts, so they must not be
+  // modified or destroyed concurrently on different threads.
   Patch copy();
   Patch invert();
+  // Returns the text that results from applying the patch to `old_text`, or
+  // nothing if a hunk lacks its new text, lies past the end of `old_text`, or
+  // has an old text that differs from the text it covers.
+  optional<Text> apply(const Text &old_text) const;
+  // The reverse of apply(), which requires the hunks' old texts instead.
+  optional<Text> apply_inverse(const Text &new_text) const;
+  // Maps positions in the old text to the new text. Sorted positions are
+  // mapped in a single pass over the hunks; each position that precedes the
+  // one before it starts another pass. Positions within a hunk, and those
+  // where a hunk only inserts text, are clipped according to `clip_mode`.
+  // Positions at the edges of other hunks map to the same edges.
+  std::vector<Point> translate_old_positions(const std::vector<Point> &positions, ClipMode clip_mode) const;
+  // The reverse of translate_old_positions().
+  std::vector<Point> translate_new_positions(const std::vector<Point> &positions, ClipMode clip_mode) const;
+  // Merges runs of hunks separated by less than `max_distance` into single
+  // hunks, bounding the size of patches that accumulate scattered edits. The
+  // merged hunks keep their texts only if `new_text`, the text the patch
+  // currently produces, is given to fill in the unchanged text between them.
+  // Fails without changing the patch if it is frozen or if `new_text` doesn't
+  // contain all of its hunks.
+  bool coalesce(Point max_distance);
+  bool coalesce(Point max_distance, const Text &new_text);
+  // Moves the hunks that end after the given position into a new patch and
+  // returns it. Both patches keep the hunks' positions, and they share their
+  // memory the way copies do.
+  Patch split_at_old_position(Point position);
+  Patch split_at_new_position(Point position);
+  // Joins two patches whose hunks cover separate regions of the same old text,
+  // taking over their nodes and texts and leaving both patches empty. Hunks
+  // from `second` keep their old positions and follow those of `first` in the
+  // new text. Returns nothing, leaving both patches as they were, if a hunk
+  // from `second` starts before the end of one from `first`.
+  static optional<Patch> concat(Patch &&first, Patch &&second);
+  // Rebases `b` onto `a`, given that both patches apply to the same old text,
+  // returning a patch that applies to the new text of `a` and makes the
+  // changes of `b` there. Text inserted by `a` is kept even where `b` deletes
+  // around it, and where both insert text at the same position, `order`
+  // decides whose text comes first. Two sites that exchange concurrent
+  // patches converge if they agree on that order, one computing
+  // transform(a, b, AFirst) and the other transform(b, a, BFirst). Runs in a
+  // single pass over both patches.
+  static Patch transform(const Patch &a, const Patch &b, InsertionOrder order = InsertionOrder::AFirst);
   std::vector<Hunk> get_hunks() const;
+  HunkCursor get_hunk_cursor() const;
   std::vector<Hunk> get_hunks_in_new_range(Point start, Point end) { return this->get_hunks_in_new_range(start, end, false); }
   std::vector<Hunk> get_hunks_in_new_range(Point start, Point end, bool inclusive);
   std::vector<Hunk> get_hunks_in_old_range(Point start, Point end);
   optional<Hunk> hunk_for_old_position(Point position);
   optional<Hunk> hunk_for_new_position(Point position);
+  // The const overloads answer the same queries by descending from the root
+  // without splaying, so they never mutate the patch and can run concurrently
+  // on multiple threads, as long as no thread modifies it.
+  std::vector<Hunk> get_hunks_in_new_range(Point start, Point end) const { return this->get_hunks_in_new_range(start, end, false); }
+  std::vector<Hunk> get_hunks_in_new_range(Point start, Point end, bool inclusive) const;
+  std::vector<Hunk> get_hunks_in_old_range(Point start, Point end) const;
+  optional<Hunk> hunk_for_old_position(Point position) const;
+  optional<Hunk> hunk_for_new_position(Point position) const;
   void serialize(std::vector<uint8_t> *) const;
+  void serialize(std::vector<uint8_t> *, uint32_t version) const;
+  bool serialize(Serializer &) const;
+  bool serialize(Serializer &, uint32_t version) const;
   std::string get_dot_graph() const;
   std::string get_json() const;
   void rebalance();
+  // Rebalances the tree automatically once accesses that descend deeper than
+  // `factor` times the log of the hunk count have done as much work as the
+  // rebalancing itself, which is linear in the hunk count. Defaults to 4. A
+  // factor of zero disables automatic rebalancing. A B+ tree stays balanced
+  // as it is spliced, so neither of these has any effect on one.
+  void set_max_depth_factor(float factor);
   size_t get_hunk_count() const;
+  Backend get_backend() const;
+  // Every node keeps these totals for its subtree, so they are available for
+  // the whole patch in constant time, and for the hunks that start in a range
+  // in time proportional to the depth of the tree. Passing a start of (0, 0)
+  // gives the totals for the hunks that precede `end`.
+  ChangeStatistics get_change_statistics() const;
+  ChangeStatistics get_change_statistics_in_old_range(Point start, Point end) const;
+  ChangeStatistics get_change_statistics_in_new_range(Point start, Point end) const;
+  // Memory that is shared with copies of this patch is counted in full for
+  // each of them. Texts borrowed from a serialized buffer aren't counted.
+  MemoryUsage get_memory_usage() const;
 
 private:
   template <typename CoordinateSpace>
@@ -70,20 +281,70 @@ private:
   template <typename CoordinateSpace>
   optional<Hunk> hunk_for_position(Point position);
 
-  std::unique_ptr<Text> compute_old_text(std::unique_ptr<Text>, Point, Point);
+  template <typename CoordinateSpace>
+  std::vector<Hunk> get_hunks_in_range(Point, Point, bool inclusive) const;
+
+  template <typename CoordinateSpace>
+  optional<Hunk> hunk_for_position(Point position) const;
+
+  template <typename SourceSpace, typename TargetSpace>
+  optional<Text> apply_hunks(const Text &) const;
+  template <typename SourceSpace, typename TargetSpace>
+  std::vector<Point> translate_positions(const std::vector<Point> &, ClipMode) const;
+  bool coalesce_hunks(Point, const Text *);
+  template <typename CoordinateSpace> Patch split_at(Point);
+  template <typename CoordinateSpace>
+  ChangeStatistics get_change_statistics_in_range(Point, Point) const;
+  Node *splay_leftmost_node();
+  Node *splay_rightmost_node();
+
+  bool splice_within_root(Point, Point, Point, TextView, TextView);
+  void splice_btree(Point, Point, Point, TextView, TextView);
+  void splice_old_btree(Point, Point, Point);
+  void replace_btree_hunks(uint32_t, uint32_t, const BTreeEntry *, uint32_t);
+  std::vector<BTreeEntry> get_btree_entries() const;
+  template <typename CoordinateSpace> Patch split_btree_at(Point);
+  void assign_hunks(const std::vector<Hunk> &);
+  Patch get_splay_tree_copy() const;
+  void splice_views(Point, Point, Point, TextView, TextView);
+  std::unique_ptr<Text> compute_old_text(TextView, Point, Point);
+  static std::unique_ptr<Text> compute_old_text(TextView, Point,
+                                                const std::vector<Hunk> &);
+  void splice_sorted(std::vector<BatchSplice> &);
+  void splice_hunks(const Patch &);
+  void splice_sorted_hunks(const std::vector<Hunk> &);
+  void get_positioned_nodes(std::vector<PositionedNode> &);
 
-  void splay_node(Node *);
+  Node *splay_node(Node *);
   void rotate_node_right(Node *, Node *, Node *);
   void rotate_node_left(Node *, Node *, Node *);
   void delete_root();
   void perform_rebalancing_rotations(uint32_t);
-  Node *build_node(Node *, Node *, Point, Point, Point, Point,
-                  std::unique_ptr<Text>, std::unique_ptr<Text>);
+  void record_access_depth(size_t) const;
+  void rebalance_if_needed();
+  static Node *build_balanced_tree(PositionedNode *, PositionedNode *, Point, Point);
+  Node *build_node(Node *, Node *, Point, Point, Point, Point, TextView, TextView);
   void delete_node(Node **);
+  slab_allocator<Node> &get_node_allocator();
+  bool is_shared() const;
+  void unshare_node(Node **);
+  void unshare_tree();
+  TextArena &get_text_arena();
+  TextView store_text(TextView);
+  TextView store_text(TextSlice, TextSlice, TextSlice = TextSlice(TextView()));
+  TextSlice slice_text(TextView);
+  void cache_line_starts(TextView, std::vector<uint32_t> &&);
+  void compact_text_if_needed();
   bool is_frozen() const;
+  void serialize_version_1(Serializer &) const;
+  void serialize_version_2(Serializer &) const;
+  void deserialize(const uint8_t *, size_t, bool borrows_text);
+  bool deserialize_version_1(const uint8_t **, const uint8_t *, bool borrows_text);
+  bool deserialize_version_2(const uint8_t **, const uint8_t *, const uint8_t *, bool borrows_text);
 
-  friend void get_node_from_buffer(const uint8_t **data, const uint8_t *end, Node *node);
-  friend void append_node_to_buffer(std::vector<uint8_t> *output, const Node &node);
+  friend void get_node_from_buffer(const uint8_t **data, const uint8_t *end, Node *node,
+                                   TextArena &arena, bool borrows_text);
+  friend void append_node_to_buffer(Serializer &output, const Node &node);
 };
 
 std::ostream &operator<<(std::ostream &, const Patch::Hunk &);
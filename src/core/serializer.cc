@@ -0,0 +1,27 @@
+#include "serializer.h"
+#include <algorithm>
+#include <cstring>
+
+Serializer::Serializer(uint8_t *buffer, size_t capacity, FlushCallback flush_callback)
+    : buffer{buffer}, capacity{capacity}, size{0}, bytes_flushed{0}, failed{false},
+      flush_callback{flush_callback} {}
+
+void Serializer::append(const uint8_t *data, size_t length) {
+  while (length > 0) {
+    if (size == capacity) flush();
+    size_t chunk_size = std::min(length, capacity - size);
+    std::memcpy(buffer + size, data, chunk_size);
+    size += chunk_size;
+    data += chunk_size;
+    length -= chunk_size;
+  }
+}
+
+bool Serializer::flush() {
+  if (size > 0 && !failed) {
+    failed = !flush_callback(buffer, size);
+  }
+  bytes_flushed += size;
+  size = 0;
+  return !failed;
+}
@@ -0,0 +1,45 @@
+#ifndef SUPERSTRING_SERIALIZER_H
+#define SUPERSTRING_SERIALIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+// Collects serialized bytes in a fixed-size buffer and hands them to a flush
+// callback whenever the buffer fills up, so that large structures can be
+// streamed to a file or socket without materializing the whole serialization.
+// The callback returns false to signal a write error, after which all further
+// output is discarded.
+class Serializer {
+public:
+  typedef std::function<bool(const uint8_t *data, size_t size)> FlushCallback;
+
+  Serializer(uint8_t *buffer, size_t capacity, FlushCallback flush_callback);
+
+  void append(uint8_t byte) {
+    if (size == capacity) flush();
+    buffer[size++] = byte;
+  }
+
+  template <typename T> void append(T value) {
+    for (auto t = 0u; t < sizeof(T); ++t) {
+      append(static_cast<uint8_t>(value & 0xFF));
+      value >>= 8;
+    }
+  }
+
+  void append(const uint8_t *data, size_t length);
+  bool flush();
+  size_t position() const { return bytes_flushed + size; }
+  bool has_failed() const { return failed; }
+
+private:
+  uint8_t *buffer;
+  size_t capacity;
+  size_t size;
+  size_t bytes_flushed;
+  bool failed;
+  FlushCallback flush_callback;
+};
+
+#endif // SUPERSTRING_SERIALIZER_H
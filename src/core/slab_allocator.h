@@ -0,0 +1,114 @@
+#ifndef SUPERSTRING_SLAB_ALLOCATOR_H
+#define SUPERSTRING_SLAB_ALLOCATOR_H
+
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Hands out fixed-size blocks for objects of type T, carved from a growing
+// list of slabs. Destroyed objects are recycled through an intrusive free
+// list, and slabs are only returned to the system allocator all at once when
+// the allocator is cleared or destroyed.
+template <typename T> class slab_allocator {
+  std::vector<void *> slabs;
+  void *free_list;
+  size_t next_slab_capacity;
+  size_t current_slab_capacity;
+  size_t current_slab_size;
+  size_t total_capacity;
+
+  enum : size_t { min_slab_capacity = 8, max_slab_capacity = 1024 };
+
+  void *allocate_block() {
+    static_assert(sizeof(T) >= sizeof(void *), "Slab blocks must be able to hold a free list link");
+
+    if (free_list) {
+      void *block = free_list;
+      free_list = *static_cast<void **>(block);
+      return block;
+    }
+
+    if (current_slab_size == current_slab_capacity) {
+      add_slab(next_slab_capacity);
+      if (next_slab_capacity < max_slab_capacity) next_slab_capacity *= 2;
+    }
+
+    return static_cast<T *>(slabs.back()) + current_slab_size++;
+  }
+
+  void add_slab(size_t capacity) {
+    void *slab = std::malloc(capacity * sizeof(T));
+    if (!slab) throw std::bad_alloc();
+    slabs.push_back(slab);
+    total_capacity += capacity;
+    current_slab_capacity = capacity;
+    current_slab_size = 0;
+  }
+
+public:
+  slab_allocator()
+      : free_list{nullptr}, next_slab_capacity{min_slab_capacity},
+        current_slab_capacity{0}, current_slab_size{0}, total_capacity{0} {}
+
+  slab_allocator(slab_allocator &&other) : slab_allocator() { swap(other); }
+
+  slab_allocator(const slab_allocator &) = delete;
+  slab_allocator &operator=(const slab_allocator &) = delete;
+
+  ~slab_allocator() { clear(); }
+
+  template <typename... Args> T *allocate(Args &&... args) {
+    return new (allocate_block()) T{std::forward<Args>(args)...};
+  }
+
+  void destroy(T *object) {
+    object->~T();
+    *static_cast<void **>(static_cast<void *>(object)) = free_list;
+    free_list = object;
+  }
+
+  // Ensures the next `count` allocations that don't reuse freed blocks are
+  // carved contiguously out of a single slab.
+  void reserve(size_t count) {
+    if (current_slab_capacity - current_slab_size < count) {
+      add_slab(count);
+    }
+  }
+
+  // Releases every slab without running destructors. Callers are responsible
+  // for destroying any objects that still own resources.
+  void clear() {
+    for (void *slab : slabs) std::free(slab);
+    slabs.clear();
+    free_list = nullptr;
+    next_slab_capacity = min_slab_capacity;
+    current_slab_capacity = 0;
+    current_slab_size = 0;
+    total_capacity = 0;
+  }
+
+  // Takes over another allocator's slabs, so that the objects allocated from
+  // them can be destroyed through this allocator. The other allocator's free
+  // blocks are not reused.
+  void absorb(slab_allocator &&other) {
+    slabs.insert(slabs.end(), other.slabs.begin(), other.slabs.end());
+    total_capacity += other.total_capacity;
+    other.slabs.clear();
+    other.clear();
+  }
+
+  void swap(slab_allocator &other) {
+    std::swap(slabs, other.slabs);
+    std::swap(free_list, other.free_list);
+    std::swap(next_slab_capacity, other.next_slab_capacity);
+    std::swap(current_slab_capacity, other.current_slab_capacity);
+    std::swap(current_slab_size, other.current_slab_size);
+    std::swap(total_capacity, other.total_capacity);
+  }
+
+  // The number of objects that fit in the slabs allocated so far.
+  size_t capacity() const { return total_capacity; }
+};
+
+#endif // SUPERSTRING_SLAB_ALLOCATOR_H
@@ -0,0 +1,329 @@
+#include "text-diff.h"
+#include "newline-scan.h"
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using std::vector;
+
+// A range of each text that differs, as offsets into the items being diffed.
+struct DiffRegion {
+  size_t old_start;
+  size_t old_end;
+  size_t new_start;
+  size_t new_end;
+};
+
+template <typename T>
+static size_t get_common_prefix_length(const T *a, const T *b, size_t length) {
+  size_t i = 0;
+  while (i < length && a[i] == b[i]) i++;
+  return i;
+}
+
+// Counts back from the ends of both sequences.
+template <typename T>
+static size_t get_common_suffix_length(const T *a_end, const T *b_end, size_t length) {
+  size_t i = 0;
+  while (i < length && a_end[-1 - static_cast<ptrdiff_t>(i)] == b_end[-1 - static_cast<ptrdiff_t>(i)]) i++;
+  return i;
+}
+
+// Texts often share long runs, so compare them eight code units at a time.
+// SSE2 is always available on x86-64, so there's no need to dispatch at
+// runtime.
+static size_t get_common_prefix_length(const uint16_t *a, const uint16_t *b, size_t length) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= length; i += 8) {
+    __m128i a_block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    __m128i b_block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(a_block, b_block));
+    if (mask != 0xffff) return i + __builtin_ctz(~mask) / 2;
+  }
+#endif
+  while (i < length && a[i] == b[i]) i++;
+  return i;
+}
+
+static size_t get_common_suffix_length(const uint16_t *a_end, const uint16_t *b_end, size_t length) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= length; i += 8) {
+    __m128i a_block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a_end - i - 8));
+    __m128i b_block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b_end - i - 8));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi16(a_block, b_block));
+    if (mask != 0xffff) return i + (__builtin_clz(~mask & 0xffff) - 16) / 2;
+  }
+#endif
+  while (i < length && a_end[-1 - static_cast<ptrdiff_t>(i)] == b_end[-1 - static_cast<ptrdiff_t>(i)]) i++;
+  return i;
+}
+
+// Finds the differing regions between two sequences with Myers' linear space
+// algorithm: search from both ends at once for a snake in the middle of an
+// optimal edit path, then diff the parts before and after it the same way.
+// This follows the bisection in Neil Fraser's diff-match-patch.
+template <typename T>
+class MyersDiff {
+  // Bounds the cost of each bisection. Past this many edits, the region is
+  // split at the furthest point either search reached, which keeps the diff
+  // correct but possibly not minimal.
+  enum : ptrdiff_t { max_work = 1 << 26, min_max_edit_count = 256 };
+
+  const T *old_items;
+  const T *new_items;
+  vector<DiffRegion> *regions;
+  vector<ptrdiff_t> forward_frontier;
+  vector<ptrdiff_t> reverse_frontier;
+
+  void add_region(size_t old_start, size_t old_end, size_t new_start, size_t new_end) {
+    if (old_start == old_end && new_start == new_end) return;
+    if (!regions->empty() && regions->back().old_end == old_start &&
+        regions->back().new_end == new_start) {
+      regions->back().old_end = old_end;
+      regions->back().new_end = new_end;
+    } else {
+      regions->push_back(DiffRegion{old_start, old_end, new_start, new_end});
+    }
+  }
+
+  void bisect(size_t old_start, size_t old_end, size_t new_start, size_t new_end) {
+    const T *a = old_items + old_start, *b = new_items + new_start;
+    ptrdiff_t n = old_end - old_start, m = new_end - new_start;
+    ptrdiff_t max_d = std::min((n + m + 1) / 2,
+                               std::max<ptrdiff_t>(min_max_edit_count, max_work / (n + m)));
+    ptrdiff_t offset = max_d + 1;
+    ptrdiff_t length = 2 * max_d + 3;
+    forward_frontier.assign(length, -1);
+    reverse_frontier.assign(length, -1);
+    ptrdiff_t *forward = forward_frontier.data(), *reverse = reverse_frontier.data();
+    forward[offset + 1] = 0;
+    reverse[offset + 1] = 0;
+
+    // Paths from each end meet on the same diagonal only if the difference in
+    // length is odd for the forward search and even for the reverse one.
+    ptrdiff_t delta = n - m;
+    bool check_forward = delta % 2 != 0;
+    ptrdiff_t forward_k_start = 0, forward_k_end = 0, reverse_k_start = 0, reverse_k_end = 0;
+    for (ptrdiff_t d = 0; d < max_d; d++) {
+      for (ptrdiff_t k = -d + forward_k_start; k <= d - forward_k_end; k += 2) {
+        ptrdiff_t x;
+        if (k == -d || (k != d && forward[offset + k - 1] < forward[offset + k + 1])) {
+          x = forward[offset + k + 1];
+        } else {
+          x = forward[offset + k - 1] + 1;
+        }
+        ptrdiff_t y = x - k;
+        while (x < n && y < m && a[x] == b[y]) x++, y++;
+        forward[offset + k] = x;
+
+        if (x > n) {
+          forward_k_end += 2;
+        } else if (y > m) {
+          forward_k_start += 2;
+        } else if (check_forward) {
+          ptrdiff_t reverse_k = delta - k;
+          if (reverse_k >= -max_d && reverse_k <= max_d && reverse[offset + reverse_k] != -1 &&
+              x >= n - reverse[offset + reverse_k]) {
+            split(old_start, old_end, new_start, new_end, x, y);
+            return;
+          }
+        }
+      }
+
+      for (ptrdiff_t k = -d + reverse_k_start; k <= d - reverse_k_end; k += 2) {
+        ptrdiff_t x;
+        if (k == -d || (k != d && reverse[offset + k - 1] < reverse[offset + k + 1])) {
+          x = reverse[offset + k + 1];
+        } else {
+          x = reverse[offset + k - 1] + 1;
+        }
+        ptrdiff_t y = x - k;
+        while (x < n && y < m && a[n - x - 1] == b[m - y - 1]) x++, y++;
+        reverse[offset + k] = x;
+
+        if (x > n) {
+          reverse_k_end += 2;
+        } else if (y > m) {
+          reverse_k_start += 2;
+        } else if (!check_forward) {
+          ptrdiff_t forward_k = delta - k;
+          if (forward_k >= -max_d && forward_k <= max_d && forward[offset + forward_k] != -1) {
+            ptrdiff_t forward_x = forward[offset + forward_k];
+            if (forward_x >= n - x) {
+              split(old_start, old_end, new_start, new_end, forward_x, forward_x - forward_k);
+              return;
+            }
+          }
+        }
+      }
+    }
+
+    ptrdiff_t best_x = 0, best_y = 0, best_progress = 0;
+    for (ptrdiff_t k = -max_d; k <= max_d; k++) {
+      ptrdiff_t x = forward[offset + k], y = x - k;
+      if (x != -1 && x <= n && y >= 0 && y <= m && x + y > best_progress) {
+        best_x = x, best_y = y, best_progress = x + y;
+      }
+      x = reverse[offset + k], y = x - k;
+      if (x != -1 && x <= n && y >= 0 && y <= m && x + y > best_progress) {
+        best_x = n - x, best_y = m - y, best_progress = x + y;
+      }
+    }
+    if (best_progress > 0 && best_progress < n + m) {
+      split(old_start, old_end, new_start, new_end, best_x, best_y);
+    } else {
+      add_region(old_start, old_end, new_start, new_end);
+    }
+  }
+
+  void split(size_t old_start, size_t old_end, size_t new_start, size_t new_end,
+             ptrdiff_t x, ptrdiff_t y) {
+    diff(old_start, old_start + x, new_start, new_start + y);
+    diff(old_start + x, old_end, new_start + y, new_end);
+  }
+
+public:
+  MyersDiff(const T *old_items, const T *new_items, vector<DiffRegion> *regions)
+      : old_items{old_items}, new_items{new_items}, regions{regions} {}
+
+  // Appends the regions that differ between the given ranges, in order.
+  void diff(size_t old_start, size_t old_end, size_t new_start, size_t new_end) {
+    size_t prefix_length = get_common_prefix_length(
+      old_items + old_start, new_items + new_start,
+      std::min(old_end - old_start, new_end - new_start)
+    );
+    old_start += prefix_length;
+    new_start += prefix_length;
+
+    size_t suffix_length = get_common_suffix_length(
+      old_items + old_end, new_items + new_end,
+      std::min(old_end - old_start, new_end - new_start)
+    );
+    old_end -= suffix_length;
+    new_end -= suffix_length;
+
+    if (old_start == old_end || new_start == new_end) {
+      add_region(old_start, old_end, new_start, new_end);
+    } else {
+      bisect(old_start, old_end, new_start, new_end);
+    }
+  }
+};
+
+struct Line {
+  const uint16_t *characters;
+  size_t length;
+
+  bool operator==(const Line &other) const {
+    return length == other.length && std::equal(characters, characters + length, other.characters);
+  }
+};
+
+struct LineHash {
+  size_t operator()(const Line &line) const {
+    size_t result = 2166136261u;
+    for (size_t i = 0; i < line.length; i++) {
+      result = (result ^ line.characters[i]) * 16777619u;
+    }
+    return result;
+  }
+};
+
+// Splits a range of a text into lines, including their newlines, and numbers
+// each distinct line, so that lines can be diffed as single items.
+static void get_lines(const uint16_t *text, size_t start, size_t end,
+                      std::unordered_map<Line, uint32_t, LineHash> *line_ids,
+                      vector<uint32_t> *ids, vector<size_t> *line_starts) {
+  const uint16_t *line_start = text + start, *text_end = text + end;
+  while (line_start != text_end) {
+    const uint16_t *newline = find_newline(line_start, text_end);
+    const uint16_t *line_end = newline == text_end ? text_end : newline + 1;
+    Line line{line_start, static_cast<size_t>(line_end - line_start)};
+    auto entry = line_ids->insert({line, static_cast<uint32_t>(line_ids->size())});
+    ids->push_back(entry.first->second);
+    line_starts->push_back(line_start - text);
+    line_start = line_end;
+  }
+  line_starts->push_back(end);
+}
+
+static bool is_line_start(const uint16_t *text, size_t index, size_t first_line_start) {
+  return index == first_line_start || text[index - 1] == '\n';
+}
+
+Patch text_diff(const Text &old_text, const Text &new_text, DiffGranularity granularity) {
+  const uint16_t *old_characters = old_text.data(), *new_characters = new_text.data();
+  size_t old_size = old_text.size(), new_size = new_text.size();
+
+  // Skip the lines both texts start and end with before splitting the rest
+  // into lines, moving inward to line boundaries.
+  size_t prefix_length = get_common_prefix_length(old_characters, new_characters,
+                                                  std::min(old_size, new_size));
+  const uint16_t *last_newline = find_last_newline(old_characters, old_characters + prefix_length);
+  prefix_length = last_newline == old_characters + prefix_length ? 0 : last_newline + 1 - old_characters;
+
+  size_t suffix_length = get_common_suffix_length(
+    old_characters + old_size, new_characters + new_size,
+    std::min(old_size, new_size) - prefix_length
+  );
+  if (!is_line_start(old_characters, old_size - suffix_length, prefix_length) ||
+      !is_line_start(new_characters, new_size - suffix_length, prefix_length)) {
+    const uint16_t *suffix_end = old_characters + old_size;
+    const uint16_t *newline = find_newline(suffix_end - suffix_length, suffix_end);
+    suffix_length = newline == suffix_end ? 0 : suffix_end - newline - 1;
+  }
+
+  std::unordered_map<Line, uint32_t, LineHash> line_ids;
+  vector<uint32_t> old_line_ids, new_line_ids;
+  vector<size_t> old_line_starts, new_line_starts;
+  get_lines(old_characters, prefix_length, old_size - suffix_length, &line_ids, &old_line_ids, &old_line_starts);
+  get_lines(new_characters, prefix_length, new_size - suffix_length, &line_ids, &new_line_ids, &new_line_starts);
+
+  vector<DiffRegion> line_regions;
+  MyersDiff<uint32_t>(old_line_ids.data(), new_line_ids.data(), &line_regions)
+    .diff(0, old_line_ids.size(), 0, new_line_ids.size());
+
+  vector<DiffRegion> regions;
+  MyersDiff<uint16_t> character_diff(old_characters, new_characters, &regions);
+  for (const DiffRegion &line_region : line_regions) {
+    DiffRegion region{
+      old_line_starts[line_region.old_start], old_line_starts[line_region.old_end],
+      new_line_starts[line_region.new_start], new_line_starts[line_region.new_end]
+    };
+    if (granularity == DiffGranularity::Characters) {
+      character_diff.diff(region.old_start, region.old_end, region.new_start, region.new_end);
+    } else {
+      regions.push_back(region);
+    }
+  }
+
+  vector<Patch::Hunk> hunks;
+  hunks.reserve(regions.size());
+  TextView old_view{old_characters, old_size}, new_view{new_characters, new_size};
+  Point old_position, new_position;
+  size_t old_offset = 0;
+  for (const DiffRegion &region : regions) {
+    Point unchanged_extent = TextSlice(old_view, old_offset, region.old_start).extent();
+    old_position = old_position.traverse(unchanged_extent);
+    new_position = new_position.traverse(unchanged_extent);
+    Point old_end = old_position.traverse(TextSlice(old_view, region.old_start, region.old_end).extent());
+    Point new_end = new_position.traverse(TextSlice(new_view, region.new_start, region.new_end).extent());
+    hunks.push_back(Patch::Hunk{
+      old_position, old_end, new_position, new_end,
+      TextView{old_characters + region.old_start, region.old_end - region.old_start},
+      TextView{new_characters + region.new_start, region.new_end - region.new_start}
+    });
+    old_position = old_end;
+    new_position = new_end;
+    old_offset = region.old_end;
+  }
+
+  return Patch::from_hunks(hunks);
+}
@@ -0,0 +1,22 @@
+#ifndef SUPERSTRING_TEXT_DIFF_H
+#define SUPERSTRING_TEXT_DIFF_H
+
+#include "patch.h"
+#include "text.h"
+
+enum class DiffGranularity {
+  // Hunks replace whole lines.
+  Lines,
+  // Changed lines are diffed again, so that hunks only replace the characters
+  // that differ.
+  Characters
+};
+
+// Computes a patch that turns `old_text` into `new_text` using Myers' diff
+// algorithm, with the texts of both sides stored in its hunks. When the
+// texts differ so much that finding a minimal diff would take too long, some
+// changes are reported as larger hunks than necessary.
+Patch text_diff(const Text &old_text, const Text &new_text,
+                DiffGranularity granularity = DiffGranularity::Characters);
+
+#endif // SUPERSTRING_TEXT_DIFF_H
@@ -1,4 +1,6 @@
 #include "text.h"
+#include "newline-scan.h"
+#include <algorithm>
 #include <limits.h>
 #include <vector>
 #include <memory>
@@ -8,21 +10,43 @@ using std::vector;
 using std::unique_ptr;
 using std::ostream;
 
-TextSlice::TextSlice(Text &text) : text{&text}, start_index{0}, end_index{text.size()} {}
+TextView::TextView(const Text *text)
+    : characters{text ? text->data() : nullptr}, length{text ? text->size() : 0},
+      is_present{text != nullptr} {}
 
-TextSlice::TextSlice(Text *text, size_t start_index, size_t end_index)
-    : text{text}, start_index{start_index}, end_index{end_index} {}
+TextView::operator Text() const {
+  return Text(begin(), end());
+}
+
+bool TextView::operator==(const TextView &other) const {
+  if (is_present != other.is_present) return false;
+  return length == other.length && std::equal(begin(), end(), other.begin());
+}
+
+TextSlice::TextSlice(const Text &text) : TextSlice(TextView(&text)) {}
+
+TextSlice::TextSlice(TextView text)
+    : text{text}, start_index{0}, end_index{text.size()}, line_starts{nullptr},
+      line_start_count{0} {}
+
+TextSlice::TextSlice(TextView text, const vector<uint32_t> &line_starts)
+    : text{text}, start_index{0}, end_index{text.size()}, line_starts{line_starts.data()},
+      line_start_count{line_starts.size()} {}
+
+TextSlice::TextSlice(TextView text, size_t start_index, size_t end_index)
+    : text{text}, start_index{start_index}, end_index{end_index}, line_starts{nullptr},
+      line_start_count{0} {}
 
-Text::iterator TextSlice::begin() {
-  return text->begin() + start_index;
+const uint16_t *TextSlice::begin() {
+  return text.begin() + start_index;
 }
 
 size_t TextSlice::size() {
   return end_index - start_index;
 }
 
-Text::iterator TextSlice::end() {
-  return text->begin() + end_index;
+const uint16_t *TextSlice::end() {
+  return text.begin() + end_index;
 }
 
 Text TextSlice::concat(TextSlice a, TextSlice b) {
@@ -63,15 +87,18 @@ Text TextSlice::concat(TextSlice a, TextSlice b, TextSlice c) {
 }
 
 TextSlice::operator Text() const {
-  return Text(text->begin() + start_index, text->begin() + end_index);
+  return Text(text.begin() + start_index, text.begin() + end_index);
 }
 
 std::pair<TextSlice, TextSlice> TextSlice::split(Point position) {
   size_t index = character_index_for_position(position);
-  return {
+  std::pair<TextSlice, TextSlice> result{
     TextSlice{text, start_index, start_index + index},
     TextSlice{text, start_index + index, end_index}
   };
+  result.first.line_starts = result.second.line_starts = line_starts;
+  result.first.line_start_count = result.second.line_start_count = line_start_count;
+  return result;
 }
 
 TextSlice TextSlice::suffix(Point suffix_start) {
@@ -83,27 +110,87 @@ TextSlice TextSlice::prefix(Point prefix_end) {
 }
 
 size_t TextSlice::character_index_for_position(Point target) {
-  Point position;
-  auto begin = text->begin() + start_index;
-  auto end = text->begin() + end_index;
-  auto iter = begin;
-  while (iter != end && position < target) {
-    if (*iter == '\n') {
-      position.row++;
-      position.column = 0;
-    } else {
-      position.column++;
+  if (line_starts) {
+    const uint32_t *line_starts_end = line_starts + line_start_count;
+
+    // Find where the target row starts, and where the newline ending it is.
+    const uint32_t *next_line_start = std::upper_bound(line_starts, line_starts_end, start_index);
+    size_t line_start = start_index;
+    if (target.row > 0) {
+      if (target.row > static_cast<size_t>(line_starts_end - next_line_start)) {
+        return size();
+      }
+      next_line_start += target.row - 1;
+      line_start = *next_line_start++;
+      if (line_start > end_index) return size();
     }
-    ++iter;
+
+    // A column past the end of the row maps to the start of the next one.
+    if (next_line_start != line_starts_end && *next_line_start <= end_index) {
+      size_t newline_index = *next_line_start - 1;
+      if (target.column <= newline_index - line_start) return line_start + target.column - start_index;
+      return newline_index + 1 - start_index;
+    }
+    return std::min<size_t>(line_start + target.column, end_index) - start_index;
+  }
+
+  const uint16_t *begin = text.begin() + start_index;
+  const uint16_t *end = text.begin() + end_index;
+  const uint16_t *line_start = begin;
+  if (target.row > 0) {
+    const uint16_t *newline = find_newline(begin, end, target.row);
+    if (newline == end) return size();
+    line_start = newline + 1;
   }
 
-  return iter - begin;
+  // A column past the end of the row maps to the start of the next one.
+  const uint16_t *line_end = line_start + std::min<size_t>(target.column, end - line_start);
+  const uint16_t *newline = find_newline(line_start, line_end);
+  if (newline != line_end) return newline + 1 - begin;
+  return line_end - begin;
+}
+
+Point TextSlice::extent() {
+  const uint16_t *begin = text.begin() + start_index;
+  const uint16_t *end = text.begin() + end_index;
+  const uint16_t *last_newline = find_last_newline(begin, end);
+  if (last_newline == end) return Point(0, size());
+  return Point(count_newlines(begin, last_newline) + 1, end - last_newline - 1);
+}
+
+vector<uint32_t> TextSlice::get_line_starts(TextView text) {
+  vector<uint32_t> result;
+  TextSlice(text).append_line_starts(&result, 0);
+  return result;
+}
+
+void TextSlice::append_line_starts(vector<uint32_t> *result, size_t offset) {
+  if (line_starts) {
+    const uint32_t *line_starts_end = line_starts + line_start_count;
+    const uint32_t *begin = std::upper_bound(line_starts, line_starts_end, start_index);
+    const uint32_t *end = std::upper_bound(begin, line_starts_end, end_index);
+    for (const uint32_t *line_start = begin; line_start != end; ++line_start) {
+      result->push_back(*line_start - start_index + offset);
+    }
+    return;
+  }
+
+  const uint16_t *begin = text.begin() + start_index;
+  const uint16_t *end = text.begin() + end_index;
+  for (const uint16_t *newline = find_newline(begin, end); newline != end;
+       newline = find_newline(newline + 1, end)) {
+    result->push_back(newline + 1 - begin + offset);
+  }
 }
 
 ostream &operator<<(ostream &stream, const Text *text) {
+  return stream << TextView(text);
+}
+
+ostream &operator<<(ostream &stream, TextView text) {
   if (text) {
     stream << "'";
-    for (uint16_t character : *text) {
+    for (uint16_t character : text) {
       if (character < CHAR_MAX) {
         stream << (char)character;
       } else {
@@ -1,6 +1,8 @@
 #ifndef TEXT_H_
 #define TEXT_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include <ostream>
@@ -13,28 +15,68 @@ struct Text : public std::vector<uint16_t> {
   Text(std::vector<uint16_t> && vec) : vector(std::move(vec)) {}
 };
 
+// A read-only reference to UTF-16 code units stored elsewhere, such as in a
+// Text or in a serialized patch. A default-constructed view represents the
+// absence of text, which is distinct from an empty text.
+class TextView {
+  const uint16_t *characters;
+  size_t length;
+  bool is_present;
+
+public:
+  TextView() : characters{nullptr}, length{0}, is_present{false} {}
+  TextView(std::nullptr_t) : TextView() {}
+  TextView(const Text *text);
+  TextView(const uint16_t *characters, size_t length)
+    : characters{characters}, length{length}, is_present{true} {}
+  operator Text() const;
+
+  explicit operator bool() const { return is_present; }
+  bool operator==(const TextView &other) const;
+  bool operator!=(const TextView &other) const { return !(*this == other); }
+
+  const uint16_t *data() const { return characters; }
+  size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+  const uint16_t *begin() const { return characters; }
+  const uint16_t *end() const { return characters + length; }
+};
+
 struct TextSlice {
-  Text *text;
+  TextView text;
   size_t start_index;
   size_t end_index;
 
+  // Optionally, the index at which each line of `text` after the first one
+  // starts, which turns mapping positions to indices into a binary search.
+  const uint32_t *line_starts;
+  size_t line_start_count;
+
   static Text concat(TextSlice a, TextSlice b);
   static Text concat(TextSlice a, TextSlice b, TextSlice c);
+  static std::vector<uint32_t> get_line_starts(TextView text);
 
-  TextSlice(Text &text);
-  TextSlice(Text *text, size_t start_index, size_t end_index);
+  TextSlice(const Text &text);
+  TextSlice(TextView text);
+  TextSlice(TextView text, const std::vector<uint32_t> &line_starts);
+  TextSlice(TextView text, size_t start_index, size_t end_index);
   operator Text() const;
 
   size_t size();
-  Text::iterator begin();
-  Text::iterator end();
+  const uint16_t *begin();
+  const uint16_t *end();
 
   std::pair<TextSlice, TextSlice> split(Point);
   TextSlice prefix(Point);
   TextSlice suffix(Point);
   size_t character_index_for_position(Point);
+  Point extent();
+  // Appends the line starts within this slice to `line_starts`, as indices
+  // into a text in which the slice starts at `offset`.
+  void append_line_starts(std::vector<uint32_t> *line_starts, size_t offset);
 };
 
 std::ostream &operator<<(std::ostream &stream, const Text *text);
+std::ostream &operator<<(std::ostream &stream, TextView text);
 
 #endif  // TEXT_H_
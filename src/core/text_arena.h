@@ -0,0 +1,93 @@
+#ifndef SUPERSTRING_TEXT_ARENA_H
+#define SUPERSTRING_TEXT_ARENA_H
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "text.h"
+
+// Stores texts back to back in a growing list of fixed-size chunks, so that
+// many small texts don't each need their own allocation. Chunks never move,
+// so the views it hands out stay valid until the arena is cleared or
+// destroyed. Texts are never freed individually. Instead, their owner copies
+// the texts it still uses into a fresh arena and discards the old one.
+class TextArena {
+  std::vector<std::unique_ptr<uint16_t[]>> chunks;
+  uint16_t *current_chunk;
+  size_t current_chunk_size;
+  size_t total_size;
+  size_t total_capacity;
+
+  enum : size_t { chunk_capacity = 16 * 1024 };
+
+public:
+  TextArena()
+      : current_chunk{nullptr}, current_chunk_size{chunk_capacity},
+        total_size{0}, total_capacity{0} {}
+
+  TextArena(const TextArena &) = delete;
+  TextArena &operator=(const TextArena &) = delete;
+
+  // Returns space for `length` code units that stays valid as long as the
+  // arena. Long texts get a chunk of their own, rather than leaving the rest
+  // of the current chunk unused. Empty texts share a static buffer, as a fresh
+  // arena has no current chunk to point into.
+  uint16_t *allocate(size_t length) {
+    static uint16_t empty_text[1];
+    if (length == 0) return empty_text;
+
+    total_size += length;
+    if (length > chunk_capacity / 4) {
+      chunks.emplace_back(new uint16_t[length]);
+      total_capacity += length;
+      return chunks.back().get();
+    }
+
+    if (current_chunk_size + length > chunk_capacity) {
+      chunks.emplace_back(new uint16_t[chunk_capacity]);
+      current_chunk = chunks.back().get();
+      current_chunk_size = 0;
+      total_capacity += chunk_capacity;
+    }
+
+    uint16_t *result = current_chunk + current_chunk_size;
+    current_chunk_size += length;
+    return result;
+  }
+
+  TextView store(TextView text) {
+    if (!text) return TextView();
+    uint16_t *characters = allocate(text.size());
+    std::copy(text.begin(), text.end(), characters);
+    return TextView{characters, text.size()};
+  }
+
+  TextView store(TextSlice a, TextSlice b, TextSlice c) {
+    uint16_t *characters = allocate(a.size() + b.size() + c.size());
+    uint16_t *end = std::copy(a.begin(), a.end(), characters);
+    end = std::copy(b.begin(), b.end(), end);
+    end = std::copy(c.begin(), c.end(), end);
+    return TextView{characters, static_cast<size_t>(end - characters)};
+  }
+
+  // Takes over another arena's chunks, keeping the views it handed out valid
+  // as long as this arena.
+  void absorb(TextArena &&other) {
+    for (auto &chunk : other.chunks) chunks.push_back(std::move(chunk));
+    total_size += other.total_size;
+    total_capacity += other.total_capacity;
+    other.chunks.clear();
+    other.current_chunk = nullptr;
+    other.current_chunk_size = chunk_capacity;
+    other.total_size = 0;
+    other.total_capacity = 0;
+  }
+
+  // The number of code units stored so far, including texts that are no
+  // longer in use.
+  size_t size() const { return total_size; }
+
+  size_t capacity() const { return total_capacity; }
+};
+
+#endif // SUPERSTRING_TEXT_ARENA_H
@@ -37,4 +37,15 @@ describe('BufferOffsetIndex', () => {
       }
     }
   })
+
+  it('reports its memory usage', () => {
+    const bufferIndex = new BufferOffsetIndex()
+    assert.equal(bufferIndex.getMemoryUsage().nodes, 0)
+
+    bufferIndex.splice(0, 0, [10, 20, 30])
+    const threeLineUsage = bufferIndex.getMemoryUsage().nodes
+    assert(threeLineUsage > 0)
+    bufferIndex.splice(3, 0, [10, 20, 30])
+    assert.equal(bufferIndex.getMemoryUsage().nodes, threeLineUsage * 2)
+  })
 })
@@ -438,6 +438,20 @@ describe('MarkerIndex', () => {
     assert.equal(index.compare(4, 1), -1)
   })
 
+  it('reports its memory usage', () => {
+    let index = new MarkerIndex()
+    assert.equal(index.getMemoryUsage().nodes, 0)
+    assert.equal(index.getMemoryUsage().markerIdSets, 0)
+
+    index.insert(1, {row: 1, column: 2}, {row: 3, column: 4})
+    index.insert(2, {row: 2, column: 2}, {row: 3, column: 4})
+    const usage = index.getMemoryUsage()
+    assert.isAbove(usage.nodes, 0)
+    assert.isAbove(usage.markerIdSets, 0)
+    assert.isAbove(usage.idMaps, 0)
+    assert.isAbove(usage.caches, 0)
+  })
+
   it('handles range queries involving Infinity', () => {
     let index = new MarkerIndex()
     index.insert(1, {row: 10, column: 10}, {row: 20, column: 20})
@@ -34,6 +34,24 @@ describe('Patch', function () {
     patch.delete();
   })
 
+  it('records the same hunks with the btree backend', function () {
+    const patch = new Patch({backend: 'btree'})
+    const expectedPatch = new Patch()
+    for (const [start, deletionExtent, insertionExtent] of [
+      [{row: 0, column: 5}, {row: 0, column: 3}, {row: 0, column: 4}],
+      [{row: 3, column: 2}, {row: 1, column: 0}, {row: 0, column: 2}],
+      [{row: 0, column: 7}, {row: 0, column: 3}, {row: 1, column: 1}]
+    ]) {
+      patch.splice(start, deletionExtent, insertionExtent)
+      expectedPatch.splice(start, deletionExtent, insertionExtent)
+    }
+    assert.deepEqual(JSON.parse(JSON.stringify(patch.getHunks())), JSON.parse(JSON.stringify(expectedPatch.getHunks())))
+    assert.deepEqual(patch.getChangeStatistics(), expectedPatch.getChangeStatistics())
+
+    patch.delete()
+    expectedPatch.delete()
+  })
+
   it('honors the mergeAdjacentHunks option set to true', function () {
     const patch = new Patch({ mergeAdjacentHunks: true })
 
@@ -175,6 +193,153 @@ describe('Patch', function () {
     patch2.delete();
   })
 
+  it('applies itself to a text in either direction', () => {
+    const patch = new Patch()
+    patch.splice({row: 0, column: 5}, {row: 0, column: 3}, {row: 0, column: 4}, 'abc', '1234')
+    patch.splice({row: 0, column: 7}, {row: 0, column: 3}, {row: 0, column: 4}, '34d', '5678')
+    assert.equal(patch.apply('01234abcd\nefg'), '01234125678\nefg')
+    assert.equal(patch.applyInverse('01234125678\nefg'), '01234abcd\nefg')
+    assert.equal(patch.apply('01234xbcd'), undefined)
+    assert.equal(patch.apply('0123'), undefined)
+
+    patch.delete();
+  })
+
+  it('coalesces hunks closer together than a given distance', () => {
+    const patch = new Patch()
+    patch.splice({row: 0, column: 1}, {row: 0, column: 1}, {row: 0, column: 1}, 'b', 'B')
+    patch.splice({row: 0, column: 4}, {row: 0, column: 1}, {row: 0, column: 2}, 'e', 'EE')
+    patch.splice({row: 1, column: 0}, {row: 0, column: 1}, {row: 0, column: 0}, 'g', '')
+
+    const patchWithoutText = patch.copy()
+    patch.coalesce({row: 0, column: 5}, 'aBcdEEf\n')
+    patchWithoutText.coalesce({row: 0, column: 5})
+    assert.deepEqual(JSON.parse(JSON.stringify(patch.getHunks())), [
+      {
+        oldStart: {row: 0, column: 1}, oldEnd: {row: 0, column: 5}, oldText: 'bcde',
+        newStart: {row: 0, column: 1}, newEnd: {row: 0, column: 6}, newText: 'BcdEE'
+      },
+      {
+        oldStart: {row: 1, column: 0}, oldEnd: {row: 1, column: 1}, oldText: 'g',
+        newStart: {row: 1, column: 0}, newEnd: {row: 1, column: 0}, newText: ''
+      }
+    ])
+    assert.equal(patchWithoutText.getHunks()[0].newText, undefined)
+    assert.throws(() => patch.coalesce({row: 2, column: 0}, 'aBc'))
+
+    patch.delete();
+    patchWithoutText.delete();
+  })
+
+  it('splits at a position and concatenates patches back together', () => {
+    const patch = new Patch()
+    patch.splice({row: 0, column: 1}, {row: 0, column: 1}, {row: 1, column: 0}, 'b', '\n')
+    patch.splice({row: 1, column: 2}, {row: 0, column: 1}, {row: 0, column: 2}, 'd', 'DD')
+    const hunks = JSON.parse(JSON.stringify(patch.getHunks()))
+
+    const tail = patch.splitAtNewPosition({row: 1, column: 0})
+    assert.deepEqual(JSON.parse(JSON.stringify(patch.getHunks())), hunks.slice(0, 1))
+    assert.deepEqual(JSON.parse(JSON.stringify(tail.getHunks())), hunks.slice(1))
+
+    const joinedPatch = Patch.concat(patch, tail)
+    assert.deepEqual(JSON.parse(JSON.stringify(joinedPatch.getHunks())), hunks)
+    assert.equal(patch.getHunkCount(), 0)
+    assert.equal(tail.getHunkCount(), 0)
+
+    const overlappingPatch = joinedPatch.copy()
+    assert.equal(Patch.concat(joinedPatch, overlappingPatch), undefined)
+
+    patch.delete();
+    tail.delete();
+    joinedPatch.delete();
+    overlappingPatch.delete();
+  })
+
+  it('translates batches of positions', () => {
+    const patch = new Patch()
+    patch.splice({row: 0, column: 2}, {row: 0, column: 2}, {row: 1, column: 1})
+
+    const positions = new Uint32Array([0, 1, 0, 3, 0, 4, 0, 6])
+    assert.deepEqual(Array.from(patch.translateOldPositions(positions)), [0, 1, 0, 2, 1, 1, 1, 3])
+    assert.deepEqual(Array.from(patch.translateOldPositions(positions, 'forward')), [0, 1, 1, 1, 1, 1, 1, 3])
+    assert.deepEqual(
+      Array.from(patch.translateNewPositions(new Uint32Array([0, 3, 1, 2]), 'backward')),
+      [0, 2, 0, 5]
+    )
+
+    patch.delete();
+  })
+
+  it('sums up the hunks in a range without retrieving them', () => {
+    const patch = new Patch()
+    patch.splice({row: 0, column: 1}, {row: 0, column: 1}, {row: 1, column: 1}, 'b', '\nB')
+    patch.splice({row: 1, column: 3}, {row: 1, column: 1}, {row: 0, column: 2}, 'd\ne', 'DE')
+    patch.splice({row: 3, column: 0}, {row: 0, column: 0}, {row: 0, column: 1}, '', 'F')
+
+    assert.deepEqual(patch.getChangeStatistics(), {
+      hunkCount: 3, oldTextSize: 4, newTextSize: 5, oldChangedRowCount: 3, newChangedRowCount: 3
+    })
+    assert.deepEqual(patch.getChangeStatisticsInNewRange({row: 0, column: 0}, {row: 2, column: 0}), {
+      hunkCount: 2, oldTextSize: 4, newTextSize: 4, oldChangedRowCount: 2, newChangedRowCount: 2
+    })
+    assert.deepEqual(patch.getChangeStatisticsInOldRange({row: 0, column: 2}, {row: 4, column: 0}), {
+      hunkCount: 2, oldTextSize: 3, newTextSize: 3, oldChangedRowCount: 3, newChangedRowCount: 2
+    })
+
+    patch.delete();
+  })
+
+  it('transforms a patch to apply after a concurrent one', () => {
+    const a = new Patch()
+    a.splice({row: 0, column: 1}, {row: 0, column: 1}, {row: 0, column: 2}, 'b', 'XX')
+    const b = new Patch()
+    b.splice({row: 0, column: 0}, {row: 0, column: 3}, {row: 0, column: 1}, 'abc', 'Y')
+    b.splice({row: 0, column: 3}, {row: 0, column: 0}, {row: 0, column: 1}, '', 'Z')
+
+    const transformedB = Patch.transform(a, b)
+    assert.deepEqual(JSON.parse(JSON.stringify(transformedB.getHunks())), [
+      {
+        oldStart: {row: 0, column: 0}, oldEnd: {row: 0, column: 1}, oldText: 'a',
+        newStart: {row: 0, column: 0}, newEnd: {row: 0, column: 1}, newText: 'Y'
+      },
+      {
+        oldStart: {row: 0, column: 3}, oldEnd: {row: 0, column: 4}, oldText: 'c',
+        newStart: {row: 0, column: 3}, newEnd: {row: 0, column: 3}, newText: ''
+      },
+      {
+        oldStart: {row: 0, column: 6}, oldEnd: {row: 0, column: 6}, oldText: '',
+        newStart: {row: 0, column: 5}, newEnd: {row: 0, column: 6}, newText: 'Z'
+      }
+    ])
+    assert.equal(transformedB.apply(a.apply('abcdef')), 'YXXdeZf')
+
+    // Where both insert at the same position, the two sites converge if they
+    // agree on whose text comes first.
+    a.splice({row: 0, column: 6}, {row: 0, column: 0}, {row: 0, column: 1}, '', 'P')
+    const transformedA = Patch.transform(b, a, 'b-first')
+    const rebasedB = Patch.transform(a, b, 'a-first')
+    assert.equal(transformedA.apply(b.apply('abcdef')), 'YXXdePZf')
+    assert.equal(rebasedB.apply(a.apply('abcdef')), 'YXXdePZf')
+
+    a.delete();
+    b.delete();
+    transformedB.delete();
+    transformedA.delete();
+    rebasedB.delete();
+  })
+
+  it('reports its memory usage', () => {
+    const patch = new Patch()
+    assert.deepEqual(patch.getMemoryUsage(), {nodes: 0, text: 0, caches: 0})
+
+    patch.splice({row: 0, column: 3}, {row: 0, column: 5}, {row: 0, column: 5}, 'hello', 'world')
+    const usage = patch.getMemoryUsage()
+    assert.isAbove(usage.nodes, 0)
+    assert.isAtLeast(usage.text, 'helloworld'.length * 2)
+
+    patch.delete();
+  })
+
   it('removes a hunk when it becomes empty', () => {
     const patch = new Patch()
     patch.splice({row: 1, column: 0}, {row: 0, column: 0}, {row: 0, column: 5})
@@ -1,6 +1,9 @@
 #include "test-helpers.h"
+#include "newline-scan.h"
+#include "text-diff.h"
 
 typedef Patch::Hunk Hunk;
+using std::unique_ptr;
 
 TEST_CASE("Records simple non-overlapping splices") {
   Patch patch;
@@ -217,3 +220,1442 @@ TEST_CASE("Serializes and deserializes") {
 
   REQUIRE(patch_copy.splice(Point{0, 1}, Point{0, 1}, Point{0, 2}, nullptr, nullptr) == false);
 }
+
+TEST_CASE("Copies and inverts patches independently of the original") {
+  Patch *patch = new Patch();
+  patch->splice(Point{0, 5}, Point{0, 3}, Point{0, 4}, GetText("abc"), GetText("1234"));
+  patch->splice(Point{1, 0}, Point{0, 0}, Point{0, 2}, GetText(""), GetText("xy"));
+  patch->splice(Point{0, 1}, Point{0, 1}, Point{0, 0}, GetText("q"), GetText(""));
+
+  Patch patch_copy = patch->copy();
+  Patch inverted_patch = patch->invert();
+  delete patch;
+
+  REQUIRE(patch_copy.get_hunk_count() == 3);
+  REQUIRE(patch_copy.get_hunks() == vector<Hunk>({
+    Hunk{
+      Point{0, 1}, Point{0, 2},
+      Point{0, 1}, Point{0, 1},
+      GetText("q").get(),
+      GetText("").get()
+    },
+    Hunk{
+      Point{0, 5}, Point{0, 8},
+      Point{0, 4}, Point{0, 8},
+      GetText("abc").get(),
+      GetText("1234").get()
+    },
+    Hunk{
+      Point{1, 0}, Point{1, 0},
+      Point{1, 0}, Point{1, 2},
+      GetText("").get(),
+      GetText("xy").get()
+    }
+  }));
+
+  REQUIRE(inverted_patch.get_hunks() == vector<Hunk>({
+    Hunk{
+      Point{0, 1}, Point{0, 1},
+      Point{0, 1}, Point{0, 2},
+      GetText("").get(),
+      GetText("q").get()
+    },
+    Hunk{
+      Point{0, 4}, Point{0, 8},
+      Point{0, 5}, Point{0, 8},
+      GetText("1234").get(),
+      GetText("abc").get()
+    },
+    Hunk{
+      Point{1, 0}, Point{1, 2},
+      Point{1, 0}, Point{1, 0},
+      GetText("xy").get(),
+      GetText("").get()
+    }
+  }));
+
+  patch_copy.splice(Point{0, 0}, Point{0, 9}, Point{0, 0}, GetText("xyzw1234v"), GetText(""));
+  REQUIRE(patch_copy.get_hunk_count() == 2);
+}
+
+TEST_CASE("Shares hunk texts between copies until one of them modifies them") {
+  Patch patch;
+  patch.splice(Point{0, 2}, Point{0, 1}, Point{0, 2}, GetText("a"), GetText("bc"));
+  patch.splice(Point{0, 6}, Point{0, 1}, Point{0, 1}, GetText("d"), GetText("e"));
+
+  Patch patch_copy = patch.copy();
+  Patch inverted_patch = patch.invert();
+  REQUIRE(patch_copy.get_hunks()[0].old_text.data() == patch.get_hunks()[0].old_text.data());
+  REQUIRE(patch_copy.get_hunks()[1].new_text.data() == patch.get_hunks()[1].new_text.data());
+  REQUIRE(inverted_patch.get_hunks()[0].new_text.data() == patch.get_hunks()[0].old_text.data());
+  REQUIRE(inverted_patch.get_hunks()[1].old_text.data() == patch.get_hunks()[1].new_text.data());
+
+  // Removing the unchanged text between the hunks merges them, which appends
+  // to the texts of the first one.
+  patch_copy.splice_old(Point{0, 3}, Point{0, 2}, Point{0, 0});
+  REQUIRE(patch_copy.get_hunks() == vector<Hunk>({
+    Hunk{
+      Point{0, 2}, Point{0, 4},
+      Point{0, 2}, Point{0, 5},
+      GetText("ad").get(),
+      GetText("bce").get()
+    }
+  }));
+  REQUIRE(patch.get_hunks() == vector<Hunk>({
+    Hunk{
+      Point{0, 2}, Point{0, 3},
+      Point{0, 2}, Point{0, 4},
+      GetText("a").get(),
+      GetText("bc").get()
+    },
+    Hunk{
+      Point{0, 5}, Point{0, 6},
+      Point{0, 6}, Point{0, 7},
+      GetText("d").get(),
+      GetText("e").get()
+    }
+  }));
+  REQUIRE(inverted_patch.get_hunks()[0].new_text == TextView(GetText("a").get()));
+}
+
+TEST_CASE("Keeps hunk texts intact while compacting the text they are stored in") {
+  auto get_text = [](Point extent, char character) {
+    unique_ptr<Text> text{new Text()};
+    for (unsigned row = 0; row < extent.row; row++) text->insert(text->end(), {'a', '\n'});
+    text->insert(text->end(), extent.column, character);
+    return text;
+  };
+
+  // The inversion shares the first patch's text, so compacting it moves the
+  // first patch's texts into an arena of its own while the inversion keeps
+  // viewing the original one.
+  Patch patch, compacted_patch;
+  patch.splice(Point{0, 0}, Point{0, 1}, Point{0, 1}, get_text(Point{0, 1}, 'a'), get_text(Point{0, 1}, 'b'));
+  compacted_patch.splice(Point{0, 0}, Point{0, 1}, Point{0, 1}, get_text(Point{0, 1}, 'a'), get_text(Point{0, 1}, 'b'));
+  Patch inverted_patch = patch.invert();
+
+  srand(4);
+  for (unsigned i = 0; i < 3000; i++) {
+    Point start(rand() % 20, rand() % 20);
+    Point deletion_extent(rand() % 4 == 0 ? 1 : 0, rand() % 20), insertion_extent(rand() % 4 == 0 ? 1 : 0, rand() % 20);
+    char character = 'a' + rand() % 26;
+    if (rand() % 3 == 0) {
+      patch.splice_old(start, deletion_extent, insertion_extent);
+      compacted_patch.splice_old(start, deletion_extent, insertion_extent);
+    } else {
+      patch.splice(start, deletion_extent, insertion_extent,
+                   get_text(deletion_extent, character), get_text(insertion_extent, character));
+      compacted_patch.splice(start, deletion_extent, insertion_extent,
+                             get_text(deletion_extent, character), get_text(insertion_extent, character));
+    }
+    REQUIRE(compacted_patch.get_hunks() == patch.get_hunks());
+  }
+
+  REQUIRE(inverted_patch.get_hunks()[0].old_text == TextView(GetText("b").get()));
+}
+
+TEST_CASE("Keeps copies intact while splicing the patch they were copied from") {
+  struct Edit {
+    unsigned kind;
+    Point start, deletion_extent, insertion_extent;
+  };
+
+  auto get_text = [](Point extent) {
+    unique_ptr<Text> text{new Text()};
+    for (unsigned row = 0; row < extent.row; row++) text->insert(text->end(), {'a', '\n'});
+    text->insert(text->end(), extent.column, 'b');
+    return text;
+  };
+
+  auto get_random_edit = []() {
+    Edit edit{static_cast<unsigned>(rand() % 8), Point(rand() % 6, rand() % 10),
+              Point(rand() % 4 == 0 ? 1 : 0, rand() % 3), Point(rand() % 4 == 0 ? 1 : 0, rand() % 3)};
+    return edit;
+  };
+
+  auto apply_edit = [&get_text](Patch &patch, const Edit &edit) {
+    if (edit.kind == 0) {
+      patch.splice_old(edit.start, edit.deletion_extent, edit.insertion_extent);
+    } else if (edit.kind == 1) {
+      patch.rebalance();
+    } else {
+      patch.splice(edit.start, edit.deletion_extent, edit.insertion_extent,
+                   get_text(edit.deletion_extent), get_text(edit.insertion_extent));
+    }
+  };
+
+  struct Snapshot {
+    Patch patch;
+    size_t edit_count;
+    vector<Edit> branch_edits;
+  };
+
+  srand(3);
+  for (unsigned trial = 0; trial < 100; trial++) {
+    Patch patch(trial % 2 == 0);
+    vector<Edit> edits;
+    vector<unique_ptr<Snapshot>> snapshots;
+    for (unsigned i = 0; i < 60; i++) {
+      if (i % 5 == 0) snapshots.emplace_back(new Snapshot{patch.copy(), edits.size(), {}});
+
+      // Edit some of the snapshots too, so that both versions of a shared
+      // node get copied.
+      if (!snapshots.empty() && rand() % 4 == 0) {
+        Snapshot &snapshot = *snapshots[rand() % snapshots.size()];
+        snapshot.branch_edits.push_back(get_random_edit());
+        apply_edit(snapshot.patch, snapshot.branch_edits.back());
+      }
+
+      // Discard a snapshot now and then, leaving its nodes to the others.
+      if (!snapshots.empty() && rand() % 10 == 0) snapshots.erase(snapshots.begin() + rand() % snapshots.size());
+
+      edits.push_back(get_random_edit());
+      apply_edit(patch, edits.back());
+    }
+    snapshots.emplace_back(new Snapshot{std::move(patch), edits.size(), {}});
+
+    for (const unique_ptr<Snapshot> &snapshot : snapshots) {
+      Patch expected_patch(trial % 2 == 0);
+      for (size_t i = 0; i < snapshot->edit_count; i++) apply_edit(expected_patch, edits[i]);
+      for (const Edit &edit : snapshot->branch_edits) apply_edit(expected_patch, edit);
+      REQUIRE(snapshot->patch.get_hunks() == expected_patch.get_hunks());
+      REQUIRE(snapshot->patch.get_hunk_count() == expected_patch.get_hunk_count());
+    }
+  }
+}
+
+TEST_CASE("Compacts hunk texts while copies of the patch share them") {
+  for (Patch::Backend backend : {Patch::Backend::SplayTree, Patch::Backend::BTree}) {
+    // Typing into a single hunk stores its whole text again on every
+    // keystroke, so the arena only stays small if it keeps being compacted
+    // while the snapshots hold on to the texts they were taken with.
+    Patch patch(true, backend);
+    vector<Patch> snapshots;
+    vector<Text> snapshot_texts;
+    Text typed_text;
+    snapshots.push_back(patch.copy());
+    snapshot_texts.push_back(typed_text);
+    for (unsigned i = 0; i < 20000; i++) {
+      uint16_t character = 'a' + i % 26;
+      patch.splice(Point(0, i), Point(), Point(0, 1), unique_ptr<Text>{new Text()},
+                   unique_ptr<Text>{new Text{character}});
+      typed_text.push_back(character);
+      if (i % 1000 == 999) {
+        snapshots.push_back(patch.copy());
+        snapshot_texts.push_back(typed_text);
+      }
+      REQUIRE(patch.get_memory_usage().text < 256 * 1024);
+    }
+
+    REQUIRE(patch.get_hunks().size() == 1);
+    REQUIRE(Text(patch.get_hunks()[0].new_text) == typed_text);
+    for (size_t i = 1; i < snapshots.size(); i++) {
+      REQUIRE(snapshots[i].get_hunks().size() == 1);
+      REQUIRE(Text(snapshots[i].get_hunks()[0].new_text) == snapshot_texts[i]);
+    }
+    REQUIRE(snapshots[0].get_hunk_count() == 0);
+  }
+}
+
+TEST_CASE("Views a serialized patch without copying its text") {
+  Patch patch;
+  patch.splice(Point{0, 5}, Point{0, 3}, Point{0, 2}, GetText("abc"), unique_ptr<Text>(new Text{0x3b1, 0x3b2}));
+  patch.splice(Point{1, 0}, Point{0, 0}, Point{0, 1}, unique_ptr<Text>(new Text{}), unique_ptr<Text>(new Text{0x3b3}));
+
+  vector<uint8_t> serialization_vector;
+  patch.serialize(&serialization_vector);
+  const uint8_t *serialization_begin = serialization_vector.data();
+  const uint8_t *serialization_end = serialization_begin + serialization_vector.size();
+
+  Patch patch_view = Patch::view(serialization_vector.data(), serialization_vector.size());
+  auto hunks = patch_view.get_hunks();
+  REQUIRE(hunks == patch.get_hunks());
+
+  for (const Hunk &hunk : hunks) {
+    const uint8_t *new_text = reinterpret_cast<const uint8_t *>(hunk.new_text.data());
+    REQUIRE((new_text >= serialization_begin && new_text < serialization_end));
+  }
+
+  REQUIRE(patch_view.splice(Point{0, 1}, Point{0, 1}, Point{0, 2}, nullptr, nullptr) == false);
+
+  Patch patch_copy = patch_view.copy();
+  serialization_vector.assign(serialization_vector.size(), 0);
+  REQUIRE(patch_copy.get_hunks() == patch.get_hunks());
+}
+
+TEST_CASE("Deserializes patches serialized with version 1") {
+  vector<uint8_t> serialization_vector;
+  auto append_word = [&serialization_vector](uint32_t word) {
+    for (int i = 0; i < 4; i++) serialization_vector.push_back(word >> (8 * i));
+  };
+
+  append_word(1); // version
+  append_word(2); // hunk count
+
+  // Root: replaces 'abc' at (0, 5) with 'xy'
+  append_word(0); append_word(3); // old extent
+  append_word(0); append_word(2); // new extent
+  append_word(0); append_word(5); // old distance from left ancestor
+  append_word(0); append_word(5); // new distance from left ancestor
+  append_word(1); append_word(3); // old text
+  for (uint16_t character : {'a', 'b', 'c'}) {
+    serialization_vector.push_back(character);
+    serialization_vector.push_back(0);
+  }
+  append_word(1); append_word(2); // new text
+  for (uint16_t character : {'x', 'y'}) {
+    serialization_vector.push_back(character);
+    serialization_vector.push_back(0);
+  }
+
+  // Right child: inserts 'z' 2 columns after the root, without text
+  append_word(2);
+  append_word(0); append_word(0);
+  append_word(0); append_word(1);
+  append_word(0); append_word(2);
+  append_word(0); append_word(2);
+  append_word(0);
+  append_word(0);
+
+  append_word(3);
+
+  Patch patch(serialization_vector);
+  REQUIRE(patch.get_hunks() == vector<Hunk>({
+    Hunk{
+      Point{0, 5}, Point{0, 8},
+      Point{0, 5}, Point{0, 7},
+      GetText("abc").get(),
+      GetText("xy").get()
+    },
+    Hunk{
+      Point{0, 10}, Point{0, 10},
+      Point{0, 9}, Point{0, 10},
+      nullptr, nullptr
+    }
+  }));
+
+  vector<uint8_t> version_1_serialization_vector;
+  patch.serialize(&version_1_serialization_vector, 1);
+  REQUIRE(version_1_serialization_vector == serialization_vector);
+
+  // Corrupt hunk counts and text lengths are rejected or clamped to the
+  // buffer instead of being allocated for.
+  vector<uint8_t> corrupt_hunk_count = serialization_vector;
+  corrupt_hunk_count[4] = corrupt_hunk_count[5] = corrupt_hunk_count[6] = 0xff;
+  corrupt_hunk_count[7] = 0x0f;
+  REQUIRE(Patch(corrupt_hunk_count).get_hunk_count() == 0);
+  REQUIRE(Patch::view(corrupt_hunk_count.data(), corrupt_hunk_count.size()).get_hunk_count() == 0);
+
+  vector<uint8_t> corrupt_text_length = serialization_vector;
+  std::fill(corrupt_text_length.begin() + 44, corrupt_text_length.begin() + 48, 0xff);
+  REQUIRE(Patch(corrupt_text_length).get_hunk_count() == 0);
+  REQUIRE(Patch::view(corrupt_text_length.data(), corrupt_text_length.size()).get_hunk_count() == 0);
+}
+
+TEST_CASE("Serializes with a compact encoding") {
+  Patch patch;
+  for (unsigned i = 0; i < 100; i++) {
+    patch.splice(Point{i, 2}, Point{0, 1}, Point{0, 2}, GetText("a"), GetText("bc"));
+  }
+  patch.splice(Point{100, 0}, Point{0, 0}, Point{1, 1}, GetText(""), unique_ptr<Text>(new Text{0x3b1, '\n', 0x3b2}));
+  patch.splice(Point{200000, 70000}, Point{3, 5}, Point{0, 0}, nullptr, nullptr);
+  patch.rebalance();
+
+  vector<uint8_t> version_1_serialization_vector, version_2_serialization_vector;
+  patch.serialize(&version_1_serialization_vector, 1);
+  patch.serialize(&version_2_serialization_vector);
+  REQUIRE(version_2_serialization_vector.size() * 4 < version_1_serialization_vector.size());
+
+  REQUIRE(Patch(version_1_serialization_vector).get_hunks() == patch.get_hunks());
+  REQUIRE(Patch(version_2_serialization_vector).get_hunks() == patch.get_hunks());
+
+  version_2_serialization_vector.resize(version_2_serialization_vector.size() / 2);
+  REQUIRE(Patch(version_2_serialization_vector).get_hunk_count() == 0);
+}
+
+TEST_CASE("Streams serializations into a sink in bounded chunks") {
+  Patch patch;
+  for (unsigned i = 0; i < 20; i++) {
+    patch.splice(Point{i, 2}, Point{0, 1}, Point{0, 2}, GetText("a"), unique_ptr<Text>(new Text{0x3b1, 'b'}));
+  }
+
+  vector<uint8_t> serialization_vector;
+  patch.serialize(&serialization_vector);
+
+  uint8_t buffer[7];
+  vector<uint8_t> streamed_bytes;
+  size_t largest_chunk_size = 0;
+  Serializer serializer(buffer, sizeof(buffer), [&](const uint8_t *data, size_t size) {
+    streamed_bytes.insert(streamed_bytes.end(), data, data + size);
+    largest_chunk_size = std::max(largest_chunk_size, size);
+    return true;
+  });
+
+  REQUIRE(patch.serialize(serializer));
+  REQUIRE(largest_chunk_size == sizeof(buffer));
+  REQUIRE(streamed_bytes == serialization_vector);
+  REQUIRE(Patch::view(streamed_bytes.data(), streamed_bytes.size()).get_hunks() == patch.get_hunks());
+
+  size_t flush_count = 0;
+  Serializer failing_serializer(buffer, sizeof(buffer), [&](const uint8_t *, size_t) {
+    flush_count++;
+    return false;
+  });
+  REQUIRE(!patch.serialize(failing_serializer));
+  REQUIRE(flush_count == 1);
+}
+
+TEST_CASE("Answers queries without splaying through a const patch") {
+  srand(0);
+  Patch patch;
+  for (unsigned i = 0; i < 200; i++) {
+    Point start(rand() % 20, rand() % 20);
+    patch.splice(start, Point(0, rand() % 4), Point(rand() % 5 == 0 ? 1 : 0, rand() % 4),
+                 GetText("abc"), GetText("def"));
+  }
+
+  const Patch &const_patch = patch;
+  for (unsigned i = 0; i < 100; i++) {
+    Point start(rand() % 22, rand() % 22);
+    Point end = start.traverse(Point(rand() % 3, rand() % 10));
+
+    REQUIRE(const_patch.get_hunks_in_old_range(start, end) == patch.get_hunks_in_old_range(start, end));
+    REQUIRE(const_patch.get_hunks_in_new_range(start, end) == patch.get_hunks_in_new_range(start, end));
+    REQUIRE(const_patch.get_hunks_in_new_range(start, end, true) == patch.get_hunks_in_new_range(start, end, true));
+
+    optional<Hunk> const_hunk = const_patch.hunk_for_old_position(start);
+    optional<Hunk> hunk = patch.hunk_for_old_position(start);
+    REQUIRE(bool(const_hunk) == bool(hunk));
+    if (hunk) REQUIRE(*const_hunk == *hunk);
+
+    const_hunk = const_patch.hunk_for_new_position(start);
+    hunk = patch.hunk_for_new_position(start);
+    REQUIRE(bool(const_hunk) == bool(hunk));
+    if (hunk) REQUIRE(*const_hunk == *hunk);
+  }
+
+  REQUIRE(const_patch.get_hunks_in_old_range(Point(0, 0), Point(100, 0)) == patch.get_hunks());
+  REQUIRE(Patch().hunk_for_new_position(Point(0, 0)) == false);
+}
+
+TEST_CASE("Walks hunks lazily with a cursor") {
+  Patch patch;
+  for (unsigned i = 0; i < 10; i++) {
+    patch.splice(Point{i, 2}, Point{0, 1}, Point{0, 3}, GetText("a"), GetText("bcd"));
+  }
+
+  vector<Hunk> hunks = patch.get_hunks();
+  vector<Hunk> visited_hunks;
+  for (Patch::HunkCursor cursor = patch.get_hunk_cursor(); cursor; cursor.next()) {
+    visited_hunks.push_back(*cursor);
+  }
+  REQUIRE(visited_hunks == hunks);
+
+  Patch::HunkCursor cursor = patch.get_hunk_cursor();
+  cursor.seek_to_new_position(Point{4, 3});
+  REQUIRE(*cursor == hunks[4]);
+  cursor.next();
+  REQUIRE(*cursor == hunks[5]);
+
+  cursor.seek_to_old_position(Point{4, 1});
+  REQUIRE(*cursor == hunks[3]);
+
+  cursor.seek_to_old_position(Point{0, 0});
+  REQUIRE(*cursor == hunks[0]);
+
+  cursor.seek_to_old_position(Point{20, 0});
+  REQUIRE(cursor->old_start == Point(9, 2));
+  cursor.next();
+  REQUIRE(!cursor);
+
+  cursor.reset();
+  REQUIRE(*cursor == hunks[0]);
+
+  REQUIRE(!Patch().get_hunk_cursor());
+}
+
+TEST_CASE("Slices texts the same way with or without their line starts") {
+  srand(5);
+  for (unsigned trial = 0; trial < 200; trial++) {
+    Text text;
+    for (unsigned i = 0, length = rand() % 100; i < length; i++) {
+      text.push_back(rand() % 4 == 0 ? '\n' : 'a');
+    }
+    vector<uint32_t> line_starts = TextSlice::get_line_starts(TextView(&text));
+
+    size_t start_index = rand() % (text.size() + 1);
+    size_t end_index = start_index + rand() % (text.size() - start_index + 1);
+    TextSlice slice(TextView(&text), start_index, end_index);
+    TextSlice indexed_slice(TextView(&text), line_starts);
+    indexed_slice.start_index = start_index;
+    indexed_slice.end_index = end_index;
+
+    for (unsigned i = 0; i < 10; i++) {
+      Point position(rand() % 6, rand() % 6);
+      REQUIRE(indexed_slice.character_index_for_position(position) == slice.character_index_for_position(position));
+      REQUIRE(Text(indexed_slice.prefix(position)) == Text(slice.prefix(position)));
+    }
+
+    vector<uint32_t> slice_line_starts, indexed_slice_line_starts;
+    slice.append_line_starts(&slice_line_starts, 3);
+    indexed_slice.append_line_starts(&indexed_slice_line_starts, 3);
+    REQUIRE(indexed_slice_line_starts == slice_line_starts);
+  }
+}
+
+TEST_CASE("Scans for newlines the same way with each implementation") {
+  srand(7);
+  for (unsigned trial = 0; trial < 500; trial++) {
+    Text text;
+    unsigned newline_frequency = 1 + rand() % 40;
+    for (unsigned i = 0, length = rand() % 300; i < length; i++) {
+      text.push_back(rand() % newline_frequency == 0 ? '\n' : 'a' + rand() % 26);
+    }
+
+    // Vary the alignment and the length of the tail after the last full block.
+    const uint16_t *begin = text.data() + rand() % (text.size() + 1);
+    const uint16_t *end = begin + rand() % (text.data() + text.size() - begin + 1);
+
+    vector<const uint16_t *> newlines;
+    for (const uint16_t *iter = begin; iter != end; ++iter) {
+      if (*iter == '\n') newlines.push_back(iter);
+    }
+
+    for (const NewlineScanner &scanner : get_newline_scanners()) {
+      INFO(scanner.name);
+      REQUIRE(scanner.count_newlines(begin, end) == newlines.size());
+      REQUIRE(scanner.find_last_newline(begin, end) == (newlines.empty() ? end : newlines.back()));
+      REQUIRE(scanner.find_newline(begin, end, 0) == end);
+      for (size_t n = 1; n <= newlines.size() + 1; n++) {
+        REQUIRE(scanner.find_newline(begin, end, n) == (n <= newlines.size() ? newlines[n - 1] : end));
+      }
+    }
+
+    TextSlice slice(TextView(&text), begin - text.data(), end - text.data());
+    Point extent;
+    for (const uint16_t *iter = begin; iter != end; ++iter) {
+      extent = *iter == '\n' ? Point(extent.row + 1, 0) : Point(extent.row, extent.column + 1);
+    }
+    REQUIRE(slice.extent() == extent);
+  }
+}
+
+TEST_CASE("Splices repeatedly within a long hunk") {
+  Text document;
+  for (unsigned i = 0; i < 5000; i++) {
+    document.push_back(i % 40 == 39 ? '\n' : 'a' + i % 26);
+  }
+
+  Patch patch;
+  patch.splice(Point(), Point(), get_position(document, document.size()),
+               unique_ptr<Text>{new Text()}, unique_ptr<Text>{new Text(document)});
+
+  srand(6);
+  for (unsigned i = 0; i < 200; i++) {
+    size_t start_index = rand() % (document.size() + 1);
+    size_t end_index = std::min(document.size(), start_index + rand() % 50);
+    splice_document(patch, document, start_index, end_index, get_random_text(rand() % 50));
+
+    auto hunks = patch.get_hunks();
+    REQUIRE(hunks.size() == 1);
+    REQUIRE(hunks[0].new_text == TextView(&document));
+  }
+}
+
+TEST_CASE("Rebalances automatically once deep accesses add up") {
+  auto get_depth = [](const Patch &patch) {
+    std::string json = patch.get_json();
+    size_t depth = 0, max_depth = 0;
+    for (char character : json) {
+      if (character == '{') max_depth = std::max(max_depth, ++depth);
+      if (character == '}') depth--;
+    }
+    return max_depth - 1; // Points are nested objects too
+  };
+
+  Patch patch, unbalanced_patch;
+  unbalanced_patch.set_max_depth_factor(0);
+  for (unsigned i = 0; i < 1000; i++) {
+    patch.splice(Point(0, 2 * i), Point(), Point(0, 1));
+    unbalanced_patch.splice(Point(0, 2 * i), Point(), Point(0, 1));
+  }
+
+  // Typing sequentially leaves every earlier hunk on one long spine.
+  REQUIRE(get_depth(patch) == 1000);
+  REQUIRE(get_depth(unbalanced_patch) == 1000);
+
+  const Patch &const_patch = patch, &const_unbalanced_patch = unbalanced_patch;
+  REQUIRE((*const_patch.hunk_for_new_position(Point(0, 0))).new_start == Point(0, 0));
+  REQUIRE((*const_unbalanced_patch.hunk_for_new_position(Point(0, 0))).new_start == Point(0, 0));
+  REQUIRE(get_depth(patch) == 1000);
+
+  patch.splice(Point(0, 2000), Point(), Point(0, 1));
+  unbalanced_patch.splice(Point(0, 2000), Point(), Point(0, 1));
+  REQUIRE(get_depth(patch) < 20);
+  REQUIRE(get_depth(unbalanced_patch) == 1001);
+  REQUIRE(patch.get_hunks() == unbalanced_patch.get_hunks());
+}
+
+TEST_CASE("Reports the memory held by nodes and texts") {
+  Patch patch;
+  Patch::MemoryUsage empty_usage = patch.get_memory_usage();
+  REQUIRE(empty_usage.nodes == 0);
+  REQUIRE(empty_usage.text == 0);
+
+  size_t text_size = 0;
+  for (unsigned i = 0; i < 100; i++) {
+    unique_ptr<Text> deleted_text{new Text{0x3b1, 0x3b2, 0x3b3}};
+    unique_ptr<Text> inserted_text{new Text{0x3b4, 0x3b5, 0x3b6, 0x3b7, 0x3b8}};
+    text_size += (deleted_text->size() + inserted_text->size()) * sizeof(uint16_t);
+    patch.splice(Point(i, 0), Point(0, 3), Point(0, 5), move(deleted_text), move(inserted_text));
+  }
+
+  Patch::MemoryUsage usage = patch.get_memory_usage();
+  REQUIRE(usage.nodes >= 100 * sizeof(uint32_t));
+  REQUIRE(usage.text >= text_size);
+
+  // Copies share their nodes and texts with the original.
+  Patch copy = patch.copy();
+  REQUIRE(copy.get_memory_usage().nodes == usage.nodes);
+  REQUIRE(copy.get_memory_usage().text == usage.text);
+
+  // Views borrow their texts from the serialized buffer, unless those were
+  // encoded with one byte per code unit.
+  vector<uint8_t> serialization;
+  patch.serialize(&serialization);
+  Patch view = Patch::view(serialization.data(), serialization.size());
+  REQUIRE(view.get_memory_usage().nodes > 0);
+  REQUIRE(view.get_memory_usage().text == 0);
+}
+
+TEST_CASE("Splices sorted batches as if splicing from last to first") {
+  auto get_text = [](Point extent) {
+    unique_ptr<Text> text{new Text()};
+    for (unsigned row = 0; row < extent.row; row++) text->insert(text->end(), {'a', '\n'});
+    text->insert(text->end(), extent.column, 'b');
+    return text;
+  };
+
+  srand(1);
+  for (unsigned trial = 0; trial < 300; trial++) {
+    Patch patch(trial % 2 == 0);
+    for (unsigned i = 0; i < 10; i++) {
+      Point start(rand() % 5, rand() % 10);
+      Point deletion_extent(0, rand() % 3), insertion_extent(rand() % 4 == 0 ? 1 : 0, rand() % 3);
+      patch.splice(start, deletion_extent, insertion_extent, get_text(deletion_extent), get_text(insertion_extent));
+    }
+
+    vector<Patch::Splice> splices;
+    Point position;
+    for (unsigned i = 0; i < 8; i++) {
+      Point start = position.traverse(Point(rand() % 3 == 0 ? 1 : 0, rand() % 4));
+      Point deletion_extent(0, rand() % 3), insertion_extent(0, rand() % 3);
+      splices.push_back(Patch::Splice{start, deletion_extent, insertion_extent,
+                                      get_text(deletion_extent), get_text(insertion_extent)});
+      position = start.traverse(deletion_extent);
+    }
+
+    Patch sequentially_spliced_patch = patch.copy();
+    for (auto splice = splices.rbegin(); splice != splices.rend(); ++splice) {
+      sequentially_spliced_patch.splice(splice->start, splice->deletion_extent, splice->insertion_extent,
+                                        get_text(splice->deletion_extent), get_text(splice->insertion_extent));
+    }
+
+    REQUIRE(patch.splice_batch(move(splices)));
+    REQUIRE(patch.get_hunks() == sequentially_spliced_patch.get_hunks());
+    REQUIRE(patch.get_hunk_count() == sequentially_spliced_patch.get_hunk_count());
+  }
+
+  Patch patch;
+  vector<Patch::Splice> unsorted_splices;
+  unsorted_splices.push_back(Patch::Splice{Point(0, 5), Point(0, 2), Point(0, 1), nullptr, nullptr});
+  unsorted_splices.push_back(Patch::Splice{Point(0, 6), Point(0, 1), Point(0, 1), nullptr, nullptr});
+  REQUIRE(!patch.splice_batch(move(unsorted_splices)));
+}
+
+TEST_CASE("Composes patches as if splicing in each one's hunks from last to first") {
+  srand(2);
+  for (unsigned trial = 0; trial < 300; trial++) {
+    // Record each patch against a document, so that the old text of every
+    // patch agrees with the new text of the patches preceding it.
+    Text document;
+    for (unsigned i = 0, count = trial % 10 == 0 ? 400 : 16; i < count; i++) {
+      Text text = get_random_text(rand() % 4, 5);
+      document.insert(document.end(), text.begin(), text.end());
+    }
+
+    vector<Patch> patches;
+    unsigned patch_count = 1 + rand() % 8;
+    for (unsigned i = 0; i < patch_count; i++) {
+      patches.emplace_back(rand() % 2 == 0);
+      Patch &patch = patches.back();
+      bool has_text = trial % 2 == 0 || rand() % 4 != 0;
+      unsigned splice_count = trial % 10 == 0 && i == 0 ? 200 : 1 + rand() % 10;
+      for (unsigned j = 0; j < splice_count; j++) {
+        size_t start_index = rand() % (document.size() + 1);
+        size_t end_index = std::min(document.size(), start_index + rand() % 3);
+        splice_document(patch, document, start_index, end_index, get_random_text(rand() % 4, 5), has_text);
+      }
+    }
+
+    vector<const Patch *> patches_to_compose;
+    for (const Patch &patch : patches) patches_to_compose.push_back(&patch);
+
+    // Compose one of the patches through a view, so its texts are borrowed.
+    vector<uint8_t> serialization;
+    unsigned viewed_patch_index = rand() % patch_count;
+    patches[viewed_patch_index].serialize(&serialization);
+    Patch viewed_patch = Patch::view(serialization.data(), serialization.size());
+    patches_to_compose[viewed_patch_index] = &viewed_patch;
+
+    Patch expected_patch;
+    for (const Patch &patch : patches) {
+      auto hunks = patch.get_hunks();
+      for (auto hunk = hunks.rbegin(); hunk != hunks.rend(); ++hunk) {
+        expected_patch.splice(hunk->old_start, hunk->old_end.traversal(hunk->old_start),
+                              hunk->new_end.traversal(hunk->new_start),
+                              hunk->old_text ? unique_ptr<Text>{new Text(hunk->old_text)} : nullptr,
+                              hunk->new_text ? unique_ptr<Text>{new Text(hunk->new_text)} : nullptr);
+      }
+    }
+
+    Patch composed_patch(patches_to_compose);
+    REQUIRE(composed_patch.get_hunks() == expected_patch.get_hunks());
+    REQUIRE(composed_patch.get_hunk_count() == expected_patch.get_hunk_count());
+
+    Patch patch_composed_in_parallel(patches_to_compose, 1 + trial % 4);
+    REQUIRE(patch_composed_in_parallel.get_hunks() == expected_patch.get_hunks());
+    REQUIRE(patch_composed_in_parallel.get_hunk_count() == expected_patch.get_hunk_count());
+  }
+
+  // A braced list of patches picks the composing constructor.
+  Patch first, second, third;
+  first.splice(Point(0, 1), Point(0, 1), Point(0, 2));
+  second.splice(Point(0, 5), Point(0, 1), Point());
+  third.splice(Point(1, 0), Point(), Point(0, 3));
+  Patch composed_list({&first, &second, &third});
+  REQUIRE(composed_list.get_hunk_count() == 3);
+}
+
+TEST_CASE("Diffs texts by line or by character") {
+  unique_ptr<Text> old_text = GetText("abc\ndef\nghi\n"), new_text = GetText("abc\ndxf\nghi\njkl");
+  unique_ptr<Text> old_line = GetText("def\n"), new_line = GetText("dxf\n");
+  unique_ptr<Text> old_character = GetText("e"), new_character = GetText("x");
+  unique_ptr<Text> empty_text = GetText(""), last_line = GetText("jkl");
+
+  REQUIRE(text_diff(*old_text, *new_text, DiffGranularity::Lines).get_hunks() == vector<Hunk>({
+    Hunk{
+      Point{1, 0}, Point{2, 0},
+      Point{1, 0}, Point{2, 0},
+      old_line.get(), new_line.get()
+    },
+    Hunk{
+      Point{3, 0}, Point{3, 0},
+      Point{3, 0}, Point{3, 3},
+      empty_text.get(), last_line.get()
+    }
+  }));
+  REQUIRE(text_diff(*old_text, *new_text, DiffGranularity::Characters).get_hunks() == vector<Hunk>({
+    Hunk{
+      Point{1, 1}, Point{1, 2},
+      Point{1, 1}, Point{1, 2},
+      old_character.get(), new_character.get()
+    },
+    Hunk{
+      Point{3, 0}, Point{3, 0},
+      Point{3, 0}, Point{3, 3},
+      empty_text.get(), last_line.get()
+    }
+  }));
+  REQUIRE(text_diff(*old_text, *old_text).get_hunk_count() == 0);
+}
+
+TEST_CASE("Diffs random texts into hunks that turn one into the other") {
+  auto get_random_text = [](unsigned length) {
+    Text text;
+    for (unsigned i = 0; i < length; i++) text.push_back(rand() % 5 == 0 ? '\n' : 'a' + rand() % 3);
+    return text;
+  };
+
+  srand(8);
+  for (unsigned trial = 0; trial < 301; trial++) {
+    // The last trial diffs long unrelated texts, which exceeds the edit budget.
+    Text old_text = get_random_text(trial < 300 ? rand() % 200 : 40000);
+    Text new_text = trial < 300 ? old_text : get_random_text(40000);
+    for (unsigned i = 0, edit_count = rand() % 10; i < edit_count; i++) {
+      size_t start = rand() % (new_text.size() + 1);
+      size_t end = std::min(new_text.size(), start + rand() % 10);
+      Text inserted_text = get_random_text(rand() % 10);
+      new_text.erase(new_text.begin() + start, new_text.begin() + end);
+      new_text.insert(new_text.begin() + start, inserted_text.begin(), inserted_text.end());
+    }
+
+    for (DiffGranularity granularity : {DiffGranularity::Lines, DiffGranularity::Characters}) {
+      Patch patch = text_diff(old_text, new_text, granularity);
+
+      // Replay the hunks on the old text, checking that each one's old text is
+      // what it replaces.
+      Text result;
+      size_t old_index = 0;
+      TextSlice old_slice{TextView(&old_text)};
+      for (const Hunk &hunk : patch.get_hunks()) {
+        size_t hunk_start = old_slice.character_index_for_position(hunk.old_start);
+        size_t hunk_end = old_slice.character_index_for_position(hunk.old_end);
+        REQUIRE(Text(hunk.old_text) == Text(old_text.begin() + hunk_start, old_text.begin() + hunk_end));
+        if (granularity == DiffGranularity::Lines) {
+          REQUIRE(hunk.old_start.column == 0);
+          REQUIRE((hunk.old_end.column == 0 || hunk_end == old_text.size()));
+        }
+        result.insert(result.end(), old_text.begin() + old_index, old_text.begin() + hunk_start);
+        result.insert(result.end(), hunk.new_text.begin(), hunk.new_text.end());
+        old_index = hunk_end;
+      }
+      result.insert(result.end(), old_text.begin() + old_index, old_text.end());
+      REQUIRE(result == new_text);
+    }
+  }
+}
+
+TEST_CASE("Applies patches to texts in either direction") {
+  srand(9);
+  for (unsigned trial = 0; trial < 200; trial++) {
+    Text original_document = get_random_text(rand() % 100, 5);
+    Text document = original_document;
+    Patch patch;
+    for (unsigned i = 0, splice_count = rand() % 20; i < splice_count; i++) {
+      splice_randomly(patch, document, 5, 5, 5);
+    }
+
+    optional<Text> new_document = patch.apply(original_document);
+    REQUIRE(new_document);
+    REQUIRE(*new_document == document);
+    optional<Text> old_document = patch.apply_inverse(document);
+    REQUIRE(old_document);
+    REQUIRE(*old_document == original_document);
+  }
+
+  Patch patch;
+  patch.splice(Point{0, 1}, Point{1, 0}, Point{0, 2}, GetText("bc\n"), GetText("XY"));
+  REQUIRE(*patch.apply(*GetText("abc\nd")) == *GetText("aXYd"));
+  REQUIRE(*patch.apply_inverse(*GetText("aXYd")) == *GetText("abc\nd"));
+
+  // The hunk's old text differs from the text it covers.
+  REQUIRE(!patch.apply(*GetText("axy\nd")));
+  // The hunk lies past the end of the text, or past the end of a line.
+  REQUIRE(!patch.apply(*GetText("abc")));
+  REQUIRE(!patch.apply(*GetText("a\nbc\nd")));
+
+  Patch patch_without_text;
+  patch_without_text.splice(Point{0, 1}, Point{0, 1}, Point{0, 1});
+  REQUIRE(!patch_without_text.apply(*GetText("abc")));
+}
+
+TEST_CASE("Coalesces hunks closer together than a given distance") {
+  srand(10);
+  for (unsigned trial = 0; trial < 200; trial++) {
+    Text original_document = get_random_text(200);
+    Text document = original_document;
+    Patch patch(trial % 2 == 0);
+    for (unsigned i = 0, splice_count = rand() % 30; i < splice_count; i++) {
+      splice_randomly(patch, document);
+    }
+
+    Point max_distance(rand() % 2, rand() % 10);
+    Patch patch_without_text = patch.copy();
+    size_t hunk_count = patch.get_hunk_count();
+    REQUIRE(patch.coalesce(max_distance, document));
+    REQUIRE(patch_without_text.coalesce(max_distance));
+    REQUIRE(patch.get_hunk_count() <= hunk_count);
+    REQUIRE(patch_without_text.get_hunk_count() == patch.get_hunk_count());
+
+    auto hunks = patch.get_hunks();
+    for (size_t i = 1; i < hunks.size(); i++) {
+      REQUIRE(hunks[i].new_start.traversal(hunks[i - 1].new_end) >= max_distance);
+    }
+    REQUIRE(*patch.apply(original_document) == document);
+    REQUIRE(*patch.apply_inverse(document) == original_document);
+  }
+
+  Patch patch;
+  patch.splice(Point{0, 1}, Point{0, 1}, Point{0, 1}, GetText("b"), GetText("B"));
+  patch.splice(Point{0, 4}, Point{0, 1}, Point{0, 2}, GetText("e"), GetText("EE"));
+  patch.splice(Point{1, 0}, Point{0, 1}, Point{0, 0}, GetText("g"), GetText(""));
+  unique_ptr<Text> new_text = GetText("aBcdEEf\n");
+
+  REQUIRE(!patch.coalesce(Point{0, 5}, *GetText("aBc")));
+  REQUIRE(patch.get_hunk_count() == 3);
+
+  Patch patch_without_text = patch.copy();
+  REQUIRE(patch.coalesce(Point{0, 5}, *new_text));
+  REQUIRE(patch_without_text.coalesce(Point{0, 5}));
+  unique_ptr<Text> old_text = GetText("bcde"), merged_text = GetText("BcdEE");
+  unique_ptr<Text> deleted_text = GetText("g"), empty_text = GetText("");
+  REQUIRE(patch.get_hunks() == vector<Hunk>({
+    Hunk{Point{0, 1}, Point{0, 5}, Point{0, 1}, Point{0, 6}, old_text.get(), merged_text.get()},
+    Hunk{Point{1, 0}, Point{1, 1}, Point{1, 0}, Point{1, 0}, deleted_text.get(), empty_text.get()}
+  }));
+  REQUIRE(patch_without_text.get_hunks() == vector<Hunk>({
+    Hunk{Point{0, 1}, Point{0, 5}, Point{0, 1}, Point{0, 6}, nullptr, nullptr},
+    Hunk{Point{1, 0}, Point{1, 1}, Point{1, 0}, Point{1, 0}, deleted_text.get(), empty_text.get()}
+  }));
+}
+
+TEST_CASE("Splits patches at a position and concatenates them back") {
+  srand(11);
+  for (unsigned trial = 0; trial < 300; trial++) {
+    Text document = get_random_text(200);
+    Patch patch(trial % 2 == 0);
+    for (unsigned i = 0, splice_count = rand() % 30; i < splice_count; i++) {
+      splice_randomly(patch, document);
+    }
+
+    // Split a copy, so that the patches share their nodes.
+    auto hunks = patch.get_hunks();
+    Patch first = patch.copy();
+    Point position = get_position(document, rand() % (document.size() + 1));
+    bool in_old_space = rand() % 2 == 0;
+    Patch second = in_old_space ? first.split_at_old_position(position) : first.split_at_new_position(position);
+
+    size_t split_index = 0;
+    while (split_index < hunks.size() &&
+           (in_old_space ? hunks[split_index].old_end : hunks[split_index].new_end) <= position) {
+      split_index++;
+    }
+    REQUIRE(first.get_hunks() == vector<Hunk>(hunks.begin(), hunks.begin() + split_index));
+    REQUIRE(second.get_hunks() == vector<Hunk>(hunks.begin() + split_index, hunks.end()));
+    REQUIRE(first.get_hunk_count() == split_index);
+    REQUIRE(second.get_hunk_count() == hunks.size() - split_index);
+
+    // Concatenate the halves back, once as they are and once after copying the
+    // second half with its copy still alive, so that its nodes must be copied.
+    unique_ptr<Patch> first_copy{new Patch(first.copy())};
+    unique_ptr<Patch> second_copy{new Patch(second.copy())};
+    optional<Patch> concatenated_patch = Patch::concat(std::move(first), std::move(second));
+    REQUIRE(concatenated_patch);
+    REQUIRE((*concatenated_patch).get_hunks() == hunks);
+    REQUIRE((*concatenated_patch).get_hunk_count() == hunks.size());
+    REQUIRE(first.get_hunk_count() == 0);
+    REQUIRE(second.get_hunks().empty());
+
+    unique_ptr<Patch> copy_of_second_copy{new Patch(second_copy->copy())};
+    optional<Patch> concatenated_copies = Patch::concat(
+      trial % 2 == 0 ? Patch::from_hunks(first_copy->get_hunks()) : std::move(*first_copy),
+      std::move(*second_copy)
+    );
+    REQUIRE(concatenated_copies);
+    if (trial % 2 != 0) REQUIRE(first_copy->get_hunks().empty());
+    REQUIRE(second_copy->get_hunks().empty());
+    REQUIRE(second_copy->get_hunk_count() == 0);
+    first_copy.reset();
+    second_copy.reset();
+    copy_of_second_copy.reset();
+    REQUIRE((*concatenated_copies).get_hunks() == hunks);
+  }
+
+  // Patches of separate regions of the same text.
+  Patch first, second;
+  first.splice(Point{0, 1}, Point{0, 1}, Point{1, 0}, GetText("b"), GetText("\n"));
+  second.splice(Point{0, 3}, Point{0, 1}, Point{0, 2}, GetText("d"), GetText("DD"));
+  Patch overlapping = second.copy();
+  optional<Patch> concatenated_patch = Patch::concat(std::move(first), std::move(second));
+  unique_ptr<Text> b = GetText("b"), newline = GetText("\n"), d = GetText("d"), dd = GetText("DD");
+  REQUIRE((*concatenated_patch).get_hunks() == vector<Hunk>({
+    Hunk{Point{0, 1}, Point{0, 2}, Point{0, 1}, Point{1, 0}, b.get(), newline.get()},
+    Hunk{Point{0, 3}, Point{0, 4}, Point{1, 1}, Point{1, 3}, d.get(), dd.get()}
+  }));
+  REQUIRE(!Patch::concat(std::move(*concatenated_patch), std::move(overlapping)));
+  REQUIRE((*concatenated_patch).get_hunk_count() == 2);
+
+  // Hunks that meet at the boundary are merged, unless the patch keeps
+  // adjacent hunks apart.
+  for (bool merges_adjacent_hunks : {true, false}) {
+    Patch first(merges_adjacent_hunks), second;
+    first.splice(Point{0, 1}, Point{0, 1}, Point{0, 1}, GetText("b"), GetText("B"));
+    second.splice(Point{0, 2}, Point{0, 1}, Point{0, 1}, GetText("c"), GetText("C"));
+    optional<Patch> patch = Patch::concat(std::move(first), std::move(second));
+    REQUIRE((*patch).get_hunk_count() == (merges_adjacent_hunks ? 1 : 2));
+    REQUIRE(*(*patch).apply(*GetText("abcd")) == *GetText("aBCd"));
+  }
+}
+
+TEST_CASE("Transforms a patch to apply after a concurrent one") {
+  srand(12);
+  for (unsigned trial = 0; trial < 3000; trial++) {
+    Text original_document = get_random_text(50);
+    Text document_a = original_document, document_b = original_document;
+    Patch a(trial % 2 == 0), b(trial % 3 == 0);
+    for (unsigned i = 0, splice_count = rand() % 20; i < splice_count; i++) {
+      splice_randomly(a, document_a, 5);
+    }
+    for (unsigned i = 0, splice_count = rand() % 20; i < splice_count; i++) {
+      splice_randomly(b, document_b, 5);
+    }
+
+    // Each transformed patch must match the text it is applied to.
+    optional<Text> document_ab = Patch::transform(a, b).apply(document_a);
+    optional<Text> document_ba = Patch::transform(b, a).apply(document_b);
+    REQUIRE(document_ab);
+    REQUIRE(document_ba);
+
+    // Both orders converge, except that text inserted by both patches at the
+    // same position is ordered by which patch was transformed.
+    bool has_tie = false;
+    for (const Hunk &hunk_a : a.get_hunks()) {
+      for (const Hunk &hunk_b : b.get_hunks()) {
+        if (hunk_a.old_start == hunk_b.old_start &&
+            !(hunk_a.new_start == hunk_a.new_end) && !(hunk_b.new_start == hunk_b.new_end)) {
+          has_tie = true;
+        }
+      }
+    }
+    if (has_tie) {
+      REQUIRE((*document_ab).size() == (*document_ba).size());
+    } else {
+      REQUIRE(*document_ab == *document_ba);
+    }
+
+    // Agreeing that the text inserted by `a` comes first, they always do.
+    optional<Text> converged_document_ba =
+      Patch::transform(b, a, Patch::InsertionOrder::BFirst).apply(document_b);
+    REQUIRE(converged_document_ba);
+    REQUIRE(*converged_document_ba == *document_ab);
+    REQUIRE(*Patch::transform(a, b, Patch::InsertionOrder::BFirst).apply(document_a) == *document_ba);
+  }
+
+  // Over "abcdef", `a` replaces "b" with "XX" and inserts "P" before "f",
+  // while `b` replaces "abc" with "Y" and inserts "Z" before "f".
+  unique_ptr<Text> b_text = GetText("b"), xx_text = GetText("XX"), p_text = GetText("P");
+  unique_ptr<Text> abc_text = GetText("abc"), y_text = GetText("Y"), z_text = GetText("Z");
+  unique_ptr<Text> empty_text = GetText("");
+  Patch a = Patch::from_hunks({
+    Hunk{Point{0, 1}, Point{0, 2}, Point{0, 1}, Point{0, 3}, b_text.get(), xx_text.get()},
+    Hunk{Point{0, 5}, Point{0, 5}, Point{0, 6}, Point{0, 7}, empty_text.get(), p_text.get()}
+  });
+  Patch b = Patch::from_hunks({
+    Hunk{Point{0, 0}, Point{0, 3}, Point{0, 0}, Point{0, 1}, abc_text.get(), y_text.get()},
+    Hunk{Point{0, 5}, Point{0, 5}, Point{0, 3}, Point{0, 4}, empty_text.get(), z_text.get()}
+  });
+
+  // The "XX" inserted by `a` survives the deletion of "abc", splitting it in
+  // two, and "P" precedes "Z".
+  Patch transformed_b = Patch::transform(a, b);
+  unique_ptr<Text> a_text = GetText("a"), c_text = GetText("c");
+  REQUIRE(transformed_b.get_hunks() == vector<Hunk>({
+    Hunk{Point{0, 0}, Point{0, 1}, Point{0, 0}, Point{0, 1}, a_text.get(), y_text.get()},
+    Hunk{Point{0, 3}, Point{0, 4}, Point{0, 3}, Point{0, 3}, c_text.get(), empty_text.get()},
+    Hunk{Point{0, 7}, Point{0, 7}, Point{0, 6}, Point{0, 7}, empty_text.get(), z_text.get()}
+  }));
+  REQUIRE(*transformed_b.apply(*a.apply(*GetText("abcdef"))) == *GetText("YXXdePZf"));
+  REQUIRE(*Patch::transform(b, a).apply(*b.apply(*GetText("abcdef"))) == *GetText("YXXdeZPf"));
+  REQUIRE(*Patch::transform(b, a, Patch::InsertionOrder::BFirst).apply(*b.apply(*GetText("abcdef"))) ==
+          *GetText("YXXdePZf"));
+  REQUIRE(*Patch::transform(a, b, Patch::InsertionOrder::BFirst).apply(*a.apply(*GetText("abcdef"))) ==
+          *GetText("YXXdeZPf"));
+}
+
+TEST_CASE("Translates batches of positions through a patch") {
+  typedef Patch::ClipMode ClipMode;
+
+  // Maps a position through the one hunk that starts at or before it, the
+  // way positions were translated one at a time.
+  auto translate_position = [](Patch &patch, Point position, ClipMode clip_mode, bool from_old) {
+    optional<Hunk> hunk = from_old ? patch.hunk_for_old_position(position) : patch.hunk_for_new_position(position);
+    if (!hunk) return position;
+    Point source_start = from_old ? (*hunk).old_start : (*hunk).new_start;
+    Point source_end = from_old ? (*hunk).old_end : (*hunk).new_end;
+    Point target_start = from_old ? (*hunk).new_start : (*hunk).old_start;
+    Point target_end = from_old ? (*hunk).new_end : (*hunk).old_end;
+    if (source_end < position ||
+        (source_end == position && (source_start < source_end || clip_mode == ClipMode::Forward))) {
+      return target_end.traverse(position.traversal(source_end));
+    }
+    if (source_start == position) return target_start;
+    return clip_mode == ClipMode::Backward ? target_start : target_end;
+  };
+
+  srand(13);
+  for (unsigned trial = 0; trial < 200; trial++) {
+    Patch patch(true);
+    for (unsigned i = 0, splice_count = rand() % 20; i < splice_count; i++) {
+      patch.splice(Point(rand() % 10, rand() % 10), Point(rand() % 2, rand() % 5), Point(rand() % 2, rand() % 5));
+    }
+
+    vector<Point> positions;
+    for (unsigned i = 0; i < 50; i++) positions.push_back(Point(rand() % 12, rand() % 12));
+    std::sort(positions.begin(), positions.end());
+
+    for (ClipMode clip_mode : {ClipMode::Backward, ClipMode::Forward}) {
+      for (bool from_old : {true, false}) {
+        vector<Point> translated_positions = from_old ?
+          patch.translate_old_positions(positions, clip_mode) :
+          patch.translate_new_positions(positions, clip_mode);
+        REQUIRE(translated_positions.size() == positions.size());
+        for (size_t i = 0; i < positions.size(); i++) {
+          REQUIRE(translated_positions[i] == translate_position(patch, positions[i], clip_mode, from_old));
+        }
+
+        // Unsorted positions are translated the same way, only more slowly.
+        vector<Point> reversed_positions(positions.rbegin(), positions.rend());
+        vector<Point> reversed_translations = from_old ?
+          patch.translate_old_positions(reversed_positions, clip_mode) :
+          patch.translate_new_positions(reversed_positions, clip_mode);
+        REQUIRE(vector<Point>(reversed_translations.rbegin(), reversed_translations.rend()) ==
+                translated_positions);
+      }
+    }
+  }
+
+  // Without merging, a hunk that only inserts text can follow one that ends
+  // at the same position, which stays at the end of the earlier hunk.
+  Patch patch(false);
+  patch.splice(Point{0, 2}, Point{0, 2}, Point{0, 1});
+  patch.splice(Point{0, 3}, Point{0, 0}, Point{0, 3});
+  vector<Point> positions{Point{0, 1}, Point{0, 2}, Point{0, 3}, Point{0, 4}, Point{0, 5}};
+  REQUIRE(patch.translate_old_positions(positions, ClipMode::Backward) == vector<Point>({
+    Point{0, 1}, Point{0, 2}, Point{0, 2}, Point{0, 3}, Point{0, 7}
+  }));
+  REQUIRE(patch.translate_old_positions(positions, ClipMode::Forward) == vector<Point>({
+    Point{0, 1}, Point{0, 2}, Point{0, 3}, Point{0, 6}, Point{0, 7}
+  }));
+  REQUIRE(patch.translate_new_positions({Point{0, 4}, Point{0, 7}}, ClipMode::Backward) == vector<Point>({
+    Point{0, 4}, Point{0, 5}
+  }));
+}
+
+TEST_CASE("Keeps change statistics for the hunks in any range") {
+  typedef Patch::ChangeStatistics ChangeStatistics;
+
+  // Sums up the hunks that start in the given range, the way the statistics
+  // were computed from the full list of hunks.
+  auto get_statistics = [](const vector<Hunk> &hunks, bool in_old_space, Point start, Point end) {
+    ChangeStatistics result{0, 0, 0, 0, 0};
+    int64_t last_old_row = -1, last_new_row = -1;
+    for (const Hunk &hunk : hunks) {
+      Point hunk_start = in_old_space ? hunk.old_start : hunk.new_start;
+      if (hunk_start < start || !(hunk_start < end)) continue;
+      result.hunk_count++;
+      result.old_text_size += hunk.old_text.size();
+      result.new_text_size += hunk.new_text.size();
+      result.old_changed_row_count += hunk.old_end.row - hunk.old_start.row + 1;
+      result.new_changed_row_count += hunk.new_end.row - hunk.new_start.row + 1;
+      if (last_old_row == hunk.old_start.row) result.old_changed_row_count--;
+      if (last_new_row == hunk.new_start.row) result.new_changed_row_count--;
+      last_old_row = hunk.old_end.row;
+      last_new_row = hunk.new_end.row;
+    }
+    return result;
+  };
+
+  auto verify_statistics = [&](const Patch &patch) {
+    vector<Hunk> hunks = patch.get_hunks();
+    REQUIRE(patch.get_change_statistics() == get_statistics(hunks, true, Point(), Point(UINT32_MAX, UINT32_MAX)));
+    for (unsigned i = 0; i < 10; i++) {
+      Point start(rand() % 12, rand() % 12);
+      Point end = start.traverse(Point(rand() % 6, rand() % 12));
+      if (i == 0) start = Point();
+      REQUIRE(patch.get_change_statistics_in_old_range(start, end) == get_statistics(hunks, true, start, end));
+      REQUIRE(patch.get_change_statistics_in_new_range(start, end) == get_statistics(hunks, false, start, end));
+    }
+  };
+
+  auto get_random_text = [](Point extent) {
+    Text text;
+    for (uint32_t row = 0; row < extent.row; row++) text.push_back('\n');
+    for (uint32_t column = 0; column < extent.column; column++) text.push_back('a' + rand() % 26);
+    return text;
+  };
+
+  srand(14);
+  for (unsigned trial = 0; trial < 200; trial++) {
+    Patch patch(trial % 2 == 0);
+    vector<Patch> copies;
+    for (unsigned i = 0, splice_count = rand() % 30; i < splice_count; i++) {
+      Point start(rand() % 10, rand() % 10);
+      Point deletion_extent(rand() % 2, rand() % 5);
+      Point insertion_extent(rand() % 2, rand() % 5);
+      switch (rand() % 8) {
+      case 0:
+        patch.splice_old(start, deletion_extent, insertion_extent);
+        break;
+      case 1:
+        patch.splice(start, deletion_extent, insertion_extent);
+        break;
+      case 2:
+        // Inserts text and deletes it again, which may leave an empty hunk
+        // that has to be removed.
+        patch.splice(start, Point(), insertion_extent);
+        patch.splice(start, insertion_extent, Point());
+        break;
+      case 3:
+        copies.push_back(patch.copy());
+        break;
+      default: {
+        unique_ptr<Text> deleted_text{new Text(get_random_text(deletion_extent))};
+        unique_ptr<Text> inserted_text{new Text(get_random_text(insertion_extent))};
+        patch.splice(start, deletion_extent, insertion_extent, std::move(deleted_text), std::move(inserted_text));
+      }
+      }
+    }
+
+    verify_statistics(patch);
+    for (const Patch &copy : copies) verify_statistics(copy);
+
+    Patch inverted_patch = patch.invert();
+    verify_statistics(inverted_patch);
+
+    vector<uint8_t> serialization_vector;
+    patch.serialize(&serialization_vector);
+    verify_statistics(Patch(serialization_vector));
+
+    Point position(rand() % 12, rand() % 12);
+    Patch second = patch.split_at_new_position(position);
+    verify_statistics(patch);
+    verify_statistics(second);
+    optional<Patch> concatenated_patch = Patch::concat(std::move(patch), std::move(second));
+    verify_statistics(*concatenated_patch);
+
+    (*concatenated_patch).rebalance();
+    verify_statistics(*concatenated_patch);
+    (*concatenated_patch).coalesce(Point(1, 0));
+    verify_statistics(*concatenated_patch);
+  }
+
+  // Rows shared by neighboring hunks count once.
+  Patch patch;
+  patch.splice(Point{0, 1}, Point{0, 1}, Point{1, 1}, GetText("b"), GetText("\nB"));
+  patch.splice(Point{1, 3}, Point{1, 1}, Point{0, 2}, GetText("d\ne"), GetText("DE"));
+  patch.splice(Point{3, 0}, Point{0, 0}, Point{0, 1}, GetText(""), GetText("F"));
+  REQUIRE(patch.get_change_statistics() == (ChangeStatistics{3, 4, 5, 3, 3}));
+  REQUIRE(patch.get_change_statistics_in_new_range(Point(), Point{2, 0}) == (ChangeStatistics{2, 4, 4, 2, 2}));
+  REQUIRE(patch.get_change_statistics_in_old_range(Point{0, 2}, Point{4, 0}) == (ChangeStatistics{2, 3, 3, 3, 2}));
+}
+
+TEST_CASE("Splices bursts of typing within the hunk that was last spliced") {
+  srand(15);
+  for (unsigned trial = 0; trial < 300; trial++) {
+    bool merges_adjacent_hunks = trial % 2 == 0;
+    Patch patch(merges_adjacent_hunks);
+    Text original_document = get_random_text(60, 6);
+    Text document = original_document;
+    size_t cursor = rand() % (document.size() + 1);
+    for (unsigned i = 0; i < 60; i++) {
+      // Mostly type or delete characters at the cursor, and occasionally
+      // replace text or move the cursor elsewhere.
+      size_t start_index = cursor, end_index = cursor;
+      Text inserted_text;
+      unsigned action = rand() % 10;
+      if (action == 0) cursor = start_index = end_index = rand() % (document.size() + 1);
+      if (action < 6) {
+        inserted_text = get_random_text(1, 6);
+      } else if (action < 9) {
+        if (cursor == 0) continue;
+        start_index--;
+      } else {
+        end_index = std::min(document.size(), cursor + rand() % 3);
+        inserted_text = get_random_text(rand() % 3, 6);
+      }
+
+      splice_document(patch, document, start_index, end_index, inserted_text);
+      cursor = start_index + inserted_text.size();
+
+      // Lookups near the cursor agree with those that descend from the root.
+      Point position = get_position(document, std::min(document.size(), cursor + rand() % 3));
+      optional<Hunk> hunk = patch.hunk_for_new_position(position);
+      optional<Hunk> expected_hunk = static_cast<const Patch &>(patch).hunk_for_new_position(position);
+      REQUIRE(bool(hunk) == bool(expected_hunk));
+      if (hunk) REQUIRE(*hunk == *expected_hunk);
+    }
+
+    REQUIRE(*patch.apply(original_document) == document);
+    REQUIRE(*patch.apply_inverse(document) == original_document);
+    auto hunks = patch.get_hunks();
+    for (size_t i = 1; i < hunks.size(); i++) {
+      REQUIRE(hunks[i - 1].new_end <= hunks[i].new_start);
+      if (merges_adjacent_hunks) REQUIRE(hunks[i - 1].new_end < hunks[i].new_start);
+    }
+    REQUIRE(patch.get_hunk_count() == hunks.size());
+  }
+}
+
+TEST_CASE("Records the same hunks with either backend") {
+  auto get_random_text = [](Point extent) {
+    unique_ptr<Text> text{new Text()};
+    for (uint32_t row = 0; row < extent.row; row++) text->push_back('\n');
+    for (uint32_t column = 0; column < extent.column; column++) text->push_back('a' + rand() % 26);
+    return text;
+  };
+
+  auto verify_same_hunks = [](const Patch &patch, const Patch &expected_patch, uint32_t row_count) {
+    REQUIRE(patch.get_hunks() == expected_patch.get_hunks());
+    REQUIRE(patch.get_hunk_count() == expected_patch.get_hunk_count());
+    REQUIRE(patch.get_change_statistics() == expected_patch.get_change_statistics());
+    for (unsigned i = 0; i < 5; i++) {
+      Point start(rand() % row_count, rand() % 12);
+      Point end = start.traverse(Point(rand() % (row_count / 4 + 1), rand() % 12));
+      REQUIRE(patch.get_hunks_in_old_range(start, end) == expected_patch.get_hunks_in_old_range(start, end));
+      REQUIRE(patch.get_hunks_in_new_range(start, end, i % 2) ==
+              expected_patch.get_hunks_in_new_range(start, end, i % 2));
+      REQUIRE(patch.get_change_statistics_in_old_range(start, end) ==
+              expected_patch.get_change_statistics_in_old_range(start, end));
+      REQUIRE(patch.get_change_statistics_in_new_range(start, end) ==
+              expected_patch.get_change_statistics_in_new_range(start, end));
+
+      optional<Hunk> hunk = patch.hunk_for_old_position(start);
+      optional<Hunk> expected_hunk = expected_patch.hunk_for_old_position(start);
+      REQUIRE(bool(hunk) == bool(expected_hunk));
+      if (hunk) REQUIRE(*hunk == *expected_hunk);
+      hunk = patch.hunk_for_new_position(end);
+      expected_hunk = expected_patch.hunk_for_new_position(end);
+      REQUIRE(bool(hunk) == bool(expected_hunk));
+      if (hunk) REQUIRE(*hunk == *expected_hunk);
+    }
+  };
+
+  srand(16);
+  for (unsigned trial = 0; trial < 40; trial++) {
+    bool merges_adjacent_hunks = trial % 2 == 0;
+    // Some trials are dense with overlapping splices, and the others record
+    // enough hunks to grow the B+ tree several levels deep.
+    uint32_t row_count = trial % 4 < 2 ? 10 : 1000;
+    unsigned splice_count = trial % 4 < 2 ? 200 : 4000;
+    Patch patch(merges_adjacent_hunks, Patch::Backend::BTree);
+    Patch expected_patch(merges_adjacent_hunks);
+    REQUIRE(patch.get_backend() == Patch::Backend::BTree);
+    REQUIRE(expected_patch.get_backend() == Patch::Backend::SplayTree);
+
+    for (unsigned i = 0; i < splice_count; i++) {
+      Point start(rand() % row_count, rand() % 10);
+      Point deletion_extent(rand() % 3 == 0 ? 1 : 0, rand() % 5);
+      Point insertion_extent(rand() % 3 == 0 ? 1 : 0, rand() % 5);
+      switch (rand() % 6) {
+      case 0:
+        patch.splice_old(start, deletion_extent, insertion_extent);
+        expected_patch.splice_old(start, deletion_extent, insertion_extent);
+        break;
+      case 1:
+        patch.splice(start, deletion_extent, insertion_extent);
+        expected_patch.splice(start, deletion_extent, insertion_extent);
+        break;
+      case 2:
+        patch.splice(start, Point(), insertion_extent);
+        patch.splice(start, insertion_extent, Point());
+        expected_patch.splice(start, Point(), insertion_extent);
+        expected_patch.splice(start, insertion_extent, Point());
+        break;
+      default: {
+        unique_ptr<Text> deleted_text = get_random_text(deletion_extent);
+        unique_ptr<Text> inserted_text = get_random_text(insertion_extent);
+        patch.splice(start, deletion_extent, insertion_extent,
+                     unique_ptr<Text>{new Text(*deleted_text)}, unique_ptr<Text>{new Text(*inserted_text)});
+        expected_patch.splice(start, deletion_extent, insertion_extent,
+                              std::move(deleted_text), std::move(inserted_text));
+      }
+      }
+      if (i % (splice_count / 10) == 0) verify_same_hunks(patch, expected_patch, row_count);
+    }
+    verify_same_hunks(patch, expected_patch, row_count);
+
+    vector<Patch::Splice> splices, expected_splices;
+    Point position;
+    for (unsigned i = 0; i < 20; i++) {
+      Point start = position.traverse(Point(rand() % 3 == 0 ? 1 : 0, rand() % 4));
+      Point deletion_extent(0, rand() % 3), insertion_extent(0, rand() % 3);
+      splices.push_back(Patch::Splice{start, deletion_extent, insertion_extent,
+                                      get_random_text(deletion_extent), get_random_text(insertion_extent)});
+      expected_splices.push_back(Patch::Splice{start, deletion_extent, insertion_extent,
+                                               unique_ptr<Text>{new Text(*splices.back().deleted_text)},
+                                               unique_ptr<Text>{new Text(*splices.back().inserted_text)}});
+      position = start.traverse(deletion_extent);
+    }
+    REQUIRE(patch.splice_batch(move(splices)));
+    REQUIRE(expected_patch.splice_batch(move(expected_splices)));
+    verify_same_hunks(patch, expected_patch, row_count);
+
+    Patch copy = patch.copy();
+    REQUIRE(copy.get_backend() == Patch::Backend::BTree);
+    verify_same_hunks(copy, expected_patch, row_count);
+    verify_same_hunks(patch.invert(), expected_patch.invert(), row_count);
+
+    vector<uint8_t> serialization;
+    patch.serialize(&serialization);
+    verify_same_hunks(Patch(serialization), expected_patch, row_count);
+
+    Text old_text;
+    for (uint32_t row = 0; row < row_count * 2; row++) {
+      old_text.insert(old_text.end(), {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', '\n'});
+    }
+    optional<Text> new_text = patch.apply(old_text);
+    optional<Text> expected_new_text = expected_patch.apply(old_text);
+    REQUIRE(bool(new_text) == bool(expected_new_text));
+    if (new_text) REQUIRE(*new_text == *expected_new_text);
+
+    Point split_position(rand() % row_count, rand() % 12);
+    Patch second = patch.split_at_new_position(split_position);
+    Patch expected_second = expected_patch.split_at_new_position(split_position);
+    REQUIRE(second.get_backend() == Patch::Backend::BTree);
+    verify_same_hunks(patch, expected_patch, row_count);
+    verify_same_hunks(second, expected_second, row_count);
+    optional<Patch> concatenated_patch = Patch::concat(std::move(patch), std::move(second));
+    optional<Patch> expected_concatenated_patch =
+      Patch::concat(std::move(expected_patch), std::move(expected_second));
+    verify_same_hunks(*concatenated_patch, *expected_concatenated_patch, row_count);
+    REQUIRE(patch.get_hunk_count() == 0);
+    REQUIRE(second.get_hunks().empty());
+
+    for (unsigned i = 0; i < 3; i++) {
+      Point position(rand() % row_count, rand() % 12);
+      Patch first_part = (*concatenated_patch).copy();
+      Patch expected_first_part = (*expected_concatenated_patch).copy();
+      Patch second_part = first_part.split_at_old_position(position);
+      Patch expected_second_part = expected_first_part.split_at_old_position(position);
+      verify_same_hunks(first_part, expected_first_part, row_count);
+      verify_same_hunks(second_part, expected_second_part, row_count);
+    }
+
+    for (Point max_distance : {Point(), Point(0, 1), Point(1, 0)}) {
+      Patch coalesced_patch = (*concatenated_patch).copy();
+      Patch expected_coalesced_patch = (*expected_concatenated_patch).copy();
+      coalesced_patch.coalesce(max_distance);
+      expected_coalesced_patch.coalesce(max_distance);
+      verify_same_hunks(coalesced_patch, expected_coalesced_patch, row_count);
+    }
+
+    (*concatenated_patch).coalesce(Point(0, 3));
+    (*expected_concatenated_patch).coalesce(Point(0, 3));
+    verify_same_hunks(*concatenated_patch, *expected_concatenated_patch, row_count);
+
+    // Splicing into the copy doesn't affect the original patch.
+    vector<Hunk> copied_hunks = copy.get_hunks();
+    Patch copy_of_copy = copy.copy();
+    for (unsigned i = 0; i < 50; i++) {
+      copy_of_copy.splice(Point(rand() % row_count, rand() % 10), Point(0, rand() % 5), Point(0, rand() % 5),
+                          get_random_text(Point(0, 0)), get_random_text(Point(0, 2)));
+    }
+    REQUIRE(copy.get_hunks() == copied_hunks);
+  }
+
+  // Empty hunks are dropped by either backend, whether coalescing merges
+  // anything or not, and splitting and concatenating don't bring them back.
+  vector<Hunk> hunks{
+    Hunk{Point{1, 0}, Point{1, 2}, Point{1, 0}, Point{3, 0}, nullptr, nullptr},
+    Hunk{Point{4, 5}, Point{4, 5}, Point{6, 5}, Point{6, 5}, nullptr, nullptr},
+    Hunk{Point{8, 0}, Point{8, 1}, Point{10, 0}, Point{11, 0}, nullptr, nullptr}
+  };
+  for (Point max_distance : {Point(), Point(0, 1), Point(3, 0)}) {
+    Patch patch = Patch::from_hunks(hunks, Patch::Backend::BTree);
+    Patch expected_patch = Patch::from_hunks(hunks);
+    REQUIRE(patch.get_hunk_count() == 2);
+    verify_same_hunks(patch, expected_patch, 12);
+    patch.coalesce(max_distance);
+    expected_patch.coalesce(max_distance);
+    verify_same_hunks(patch, expected_patch, 12);
+
+    Patch second = patch.split_at_new_position(Point{6, 5});
+    Patch expected_second = expected_patch.split_at_new_position(Point{6, 5});
+    verify_same_hunks(second, expected_second, 12);
+    optional<Patch> concatenated_patch = Patch::concat(std::move(patch), std::move(second));
+    optional<Patch> expected_concatenated_patch =
+      Patch::concat(std::move(expected_patch), std::move(expected_second));
+    verify_same_hunks(*concatenated_patch, *expected_concatenated_patch, 12);
+  }
+}
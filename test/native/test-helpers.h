@@ -2,30 +2,32 @@
 #define SUPERSTRING_TEST_HELPERS_H
 
 #include "patch.h"
+#include "serializer.h"
+#include <algorithm>
 #include <catch.hpp>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
 #include <ostream>
 #include <vector>
 
 using std::vector;
-
-bool text_eq(const Text *left, const Text *right) {
-  if (left == right)
-    return true;
-  if (!left && right)
-    return false;
-  if (left && !right)
-    return false;
-  return *left == *right;
-}
+using std::unique_ptr;
 
 bool operator==(const Patch::Hunk &left, const Patch::Hunk &right) {
   return left.old_start == right.old_start &&
          left.new_start == right.new_start && left.old_end == right.old_end &&
          left.new_end == right.new_end &&
-         text_eq(left.old_text, right.old_text) &&
-         text_eq(left.new_text, right.new_text);
+         left.old_text == right.old_text &&
+         left.new_text == right.new_text;
+}
+
+bool operator==(const Patch::ChangeStatistics &left, const Patch::ChangeStatistics &right) {
+  return left.hunk_count == right.hunk_count &&
+         left.old_text_size == right.old_text_size &&
+         left.new_text_size == right.new_text_size &&
+         left.old_changed_row_count == right.old_changed_row_count &&
+         left.new_changed_row_count == right.new_changed_row_count;
 }
 
 std::unique_ptr<Text> GetText(const char *string) {
@@ -38,4 +40,56 @@ std::unique_ptr<Text> GetText(const char *string) {
   return std::unique_ptr<Text>(new Text(move(content)));
 }
 
+// The position of the character at `index` in `text`.
+Point get_position(const Text &text, size_t index) {
+  Point position;
+  for (size_t i = 0; i < index; i++) {
+    if (text[i] == '\n') {
+      position.row++;
+      position.column = 0;
+    } else {
+      position.column++;
+    }
+  }
+  return position;
+}
+
+// Random lowercase letters, with about one in `newline_frequency` characters
+// being a newline instead.
+Text get_random_text(unsigned length, unsigned newline_frequency = 10) {
+  Text text;
+  for (unsigned i = 0; i < length; i++) {
+    text.push_back(rand() % newline_frequency == 0 ? '\n' : 'a' + rand() % 26);
+  }
+  return text;
+}
+
+// Replaces the characters of `document` between the given indices with
+// `inserted_text`, and records the same splice in `patch`.
+void splice_document(Patch &patch, Text &document, size_t start_index, size_t end_index,
+                     const Text &inserted_text, bool records_text = true) {
+  Point start = get_position(document, start_index);
+  Point deletion_extent = get_position(document, end_index).traversal(start);
+  Point insertion_extent = get_position(inserted_text, inserted_text.size());
+  if (records_text) {
+    Text deleted_text(document.begin() + start_index, document.begin() + end_index);
+    patch.splice(start, deletion_extent, insertion_extent,
+                 unique_ptr<Text>{new Text(deleted_text)}, unique_ptr<Text>{new Text(inserted_text)});
+  } else {
+    patch.splice(start, deletion_extent, insertion_extent);
+  }
+  document.erase(document.begin() + start_index, document.begin() + end_index);
+  document.insert(document.begin() + start_index, inserted_text.begin(), inserted_text.end());
+}
+
+// Splices a random edit into both `document` and `patch`, deleting and
+// inserting fewer characters than the given limits.
+void splice_randomly(Patch &patch, Text &document, unsigned deletion_limit = 3,
+                     unsigned insertion_limit = 3, unsigned newline_frequency = 10) {
+  size_t start_index = rand() % (document.size() + 1);
+  size_t end_index = std::min(document.size(), start_index + rand() % deletion_limit);
+  splice_document(patch, document, start_index, end_index,
+                  get_random_text(rand() % insertion_limit, newline_frequency));
+}
+
 #endif // SUPERSTRING_TEST_HELPERS_H